@@ -1,15 +1,25 @@
 #version 450
 
-// Per vertex data
-layout(location = 0) in vec3 position;
-layout(location = 1) in vec3 normal;
-layout(location = 2) in vec2 uv;
+// Vertices are pulled from storage buffers instead of vertex inputs. Each face is a quad of 4 vertices, so
+// `gl_VertexIndex / 4` is the face and `gl_VertexIndex % 4` its corner, and `inInstance` is the chunk.
+//
+// A face is packed in 32 bits:
+//   bits 0-14  : position of the block in the chunk, 5 bits per axis
+//   bits 15-17 : direction of the face, see `corners`
+//   bits 18-25 : layer of the texture array
+//   bits 26-27 : gradient type
+//   bits 28-31 : visibility gradient
+layout(std430, binding = 1) readonly buffer Faces {
+    uint faces[];
+};
+
+layout(std430, binding = 2) readonly buffer Chunks {
+    ivec4 chunkOrigins[];
+};
 
-// Per instance data
-layout(location = 3) in vec3 instancePosition;
-layout(location = 4) in vec3 texture0;
-layout(location = 5) in vec3 texture1;
-layout(location = 6) in uint visibility_gradient;
+// The view matrix and the instance index of each draw, given per instance so draws of the same mesh can be merged.
+layout(location = 0) in mat4 inViewMatrix;
+layout(location = 4) in uint inInstance;
 
 layout(location = 0) out vec4 fragPos;
 layout(location = 1) out vec2 fragUV;
@@ -19,55 +29,52 @@ layout(location = 4) out uint textureIndex;
 layout(location = 5) out uint fragGradient;
 layout(location = 6) out uint fragGradientType;
 
-layout(push_constant) uniform PushConstants {
-    mat4 viewMatrix;
-};
+// Corners of the faces of a unit block, counter-clockwise seen from outside: front (+Z), back (-Z), right (+X),
+// left (-X), top (+Y) and bottom (-Y).
+const vec3 corners[24] = vec3[](
+    vec3(0.0, 0.0, 1.0), vec3(1.0, 0.0, 1.0), vec3(1.0, 1.0, 1.0), vec3(0.0, 1.0, 1.0),
+    vec3(1.0, 0.0, 0.0), vec3(0.0, 0.0, 0.0), vec3(0.0, 1.0, 0.0), vec3(1.0, 1.0, 0.0),
+    vec3(1.0, 0.0, 1.0), vec3(1.0, 0.0, 0.0), vec3(1.0, 1.0, 0.0), vec3(1.0, 1.0, 1.0),
+    vec3(0.0, 0.0, 0.0), vec3(0.0, 0.0, 1.0), vec3(0.0, 1.0, 1.0), vec3(0.0, 1.0, 0.0),
+    vec3(0.0, 1.0, 1.0), vec3(1.0, 1.0, 1.0), vec3(1.0, 1.0, 0.0), vec3(0.0, 1.0, 0.0),
+    vec3(0.0, 0.0, 0.0), vec3(1.0, 0.0, 0.0), vec3(1.0, 0.0, 1.0), vec3(0.0, 0.0, 1.0)
+);
 
-const mat4 biasMat = mat4(
-    0.5, 0.0, 0.0, 0.0,
-    0.0, 0.5, 0.0, 0.0,
-    0.0, 0.0, 1.0, 0.0,
-    0.5, 0.5, 0.0, 1.0
+const vec3 normals[6] = vec3[](
+    vec3(0.0, 0.0, 1.0),
+    vec3(0.0, 0.0, -1.0),
+    vec3(1.0, 0.0, 0.0),
+    vec3(-1.0, 0.0, 0.0),
+    vec3(0.0, 1.0, 0.0),
+    vec3(0.0, -1.0, 0.0)
 );
 
-void main() {
-    uint visibility = visibility_gradient & 255;
-    uint gradient = (visibility_gradient >> 8) & 255;
-    uint gradientType = (visibility_gradient >> 16) & 255;
+const vec2 uvs[4] = vec2[](
+    vec2(0.0, 0.0),
+    vec2(1.0, 0.0),
+    vec2(1.0, 1.0),
+    vec2(0.0, 1.0)
+);
 
-    // Discard vertices by setting the position to nan, the GPU will ignore them.
-    if (
-        ((visibility & (1 << 1)) == 0 && gl_VertexIndex >= 0 && gl_VertexIndex < 4) ||
-        ((visibility & (1 << 0)) == 0 && gl_VertexIndex >= 4 && gl_VertexIndex < 8) ||
-        ((visibility & (1 << 2)) == 0 && gl_VertexIndex >= 8 && gl_VertexIndex < 12) ||
-        ((visibility & (1 << 3)) == 0 && gl_VertexIndex >= 12 && gl_VertexIndex < 16) ||
-        ((visibility & (1 << 4)) == 0 && gl_VertexIndex >= 16 && gl_VertexIndex < 20) ||
-        ((visibility & (1 << 5)) == 0 && gl_VertexIndex >= 20 && gl_VertexIndex < 24)
-    ) {
-        float nan = 0.0 / 0.0;
-        gl_Position = vec4(nan, nan, nan, nan);
-        return;
-    }
+void main() {
+    uint face = faces[gl_VertexIndex >> 2];
+    uint corner = uint(gl_VertexIndex) & 3u;
 
-    fragGradient = gradient;
-    fragGradientType = gradientType;
+    ivec3 block = ivec3(face & 31, (face >> 5) & 31, (face >> 10) & 31);
+    uint direction = (face >> 15) & 7;
 
-    mat4 modelMatrix = mat4(
-        1.0, 0.0, 0.0, 0.0,
-        0.0, 1.0, 0.0, 0.0,
-        0.0, 0.0, 1.0, 0.0,
-        instancePosition.x, instancePosition.y, instancePosition.z, 1.0
-    );
+    vec3 position = vec3(chunkOrigins[inInstance].xyz + block) + corners[direction * 4 + corner];
 
-    gl_Position = viewMatrix * modelMatrix * vec4(position, 1.0);
+    gl_Position = inViewMatrix * vec4(position, 1.0);
 
 #ifndef DEPTH_PREPASS
-    fragPos = modelMatrix * vec4(position, 1.0);
-    fragUV = uv;
-    fragNormal = normal;
+    fragPos = vec4(position, 1.0);
+    fragUV = uvs[corner];
+    fragNormal = normals[direction];
     fragLightVec = vec3(-1.0, -1.0, 0.0);
 
-    uint textureIndices[] = uint[](uint(texture0.x), uint(texture0.y), uint(texture0.z), uint(texture1.x), uint(texture1.y), uint(texture1.z));
-    textureIndex = textureIndices[gl_VertexIndex / 4];
+    textureIndex = (face >> 18) & 255;
+    fragGradient = face >> 28;
+    fragGradientType = (face >> 26) & 3;
 #endif
 }
@@ -0,0 +1,51 @@
+#include "Chunk.hpp"
+
+#include <glm/vector_relational.hpp>
+
+uint32_t pack_face(glm::uvec3 block, FaceDirection direction, uint32_t texture, uint32_t gradient_type, uint32_t gradient)
+{
+    return block.x | block.y << 5 | block.z << 10 | (uint32_t)direction << 15 | texture << 18 | gradient_type << 26 | (gradient & 15) << 28;
+}
+
+size_t Chunk::build_faces(std::vector<uint32_t>& faces) const
+{
+    // Offset to the neighbour covering each face, in the order of `FaceDirection`.
+    static const std::array<glm::ivec3, 6> neighbours{
+        glm::ivec3(0, 0, 1),
+        glm::ivec3(0, 0, -1),
+        glm::ivec3(1, 0, 0),
+        glm::ivec3(-1, 0, 0),
+        glm::ivec3(0, 1, 0),
+        glm::ivec3(0, -1, 0),
+    };
+
+    const size_t first_face = faces.size();
+
+    for (uint32_t y = 0; y < size; y++)
+    {
+        for (uint32_t z = 0; z < size; z++)
+        {
+            for (uint32_t x = 0; x < size; x++)
+            {
+                const uint8_t block = get_block(x, y, z);
+
+                if (block == air)
+                    continue;
+
+                for (uint32_t direction = 0; direction < neighbours.size(); direction++)
+                {
+                    const glm::ivec3 neighbour = glm::ivec3(x, y, z) + neighbours[direction];
+                    const bool inside = glm::all(glm::greaterThanEqual(neighbour, glm::ivec3(0))) && glm::all(glm::lessThan(neighbour, glm::ivec3(size)));
+
+                    // Hidden faces are never sent to the GPU, instead of being discarded by the vertex shader.
+                    if (inside && get_block(neighbour.x, neighbour.y, neighbour.z) != air)
+                        continue;
+
+                    faces.push_back(pack_face(glm::uvec3(x, y, z), (FaceDirection)direction, block - 1));
+                }
+            }
+        }
+    }
+
+    return faces.size() - first_face;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+/**
+ * @brief Directions of the faces of a block, in the order expected by `voxel.vert`.
+ */
+enum class FaceDirection : uint8_t
+{
+    Front,
+    Back,
+    Right,
+    Left,
+    Top,
+    Bottom,
+};
+
+/**
+ * @brief Pack a face of a block as read by `voxel.vert`, `block` is the position of the block inside of its chunk.
+ * `gradient` is the visibility gradient, only its 4 lower bits are kept.
+ */
+uint32_t pack_face(glm::uvec3 block, FaceDirection direction, uint32_t texture, uint32_t gradient_type = 0, uint32_t gradient = 0);
+
+class Chunk
+{
+public:
+    static constexpr uint32_t size = 32;
+
+    /**
+     * @brief Block id of empty space, other ids are drawn with the layer `id - 1` of the texture array.
+     */
+    static constexpr uint8_t air = 0;
+
+    Chunk(glm::ivec3 origin)
+        : m_origin(origin)
+    {
+    }
+
+    inline glm::ivec3 origin() const
+    {
+        return m_origin;
+    }
+
+    inline uint8_t get_block(uint32_t x, uint32_t y, uint32_t z) const
+    {
+        return m_blocks[index_of(x, y, z)];
+    }
+
+    inline void set_block(uint32_t x, uint32_t y, uint32_t z, uint8_t block)
+    {
+        m_blocks[index_of(x, y, z)] = block;
+    }
+
+    /**
+     * @brief Append the faces which are not hidden by a neighbouring block and returns how many were added. Faces on
+     * the border of the chunk are always kept, the neighbouring chunks are not known here.
+     */
+    size_t build_faces(std::vector<uint32_t>& faces) const;
+
+private:
+    glm::ivec3 m_origin;
+    std::array<uint8_t, size * size * size> m_blocks = {};
+
+    static inline size_t index_of(uint32_t x, uint32_t y, uint32_t z)
+    {
+        return (size_t)x + (size_t)z * size + (size_t)y * size * size;
+    }
+};
@@ -56,6 +56,11 @@ enum class ErrorKind : uint16_t
      * @brief No GPU can be use by the engine.
      */
     NoSuitableDevice = 0x1002,
+
+    /**
+     * @brief The GPU does not support a feature needed by the operation.
+     */
+    UnsupportedFeature = 0x1003,
 };
 
 template <>
@@ -82,6 +87,9 @@ struct std::formatter<ErrorKind> : std::formatter<std::string>
         case ErrorKind::NoSuitableDevice:
             msg = "No suitable device";
             break;
+        case ErrorKind::UnsupportedFeature:
+            msg = "Unsupported feature";
+            break;
         }
 
         std::format_to(ctx.out(), "{}", msg);
@@ -0,0 +1,373 @@
+#include "Render/AllocatorVulkan.hpp"
+
+#include <bit>
+
+MemoryBlock::MemoryBlock(vk::DeviceMemory memory, vk::DeviceSize size, uint8_t *mapped)
+    : m_memory(memory), m_size(size), m_mapped(mapped)
+{
+    m_max_order = order_for(size, 1);
+    m_free.resize(m_max_order + 1);
+    m_free[m_max_order].insert(0);
+}
+
+uint8_t MemoryBlock::order_for(vk::DeviceSize size, vk::DeviceSize alignment)
+{
+    const vk::DeviceSize units = (std::max(size, alignment) + min_size - 1) / min_size;
+    return (uint8_t)std::bit_width(units - 1);
+}
+
+std::optional<vk::DeviceSize> MemoryBlock::allocate(uint8_t order, vk::DeviceSize size)
+{
+    if (order > m_max_order)
+        return std::nullopt;
+
+    uint8_t current = order;
+
+    while (current <= m_max_order && m_free[current].empty())
+        current += 1;
+
+    if (current > m_max_order)
+        return std::nullopt;
+
+    const vk::DeviceSize offset = *m_free[current].begin();
+    m_free[current].erase(m_free[current].begin());
+
+    // Split the block until it has the requested size, giving back the upper halves.
+    while (current > order)
+    {
+        current -= 1;
+        m_free[current].insert(offset + (min_size << current));
+    }
+
+    m_allocated[offset] = Allocated{.order = order, .size = size};
+    m_used += min_size << order;
+
+    return offset;
+}
+
+void MemoryBlock::free(vk::DeviceSize offset, uint8_t order)
+{
+    m_allocated.erase(offset);
+    m_used -= min_size << order;
+
+    // Merge with the buddy as long as it is free.
+    while (order < m_max_order)
+    {
+        const vk::DeviceSize buddy = offset ^ (min_size << order);
+        auto iter = m_free[order].find(buddy);
+
+        if (iter == m_free[order].end())
+            break;
+
+        m_free[order].erase(iter);
+        offset = std::min(offset, buddy);
+        order += 1;
+    }
+
+    m_free[order].insert(offset);
+}
+
+RangeAllocator::RangeAllocator(uint64_t capacity)
+    : m_capacity(capacity)
+{
+    if (capacity > 0)
+        m_free[0] = capacity;
+}
+
+std::optional<uint64_t> RangeAllocator::allocate(uint64_t size, uint64_t alignment)
+{
+    // Empty ranges do not take any space.
+    if (size == 0)
+        return 0;
+
+    for (auto iter = m_free.begin(); iter != m_free.end(); iter++)
+    {
+        const auto [begin, range_size] = *iter;
+        const uint64_t end = begin + range_size;
+        const uint64_t offset = (begin + alignment - 1) / alignment * alignment;
+
+        if (offset + size > end)
+            continue;
+
+        m_free.erase(iter);
+
+        // Give back what is left on both sides of the allocation.
+        if (offset > begin)
+            m_free[begin] = offset - begin;
+        if (offset + size < end)
+            m_free[offset + size] = end - offset - size;
+
+        m_used += size;
+
+        return offset;
+    }
+
+    return std::nullopt;
+}
+
+void RangeAllocator::free(uint64_t offset, uint64_t size)
+{
+    if (size == 0)
+        return;
+
+    m_used -= size;
+
+    auto next = m_free.lower_bound(offset);
+
+    // Merge with the following range, then with the preceding one.
+    if (next != m_free.end() && offset + size == next->first)
+    {
+        size += next->second;
+        next = m_free.erase(next);
+    }
+
+    if (next != m_free.begin())
+    {
+        auto prev = std::prev(next);
+
+        if (prev->first + prev->second == offset)
+        {
+            prev->second += size;
+            return;
+        }
+    }
+
+    m_free[offset] = size;
+}
+
+uint64_t RangeAllocator::largest_free() const
+{
+    uint64_t largest = 0;
+
+    for (const auto& [offset, size] : m_free)
+        largest = std::max(largest, size);
+
+    return largest;
+}
+
+void MemoryAllocator::initialize(vk::Device device, const vk::PhysicalDeviceMemoryProperties& memory_properties)
+{
+    m_device = device;
+    m_memory_properties = memory_properties;
+}
+
+void MemoryAllocator::destroy()
+{
+    for (auto& pool : m_pools)
+    {
+        for (auto& block : pool.blocks)
+        {
+            if (block)
+                m_device.freeMemory(block->memory());
+        }
+
+        pool.blocks.clear();
+    }
+}
+
+Expected<vk::DeviceMemory> MemoryAllocator::allocate_device_memory(vk::DeviceSize size, uint32_t memory_type, uint8_t **mapped)
+{
+    auto memory_result = m_device.allocateMemory(vk::MemoryAllocateInfo(size, memory_type));
+    YEET_RESULT(memory_result);
+
+    *mapped = nullptr;
+
+    if (m_memory_properties.memoryTypes[memory_type].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible)
+    {
+        auto map_result = m_device.mapMemory(memory_result.value, 0, size, {});
+
+        if (map_result.result != vk::Result::eSuccess)
+        {
+            m_device.freeMemory(memory_result.value);
+            return std::unexpected(map_result.result);
+        }
+
+        *mapped = (uint8_t *)map_result.value;
+    }
+
+    m_reserved += size;
+    m_peak_reserved = std::max(m_peak_reserved, m_reserved);
+
+    return memory_result.value;
+}
+
+Expected<MemoryAllocation> MemoryAllocator::allocate(const vk::MemoryRequirements& requirements, uint32_t memory_type, bool linear)
+{
+    MemoryAllocation allocation{
+        .size = requirements.size,
+        .padded_size = requirements.size,
+        .memory_type = memory_type,
+        .linear = linear,
+    };
+
+    // Large resources would waste most of a block, give them their own memory.
+    if (requirements.size > block_size / 2)
+    {
+        auto memory_result = allocate_device_memory(requirements.size, memory_type, &allocation.ptr);
+        YEET(memory_result);
+
+        allocation.memory = memory_result.value();
+        allocation.block = MemoryAllocation::dedicated_block;
+
+        m_dedicated_count += 1;
+        m_dedicated_size += requirements.size;
+        m_allocation_count += 1;
+        m_requested += requirements.size;
+        m_peak_requested = std::max(m_peak_requested, m_requested);
+
+        return allocation;
+    }
+
+    Pool& pool = pool_for(memory_type, linear);
+    const uint8_t order = MemoryBlock::order_for(requirements.size, requirements.alignment);
+
+    std::optional<vk::DeviceSize> offset;
+    size_t block_index = 0;
+    size_t hole = pool.blocks.size();
+
+    for (; block_index < pool.blocks.size(); block_index++)
+    {
+        if (!pool.blocks[block_index])
+        {
+            hole = std::min(hole, block_index);
+            continue;
+        }
+
+        offset = pool.blocks[block_index]->allocate(order, requirements.size);
+
+        if (offset.has_value())
+            break;
+    }
+
+    if (!offset.has_value())
+    {
+        uint8_t *mapped;
+
+        auto memory_result = allocate_device_memory(block_size, memory_type, &mapped);
+        YEET(memory_result);
+
+        block_index = hole;
+
+        if (block_index == pool.blocks.size())
+            pool.blocks.push_back(nullptr);
+
+        pool.blocks[block_index] = std::make_unique<MemoryBlock>(memory_result.value(), block_size, mapped);
+        offset = pool.blocks[block_index]->allocate(order, requirements.size);
+    }
+
+    const MemoryBlock& block = *pool.blocks[block_index];
+
+    allocation.memory = block.memory();
+    allocation.offset = offset.value();
+    allocation.ptr = block.mapped() ? block.mapped() + offset.value() : nullptr;
+    allocation.block = block_index;
+    allocation.order = order;
+    allocation.padded_size = MemoryBlock::min_size << order;
+
+    m_allocation_count += 1;
+    m_requested += requirements.size;
+    m_peak_requested = std::max(m_peak_requested, m_requested);
+
+    return allocation;
+}
+
+void MemoryAllocator::free(const MemoryAllocation& allocation)
+{
+    if (!allocation.memory)
+        return;
+
+    m_allocation_count -= 1;
+    m_requested -= allocation.size;
+
+    if (allocation.block == MemoryAllocation::dedicated_block)
+    {
+        m_dedicated_count -= 1;
+        m_dedicated_size -= allocation.size;
+        m_reserved -= allocation.size;
+
+        m_device.freeMemory(allocation.memory);
+        return;
+    }
+
+    Pool& pool = pool_for(allocation.memory_type, allocation.linear);
+    pool.blocks[allocation.block]->free(allocation.offset, allocation.order);
+}
+
+void MemoryAllocator::trim()
+{
+    for (auto& pool : m_pools)
+    {
+        for (auto& block : pool.blocks)
+        {
+            if (block && block->used() == 0)
+            {
+                m_reserved -= block->size();
+                m_device.freeMemory(block->memory());
+                block = nullptr;
+            }
+        }
+    }
+}
+
+std::vector<MemoryAllocation> MemoryAllocator::defragmentation_candidates(float max_usage) const
+{
+    std::vector<MemoryAllocation> candidates;
+
+    for (size_t pool_index = 0; pool_index < m_pools.size(); pool_index++)
+    {
+        const Pool& pool = m_pools[pool_index];
+
+        for (size_t block_index = 0; block_index < pool.blocks.size(); block_index++)
+        {
+            const auto& block = pool.blocks[block_index];
+
+            if (!block || block->used() == 0 || (float)block->used() / (float)block->size() > max_usage)
+                continue;
+
+            for (const auto& [offset, allocated] : block->allocations())
+            {
+                candidates.push_back(MemoryAllocation{
+                    .memory = block->memory(),
+                    .offset = offset,
+                    .size = allocated.size,
+                    .padded_size = MemoryBlock::min_size << allocated.order,
+                    .ptr = block->mapped() ? block->mapped() + offset : nullptr,
+                    .memory_type = (uint32_t)(pool_index / 2),
+                    .block = (uint32_t)block_index,
+                    .order = allocated.order,
+                    .linear = pool_index % 2 == 1,
+                });
+            }
+        }
+    }
+
+    return candidates;
+}
+
+MemoryStats MemoryAllocator::stats() const
+{
+    MemoryStats stats{
+        .device_allocation_count = m_dedicated_count,
+        .allocation_count = m_allocation_count,
+        .reserved = m_dedicated_size,
+        .used = m_dedicated_size,
+        .requested = m_requested,
+        .peak_reserved = m_peak_reserved,
+        .peak_requested = m_peak_requested,
+    };
+
+    for (const auto& pool : m_pools)
+    {
+        for (const auto& block : pool.blocks)
+        {
+            if (!block)
+                continue;
+
+            stats.device_allocation_count += 1;
+            stats.reserved += block->size();
+            stats.used += block->used();
+        }
+    }
+
+    return stats;
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "Core/Error.hpp"
+
+#include <map>
+#include <memory>
+#include <set>
+
+/**
+ * @brief A range of device memory returned by `MemoryAllocator`.
+ */
+struct MemoryAllocation
+{
+    static constexpr uint32_t dedicated_block = UINT32_MAX;
+
+    vk::DeviceMemory memory;
+    vk::DeviceSize offset = 0;
+
+    /**
+     * @brief Bytes requested for the allocation.
+     */
+    vk::DeviceSize size = 0;
+
+    /**
+     * @brief Bytes reserved for the allocation in its block, `size` rounded up to the order of the allocation.
+     */
+    vk::DeviceSize padded_size = 0;
+
+    /**
+     * @brief Pointer to the start of the allocation when the memory is host visible, blocks stay mapped for their whole
+     * lifetime.
+     */
+    uint8_t *ptr = nullptr;
+
+    uint32_t memory_type = 0;
+    uint32_t block = dedicated_block;
+    uint8_t order = 0;
+    bool linear = true;
+};
+
+struct MemoryStats
+{
+    /**
+     * @brief Number of `vk::DeviceMemory` currently allocated, including dedicated allocations.
+     */
+    size_t device_allocation_count = 0;
+
+    /**
+     * @brief Number of allocations handed out by the allocator.
+     */
+    size_t allocation_count = 0;
+
+    /**
+     * @brief Bytes allocated from the driver.
+     */
+    vk::DeviceSize reserved = 0;
+
+    /**
+     * @brief Bytes used by allocations, including the padding added to round them to a power of two.
+     */
+    vk::DeviceSize used = 0;
+
+    /**
+     * @brief Bytes requested by the allocations.
+     */
+    vk::DeviceSize requested = 0;
+
+    /**
+     * @brief Highest values of `reserved` and `requested` since the creation of the allocator.
+     */
+    vk::DeviceSize peak_reserved = 0;
+    vk::DeviceSize peak_requested = 0;
+};
+
+/**
+ * @brief A block of device memory sub-allocated with a buddy allocator.
+ *
+ * An allocation of order `n` is `min_size << n` bytes and is always aligned on its size.
+ */
+class MemoryBlock
+{
+public:
+    static constexpr vk::DeviceSize min_size = 256;
+
+    MemoryBlock(vk::DeviceMemory memory, vk::DeviceSize size, uint8_t *mapped);
+
+    /**
+     * @brief Returns the order needed to fit `size` bytes aligned on `alignment`.
+     */
+    static uint8_t order_for(vk::DeviceSize size, vk::DeviceSize alignment);
+
+    struct Allocated
+    {
+        uint8_t order;
+        vk::DeviceSize size;
+    };
+
+    /**
+     * @brief Allocate a range of order `order` for `size` requested bytes.
+     */
+    std::optional<vk::DeviceSize> allocate(uint8_t order, vk::DeviceSize size);
+    void free(vk::DeviceSize offset, uint8_t order);
+
+    inline vk::DeviceMemory memory() const
+    {
+        return m_memory;
+    }
+
+    inline uint8_t *mapped() const
+    {
+        return m_mapped;
+    }
+
+    inline vk::DeviceSize size() const
+    {
+        return m_size;
+    }
+
+    inline vk::DeviceSize used() const
+    {
+        return m_used;
+    }
+
+    inline const std::map<vk::DeviceSize, Allocated>& allocations() const
+    {
+        return m_allocated;
+    }
+
+private:
+    vk::DeviceMemory m_memory;
+    vk::DeviceSize m_size;
+    uint8_t *m_mapped;
+    uint8_t m_max_order;
+
+    // Free offsets for each order.
+    std::vector<std::set<vk::DeviceSize>> m_free;
+    std::map<vk::DeviceSize, Allocated> m_allocated;
+    vk::DeviceSize m_used = 0;
+};
+
+/**
+ * @brief Hand out ranges of a fixed capacity from a free list, with first fit so allocations stay packed at the start.
+ *
+ * Adjacent free ranges are merged when a range is freed.
+ */
+class RangeAllocator
+{
+public:
+    RangeAllocator() {}
+    RangeAllocator(uint64_t capacity);
+
+    std::optional<uint64_t> allocate(uint64_t size, uint64_t alignment = 1);
+    void free(uint64_t offset, uint64_t size);
+
+    inline uint64_t capacity() const
+    {
+        return m_capacity;
+    }
+
+    inline uint64_t used() const
+    {
+        return m_used;
+    }
+
+    /**
+     * @brief Size of the largest free range, lower than the free space when the allocator is fragmented.
+     */
+    uint64_t largest_free() const;
+
+    inline size_t free_range_count() const
+    {
+        return m_free.size();
+    }
+
+private:
+    uint64_t m_capacity = 0;
+    uint64_t m_used = 0;
+
+    // Free ranges by offset.
+    std::map<uint64_t, uint64_t> m_free;
+};
+
+/**
+ * @brief Sub-allocate device memory from large blocks instead of allocating memory for every resource.
+ *
+ * There is one pool of blocks per memory type, and buffers (linear resources) are kept apart from images to respect
+ * `bufferImageGranularity`. Allocations larger than half a block get their own `vk::DeviceMemory`.
+ */
+class MemoryAllocator
+{
+public:
+    static constexpr vk::DeviceSize block_size = 64 * 1024 * 1024;
+
+    MemoryAllocator() {}
+
+    void initialize(vk::Device device, const vk::PhysicalDeviceMemoryProperties& memory_properties);
+    void destroy();
+
+    [[nodiscard]]
+    Expected<MemoryAllocation> allocate(const vk::MemoryRequirements& requirements, uint32_t memory_type, bool linear);
+
+    void free(const MemoryAllocation& allocation);
+
+    /**
+     * @brief Release the blocks which do not contain any allocation anymore.
+     */
+    void trim();
+
+    /**
+     * @brief Returns the allocations of blocks used below `max_usage` (between `0.0` and `1.0`).
+     *
+     * Moving those allocations elsewhere, by recreating the resource, copying its content and freeing the old
+     * allocation, lets `trim` release the block.
+     */
+    std::vector<MemoryAllocation> defragmentation_candidates(float max_usage) const;
+
+    MemoryStats stats() const;
+
+private:
+    struct Pool
+    {
+        // Blocks are never moved so `MemoryAllocation::block` stays valid, released blocks leave a hole.
+        std::vector<std::unique_ptr<MemoryBlock>> blocks;
+    };
+
+    vk::Device m_device;
+    vk::PhysicalDeviceMemoryProperties m_memory_properties;
+
+    std::array<Pool, VK_MAX_MEMORY_TYPES * 2> m_pools;
+
+    size_t m_dedicated_count = 0;
+    vk::DeviceSize m_dedicated_size = 0;
+    size_t m_allocation_count = 0;
+    vk::DeviceSize m_requested = 0;
+
+    vk::DeviceSize m_reserved = 0;
+    vk::DeviceSize m_peak_reserved = 0;
+    vk::DeviceSize m_peak_requested = 0;
+
+    inline Pool& pool_for(uint32_t memory_type, bool linear)
+    {
+        return m_pools[memory_type * 2 + (linear ? 1 : 0)];
+    }
+
+    Expected<vk::DeviceMemory> allocate_device_memory(vk::DeviceSize size, uint32_t memory_type, uint8_t **mapped);
+};
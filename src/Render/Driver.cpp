@@ -1,5 +1,7 @@
 #include "Render/Driver.hpp"
 
+#include <glm/gtc/packing.hpp>
+
 Ref<RenderingDriver> RenderingDriver::singleton = nullptr;
 
 size_t size_of(const TextureFormat& format)
@@ -35,6 +37,66 @@ size_t size_of(const IndexType& format)
     return 0;
 }
 
+uint32_t SortIds::acquire()
+{
+    if (!m_free.empty())
+    {
+        const uint32_t id = m_free.back();
+        m_free.pop_back();
+        return id;
+    }
+
+    assert_error(m_next < max_count, "error: More than {} sort identifiers are in use", max_count);
+
+    return m_next++;
+}
+
+void SortIds::release(uint32_t id)
+{
+    m_free.push_back(id);
+}
+
+VertexLayout VertexLayout::packed()
+{
+    return VertexLayout(
+        {
+            VertexLayoutInput{.type = ShaderType::Half4, .stream = 0, .offset = offsetof(PackedVertex, position)},
+            VertexLayoutInput{.type = ShaderType::Snorm8x4, .stream = 0, .offset = offsetof(PackedVertex, normal)},
+            VertexLayoutInput{.type = ShaderType::Half2, .stream = 0, .offset = offsetof(PackedVertex, uv)},
+        },
+        {sizeof(PackedVertex)});
+}
+
+VertexLayout VertexLayout::separate()
+{
+    return VertexLayout(
+        {
+            VertexLayoutInput{.type = ShaderType::Vec3, .stream = 0, .offset = 0},
+            VertexLayoutInput{.type = ShaderType::Vec3, .stream = 1, .offset = 0},
+            VertexLayoutInput{.type = ShaderType::Vec2, .stream = 2, .offset = 0},
+        },
+        {sizeof(glm::vec3), sizeof(glm::vec3), sizeof(glm::vec2)});
+}
+
+PackedVertex PackedVertex::pack(glm::vec3 position, glm::vec3 normal, glm::vec2 uv)
+{
+    return PackedVertex{
+        .position = glm::packHalf4x16(glm::vec4(position, 1.0)),
+        .normal = glm::packSnorm4x8(glm::vec4(normal, 0.0)),
+        .uv = glm::packHalf2x16(uv),
+    };
+}
+
+Expected<Ref<Mesh>> RenderingDriver::create_mesh(IndexType index_type, Span<uint8_t> indices, Span<glm::vec3> vertices, Span<glm::vec2> uvs, Span<glm::vec3> normals)
+{
+    if (uvs.size() != vertices.size() || normals.size() != vertices.size())
+        return Error::unexpected<Ref<Mesh>>(ErrorKind::Unknown);
+
+    std::array<Span<uint8_t>, 3> streams{vertices.as_bytes(), normals.as_bytes(), uvs.as_bytes()};
+
+    return create_mesh(index_type, indices, VertexLayout::separate(), streams);
+}
+
 Expected<Ref<Buffer>> RenderingDriver::create_buffer_from_data(size_t size, Span<uint8_t> data, BufferUsage flags, BufferVisibility visibility)
 {
     auto buffer_result = create_buffer(size, flags, visibility);
@@ -45,3 +107,40 @@ Expected<Ref<Buffer>> RenderingDriver::create_buffer_from_data(size_t size, Span
 
     return buffer;
 }
+
+MaterialParamHandle MaterialLayout::find_param(const std::string& name) const
+{
+    for (size_t i = 0; i < m_params.size(); i++)
+    {
+        if (!std::strcmp(name.c_str(), m_params[i].name))
+            return MaterialParamHandle{.index = (uint32_t)i, .kind = m_params[i].kind};
+    }
+
+    return MaterialParamHandle();
+}
+
+void Material::set_param(const std::string& name, Ref<Buffer>& buffer)
+{
+    MaterialParamHandle param = m_layout->find_param(name);
+    ERR_COND_VR(!param.is_valid(), "Invalid parameter name `%s`", name.c_str());
+
+    set_param(param, buffer);
+}
+
+void Material::set_param(const std::string& name, Ref<Texture>& texture)
+{
+    MaterialParamHandle param = m_layout->find_param(name);
+    ERR_COND_VR(!param.is_valid(), "Invalid parameter name `%s`", name.c_str());
+
+    set_param(param, texture);
+}
+
+void Buffer::write(Span<uint8_t> view, size_t offset)
+{
+    ERR_COND_VR(offset > m_size || view.size() > m_size - offset, "Out of bounds: %zu + %zu vs %zu", offset, view.size(), m_size);
+
+    uint8_t *ptr = map();
+    ERR_COND_R(ptr == nullptr, "Only dynamic buffers can be written directly");
+
+    std::memcpy(ptr + offset, view.data(), view.size());
+}
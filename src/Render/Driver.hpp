@@ -3,6 +3,7 @@
 #include "Core/Error.hpp"
 #include "Core/Ref.hpp"
 #include "Core/Span.hpp"
+#include "Render/FramePacer.hpp"
 #include "Render/Graph.hpp"
 #include "Window.hpp"
 
@@ -20,6 +21,12 @@ enum class VSync : uint8_t
      * @brief Enable vertical synchronization.
      */
     On,
+
+    /**
+     * @brief Present the most recent frame at the vertical blank without blocking rendering. Lower latency than `On`
+     * without tearing, falls back to `On` when not supported.
+     */
+    Mailbox,
 };
 
 enum class BufferVisibility : uint8_t
@@ -33,6 +40,14 @@ enum class BufferVisibility : uint8_t
      * @brief Indicate a buffer visible from GPU and CPU.
      */
     GPUAndCPU,
+
+    /**
+     * @brief Indicate a buffer rewritten by the CPU every frame.
+     *
+     * The buffer is persistently mapped and has one copy per frame in flight, it is written with `Buffer::map` or
+     * `Buffer::write` without any staging copy.
+     */
+    Dynamic,
 };
 
 struct BufferUsage
@@ -61,6 +76,11 @@ struct BufferUsage
      * @brief Used as an vertex or instance buffer.
      */
     bool vertex : 1 = false;
+
+    /**
+     * @brief Used as a storage buffer, read by shaders through the bindless set or a storage buffer parameter.
+     */
+    bool storage : 1 = false;
 };
 
 enum class TextureFormat : uint8_t
@@ -97,6 +117,12 @@ struct TextureUsage
 
     bool color_attachment : 1 = false;
     bool depth_attachment : 1 = false;
+
+    /**
+     * @brief The content only lives during a render pass, the texture can be backed by lazily allocated memory. Only
+     * valid with attachment usages.
+     */
+    bool transient : 1 = false;
 };
 
 enum class IndexType : uint8_t
@@ -129,6 +155,14 @@ enum class ShaderType : uint8_t
     Vec4,
 
     Uint,
+
+    // Compact types of vertex and instance inputs, shaders read them as the float or uint vector of the same size.
+    Half2,
+    Half4,
+    Snorm8x4,
+    Unorm8x4,
+    Uint8x4,
+    Uint16x2,
 };
 
 struct Extent2D
@@ -155,6 +189,19 @@ public:
      */
     virtual void update(Span<uint8_t> view, size_t offset = 0) = 0;
 
+    /**
+     * @brief Returns a pointer to the copy of a `BufferVisibility::Dynamic` buffer used by the next frame, or
+     * `nullptr` for other buffers.
+     *
+     * The content of the copy is undefined, everything read by the frame must be written again.
+     */
+    virtual uint8_t *map() = 0;
+
+    /**
+     * @brief Write `view` into the copy of a `BufferVisibility::Dynamic` buffer used by the next frame.
+     */
+    void write(Span<uint8_t> view, size_t offset = 0);
+
     inline size_t size() const
     {
         return m_size;
@@ -170,6 +217,7 @@ protected:
 enum class TextureLayout : uint8_t
 {
     Undefined,
+    ColorAttachment,
     DepthStencilAttachment,
     CopyDst,
     ShaderReadOnly,
@@ -199,6 +247,11 @@ public:
         return m_height;
     }
 
+    inline TextureLayout layout() const
+    {
+        return m_layout;
+    }
+
     virtual ~Texture() {}
 
 protected:
@@ -207,6 +260,26 @@ protected:
     TextureLayout m_layout;
 };
 
+/**
+ * @brief Hand out the identifiers used to sort draws, which must fit in the bits reserved for them in the sort keys.
+ *
+ * Identifiers are recycled when their owner is destroyed, running out of them aborts since unrelated draws would share
+ * an identifier and be merged or misordered.
+ */
+class SortIds
+{
+public:
+    static constexpr uint32_t bits = 18;
+    static constexpr uint32_t max_count = 1 << bits;
+
+    uint32_t acquire();
+    void release(uint32_t id);
+
+private:
+    uint32_t m_next = 0;
+    std::vector<uint32_t> m_free;
+};
+
 class Mesh
 {
 public:
@@ -220,11 +293,26 @@ public:
         return m_index_type;
     }
 
-    virtual ~Mesh() {}
+    /**
+     * @brief Identifier used to sort draws.
+     */
+    inline uint32_t sort_id() const
+    {
+        return m_sort_id;
+    }
+
+    virtual ~Mesh()
+    {
+        sort_ids.release(m_sort_id);
+    }
 
 protected:
     uint32_t m_vertex_count;
     IndexType m_index_type;
+
+private:
+    inline static SortIds sort_ids;
+    uint32_t m_sort_id = sort_ids.acquire();
 };
 
 enum class ShaderKind : uint8_t
@@ -252,6 +340,7 @@ enum class MaterialParamKind : uint8_t
 {
     Texture,
     UniformBuffer,
+    StorageBuffer,
 };
 
 enum class Filter : uint8_t
@@ -321,6 +410,11 @@ union MaterialParam
     {
         return {.kind = MaterialParamKind::UniformBuffer, .shader_kind = shader_kind, .name = name};
     }
+
+    static MaterialParam storage_buffer(ShaderKind shader_kind, const char *name)
+    {
+        return {.kind = MaterialParamKind::StorageBuffer, .shader_kind = shader_kind, .name = name};
+    }
 };
 
 struct InstanceLayoutInput
@@ -340,10 +434,111 @@ struct InstanceLayout
     }
 };
 
+struct VertexLayoutInput
+{
+    ShaderType type;
+
+    /**
+     * @brief Stream holding the input, inputs of the same stream are interleaved.
+     */
+    uint32_t stream;
+    uint32_t offset;
+};
+
+/**
+ * @brief Describe how the vertices of meshes are stored. Inputs are bound to consecutive locations starting at `0`,
+ * followed by the inputs of the `InstanceLayout`.
+ */
+struct VertexLayout
+{
+    static constexpr size_t max_streams = 4;
+
+    std::vector<VertexLayoutInput> inputs;
+
+    /**
+     * @brief Size of a vertex in each stream.
+     */
+    std::vector<uint32_t> strides;
+
+    VertexLayout(std::vector<VertexLayoutInput> inputs, std::vector<uint32_t> strides)
+        : inputs(inputs), strides(strides)
+    {
+    }
+
+    /**
+     * @brief One interleaved stream of `PackedVertex`, half the size of `separate()` for meshes which can afford the
+     * precision of half float positions.
+     */
+    static VertexLayout packed();
+
+    /**
+     * @brief Positions, normals and uvs as full floats in three streams, the default layout of meshes.
+     */
+    static VertexLayout separate();
+};
+
+/**
+ * @brief A vertex of `VertexLayout::packed()`, 16 bytes instead of 32 bytes with floats.
+ *
+ * Positions and uvs are half floats with 11 significant bits: the step between two values is 1/1024 below 1, 1/32
+ * between 32 and 64 and 0.25 between 256 and 512. Integers are exact up to 2048, which suits voxel meshes, but other
+ * meshes should keep their positions within a few units of their origin.
+ */
+struct PackedVertex
+{
+    // xyz and an unused w.
+    uint64_t position;
+    // snorm8 xyz and an unused w.
+    uint32_t normal;
+    uint32_t uv;
+
+    static PackedVertex pack(glm::vec3 position, glm::vec3 normal, glm::vec2 uv);
+};
+
+static_assert(sizeof(PackedVertex) == 16, "packed vertices are half the size of float vertices");
+
+/**
+ * @brief A parameter of a material layout resolved from its name with `MaterialLayout::find_param`.
+ */
+struct MaterialParamHandle
+{
+    static constexpr uint32_t invalid_index = UINT32_MAX;
+
+    /**
+     * @brief Index of the parameter in its layout, which is also its binding.
+     */
+    uint32_t index = invalid_index;
+    MaterialParamKind kind = MaterialParamKind::Texture;
+
+    inline bool is_valid() const
+    {
+        return index != invalid_index;
+    }
+};
+
 struct MaterialFlags
 {
     bool transparency : 1 = false;
     bool always_first : 1 = false;
+
+    /**
+     * @brief Shaders read textures and storage buffers from the bindless set instead of material parameters, by
+     * indices passed in the instance data. All bindless materials share the same descriptor set.
+     */
+    bool bindless : 1 = false;
+
+    /**
+     * @brief The pipeline has no vertex input, shaders fetch their vertices from storage buffers with
+     * `gl_VertexIndex` and `gl_InstanceIndex`. Draw them with meshes from `RenderingDriver::create_pulled_mesh`.
+     */
+    bool vertex_pulling : 1 = false;
+
+    /**
+     * @brief The vertex shader reads the view matrix from a per-instance `mat4` input instead of the push constants,
+     * followed by a `uint` input replacing `gl_InstanceIndex`. Their locations follow the inputs of the vertex and
+     * instance layouts. Draws of the same mesh and material are merged even when their view matrices differ.
+     */
+    bool instanced_view_matrix : 1 = false;
 };
 
 /**
@@ -355,14 +550,72 @@ struct MaterialFlags
 class MaterialLayout
 {
 public:
-    virtual ~MaterialLayout() {}
+    virtual ~MaterialLayout()
+    {
+        sort_ids.release(m_sort_id);
+    }
+
+    /**
+     * @brief Identifier used to sort draws, all materials of a layout share the same pipeline.
+     */
+    inline uint32_t sort_id() const
+    {
+        return m_sort_id;
+    }
+
+    inline bool is_transparent() const
+    {
+        return m_transparent;
+    }
+
+    inline bool is_drawn_first() const
+    {
+        return m_drawn_first;
+    }
+
+    inline bool has_instanced_view_matrix() const
+    {
+        return m_instanced_view_matrix;
+    }
+
+    /**
+     * @brief Resolve a parameter from its name. The handle is valid for every material of the layout, so it can be
+     * resolved once instead of passing the name to `Material::set_param`. Returns an invalid handle when there is no
+     * such parameter.
+     */
+    MaterialParamHandle find_param(const std::string& name) const;
+
+    inline Span<MaterialParam> get_params() const
+    {
+        return m_params;
+    }
+
+protected:
+    bool m_transparent = false;
+    bool m_drawn_first = false;
+    bool m_instanced_view_matrix = false;
+    std::vector<MaterialParam> m_params;
+
+private:
+    inline static SortIds sort_ids;
+    uint32_t m_sort_id = sort_ids.acquire();
 };
 
 class Material
 {
 public:
-    virtual void set_param(const std::string& name, Ref<Buffer>& buffer) = 0;
-    virtual void set_param(const std::string& name, Ref<Texture>& texture) = 0;
+    /**
+     * @brief Set a parameter from its name, which is looked up in the layout on every call.
+     */
+    void set_param(const std::string& name, Ref<Buffer>& buffer);
+    void set_param(const std::string& name, Ref<Texture>& texture);
+
+    /**
+     * @brief Bind `buffer` to a uniform or storage buffer parameter. `BufferVisibility::Dynamic` buffers are rejected
+     * since a descriptor cannot follow their copy of the current frame.
+     */
+    virtual void set_param(MaterialParamHandle param, Ref<Buffer>& buffer) = 0;
+    virtual void set_param(MaterialParamHandle param, Ref<Texture>& texture) = 0;
 
     const Ref<MaterialLayout>& get_layout() const
     {
@@ -374,10 +627,25 @@ public:
         return m_layout;
     }
 
-    virtual ~Material() {}
+    /**
+     * @brief Identifier used to sort draws.
+     */
+    inline uint32_t sort_id() const
+    {
+        return m_sort_id;
+    }
+
+    virtual ~Material()
+    {
+        sort_ids.release(m_sort_id);
+    }
 
 protected:
     Ref<MaterialLayout> m_layout;
+
+private:
+    inline static SortIds sort_ids;
+    uint32_t m_sort_id = sort_ids.acquire();
 };
 
 class RenderingDriver
@@ -423,6 +691,23 @@ public:
      */
     virtual void limit_frames(uint32_t limit) = 0;
 
+    /**
+     * @brief Wait for the CPU and the GPU to finish the previous frame before starting a new one, instead of queuing
+     * frames in advance. Reduces the input latency at the cost of some throughput.
+     */
+    virtual void set_low_latency(bool enabled) = 0;
+
+    /**
+     * @brief Wait until the next frame should start. Call it before sampling input so the input is as recent as
+     * possible when the frame is drawn, otherwise `draw_graph` waits instead.
+     */
+    virtual void begin_frame() = 0;
+
+    /**
+     * @brief Returns statistics about the time between frames.
+     */
+    virtual FrameTimeStats get_frame_time_stats() const = 0;
+
     /**
      * @brief Allocate a buffer in the GPU memory.
      */
@@ -444,15 +729,63 @@ public:
     [[nodiscard]]
     virtual Expected<Ref<Texture>> create_texture_cube(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage) = 0;
 
+    /**
+     * @brief Create a mesh from the vertices of each stream of `layout`, all streams have the same number of vertices.
+     */
     [[nodiscard]]
-    virtual Expected<Ref<Mesh>> create_mesh(IndexType index_type, Span<uint8_t> indices, Span<glm::vec3> vertices, Span<glm::vec2> uvs, Span<glm::vec3> normals) = 0;
+    virtual Expected<Ref<Mesh>> create_mesh(IndexType index_type, Span<uint8_t> indices, const VertexLayout& layout, Span<Span<uint8_t>> streams) = 0;
 
+    /**
+     * @brief Create a mesh with `VertexLayout::separate()`, the vertices keep their full precision.
+     */
     [[nodiscard]]
-    virtual Expected<Ref<MaterialLayout>> create_material_layout(Span<ShaderRef> shaders, Span<MaterialParam> params = {}, MaterialFlags flags = {}, std::optional<InstanceLayout> instance_layout = std::nullopt, CullMode cull_mode = CullMode::Back, PolygonMode polygon_mode = PolygonMode::Fill, bool transparency = false, bool always_draw_before = false) = 0;
+    Expected<Ref<Mesh>> create_mesh(IndexType index_type, Span<uint8_t> indices, Span<glm::vec3> vertices, Span<glm::vec2> uvs, Span<glm::vec3> normals);
+
+    /**
+     * @brief Create a mesh without vertices for materials using `MaterialFlags::vertex_pulling`. It draws `quad_count`
+     * quads of 4 vertices, `gl_VertexIndex / 4` being the quad starting at `first_quad` and `gl_VertexIndex % 4` its
+     * corner, and `gl_InstanceIndex` starts at `first_instance`. With `MaterialFlags::instanced_view_matrix`, the
+     * instance input starts at `first_instance` instead.
+     *
+     * All pulled meshes share one index buffer holding the pattern of a quad repeated, creating them is cheap.
+     */
+    [[nodiscard]]
+    virtual Expected<Ref<Mesh>> create_pulled_mesh(uint32_t first_quad, uint32_t quad_count, uint32_t first_instance = 0) = 0;
+
+    /**
+     * @brief Create a material layout, its meshes must be created with `vertex_layout`. It is ignored along with
+     * `instance_layout` when the material uses `MaterialFlags::vertex_pulling`.
+     */
+    [[nodiscard]]
+    virtual Expected<Ref<MaterialLayout>> create_material_layout(Span<ShaderRef> shaders, Span<MaterialParam> params = {}, MaterialFlags flags = {}, std::optional<InstanceLayout> instance_layout = std::nullopt, CullMode cull_mode = CullMode::Back, PolygonMode polygon_mode = PolygonMode::Fill, bool transparency = false, bool always_draw_before = false, const VertexLayout& vertex_layout = VertexLayout::separate()) = 0;
 
     [[nodiscard]]
     virtual Expected<Ref<Material>> create_material(MaterialLayout *layout) = 0;
 
+    /**
+     * @brief Returns `true` when materials can be created with `MaterialFlags::bindless`.
+     */
+    virtual bool supports_bindless() const = 0;
+
+    /**
+     * @brief Add a sampled texture to the bindless set and returns its index in the array of textures.
+     */
+    [[nodiscard]]
+    virtual Expected<uint32_t> add_bindless_texture(Texture *texture, Sampler sampler = {}) = 0;
+
+    /**
+     * @brief Add a storage buffer to the bindless set and returns its index in the array of buffers.
+     */
+    [[nodiscard]]
+    virtual Expected<uint32_t> add_bindless_buffer(Buffer *buffer) = 0;
+
+    /**
+     * @brief Remove a resource from the bindless set. Its index is reused once the frames which may read it are
+     * finished.
+     */
+    virtual void remove_bindless_texture(uint32_t index) = 0;
+    virtual void remove_bindless_buffer(uint32_t index) = 0;
+
     /**
      * @brief Draw a frame using a `RenderGraph`.
      */
@@ -0,0 +1,257 @@
+#include "Render/DriverNull.hpp"
+
+#include <cstring>
+
+Expected<void> RenderingDriverNull::initialize(const Window& window)
+{
+    return configure_surface(window, VSync::On);
+}
+
+Expected<void> RenderingDriverNull::configure_surface(const Window& window, VSync vsync)
+{
+    (void)vsync;
+
+    const WindowSize size = window.size();
+    m_surface_extent = Extent2D(size.width, size.height);
+
+    return {};
+}
+
+void RenderingDriverNull::limit_frames(uint32_t limit)
+{
+    m_frame_pacer.set_limit(limit);
+}
+
+void RenderingDriverNull::set_low_latency(bool enabled)
+{
+    // Nothing is queued on a GPU.
+    (void)enabled;
+}
+
+void RenderingDriverNull::begin_frame()
+{
+    m_frame_pacer.wait();
+    m_frame_began = true;
+}
+
+FrameTimeStats RenderingDriverNull::get_frame_time_stats() const
+{
+    return m_frame_pacer.stats();
+}
+
+Expected<Ref<Buffer>> RenderingDriverNull::create_buffer(size_t size, BufferUsage usage, BufferVisibility visibility)
+{
+    (void)usage;
+
+    m_stats.buffer_count += 1;
+    m_stats.buffer_bytes += size;
+
+    return make_ref<BufferNull>(size, visibility == BufferVisibility::Dynamic).cast_to<Buffer>();
+}
+
+Expected<Ref<Texture>> RenderingDriverNull::create_texture(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage)
+{
+    return create_texture_array(width, height, format, usage, 1);
+}
+
+Expected<Ref<Texture>> RenderingDriverNull::create_texture_array(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage, uint32_t layers)
+{
+    (void)usage;
+
+    const size_t size = width * height * size_of(format) * layers;
+
+    m_stats.texture_count += 1;
+    m_stats.texture_bytes += size;
+
+    return make_ref<TextureNull>(width, height, size, layers).cast_to<Texture>();
+}
+
+Expected<Ref<Texture>> RenderingDriverNull::create_texture_cube(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage)
+{
+    return create_texture_array(width, height, format, usage, 6);
+}
+
+Expected<Ref<Mesh>> RenderingDriverNull::create_mesh(IndexType index_type, Span<uint8_t> indices, const VertexLayout& layout, Span<Span<uint8_t>> streams)
+{
+    (void)layout;
+    (void)streams;
+
+    m_stats.mesh_count += 1;
+
+    return make_ref<MeshNull>(index_type, indices.size() / size_of(index_type)).cast_to<Mesh>();
+}
+
+Expected<Ref<Mesh>> RenderingDriverNull::create_pulled_mesh(uint32_t first_quad, uint32_t quad_count, uint32_t first_instance)
+{
+    (void)first_quad;
+    (void)first_instance;
+
+    m_stats.mesh_count += 1;
+
+    return make_ref<MeshNull>(IndexType::Uint16, quad_count * 6).cast_to<Mesh>();
+}
+
+Expected<Ref<MaterialLayout>> RenderingDriverNull::create_material_layout(Span<ShaderRef> shaders, Span<MaterialParam> params, MaterialFlags flags, std::optional<InstanceLayout> instance_layout, CullMode cull_mode, PolygonMode polygon_mode, bool transparency, bool always_draw_before, const VertexLayout& vertex_layout)
+{
+    (void)shaders;
+    (void)vertex_layout;
+    (void)cull_mode;
+    (void)polygon_mode;
+
+    return make_ref<MaterialLayoutNull>(instance_layout, params.to_vector(), flags, transparency, always_draw_before).cast_to<MaterialLayout>();
+}
+
+Expected<Ref<Material>> RenderingDriverNull::create_material(MaterialLayout *layout)
+{
+    m_stats.material_count += 1;
+
+    return make_ref<MaterialNull>(layout).cast_to<Material>();
+}
+
+bool RenderingDriverNull::supports_bindless() const
+{
+    return true;
+}
+
+static uint32_t take_index(std::vector<uint32_t>& free_indices, uint32_t& count)
+{
+    if (free_indices.empty())
+        return count++;
+
+    const uint32_t index = free_indices.back();
+    free_indices.pop_back();
+
+    return index;
+}
+
+Expected<uint32_t> RenderingDriverNull::add_bindless_texture(Texture *texture, Sampler sampler)
+{
+    (void)texture;
+    (void)sampler;
+
+    return take_index(m_free_bindless_textures, m_bindless_texture_count);
+}
+
+Expected<uint32_t> RenderingDriverNull::add_bindless_buffer(Buffer *buffer)
+{
+    (void)buffer;
+
+    return take_index(m_free_bindless_buffers, m_bindless_buffer_count);
+}
+
+void RenderingDriverNull::remove_bindless_texture(uint32_t index)
+{
+    m_free_bindless_textures.push_back(index);
+}
+
+void RenderingDriverNull::remove_bindless_buffer(uint32_t index)
+{
+    m_free_bindless_buffers.push_back(index);
+}
+
+void RenderingDriverNull::draw_graph(const RenderGraph& graph)
+{
+    if (!m_frame_began)
+        begin_frame();
+
+    m_frame_began = false;
+
+    m_stats.pass_count = 0;
+    m_stats.culled_pass_count = 0;
+    m_stats.draw_count = 0;
+    m_stats.instance_count = 0;
+    m_stats.copy_count = 0;
+    m_stats.copy_bytes = 0;
+
+    Span<Instruction> instructions = graph.get_instructions();
+
+    graph.cull_passes(m_culled_passes);
+
+    for (size_t i = 0; i < instructions.size(); i++)
+    {
+        const Instruction& instruction = instructions[i];
+
+        if (m_culled_passes[i])
+        {
+            m_stats.culled_pass_count += 1;
+            continue;
+        }
+
+        switch (instruction.kind)
+        {
+        case InstructionKind::BeginRenderPass:
+            m_stats.pass_count += 1;
+            break;
+        case InstructionKind::Draw:
+            m_stats.draw_count += 1;
+            m_stats.instance_count += instruction.draw.instance_count;
+            break;
+        case InstructionKind::Copy:
+        {
+            // Copies are executed so buffers hold what the GPU would read.
+            BufferNull *src = (BufferNull *)instruction.copy.src;
+            BufferNull *dst = (BufferNull *)instruction.copy.dst;
+
+            std::memcpy(dst->data.data() + instruction.copy.dst_offset, src->data.data() + instruction.copy.src_offset, instruction.copy.size);
+
+            m_stats.pass_count += 1;
+            m_stats.copy_count += 1;
+            m_stats.copy_bytes += instruction.copy.size;
+            break;
+        }
+        case InstructionKind::EndRenderPass:
+        case InstructionKind::BeginRange:
+        case InstructionKind::EndRange:
+            break;
+        }
+    }
+
+    m_stats.frame_count += 1;
+}
+
+BufferNull::~BufferNull()
+{
+    RenderingDriverNull::get()->get_stats().buffer_count -= 1;
+    RenderingDriverNull::get()->get_stats().buffer_bytes -= m_size;
+}
+
+void BufferNull::update(Span<uint8_t> view, size_t offset)
+{
+    ERR_COND_VR(offset > m_size || view.size() > m_size - offset, "Out of bounds: %zu + %zu vs %zu", offset, view.size(), m_size);
+
+    std::memcpy(data.data() + offset, view.data(), view.size());
+}
+
+uint8_t *BufferNull::map()
+{
+    return dynamic ? data.data() : nullptr;
+}
+
+TextureNull::~TextureNull()
+{
+    RenderingDriverNull::get()->get_stats().texture_count -= 1;
+    RenderingDriverNull::get()->get_stats().texture_bytes -= size;
+}
+
+void TextureNull::update(Span<uint8_t> view, uint32_t layer)
+{
+    ERR_COND_VR(layer >= layers, "Layer out of bounds: %u vs %u", layer, layers);
+    ERR_COND_VR(view.size() > size / layers, "Out of bounds: %zu vs %zu", view.size(), size / layers);
+}
+
+void TextureNull::transition_layout(TextureLayout new_layout)
+{
+    m_layout = new_layout;
+}
+
+void MaterialNull::set_param(MaterialParamHandle param, Ref<Texture>& texture)
+{
+    (void)param;
+    (void)texture;
+}
+
+void MaterialNull::set_param(MaterialParamHandle param, Ref<Buffer>& buffer)
+{
+    (void)param;
+    ERR_COND_R(((BufferNull *)buffer.ptr())->dynamic, "Dynamic buffers cannot be bound to material parameters");
+}
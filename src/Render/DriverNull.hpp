@@ -0,0 +1,198 @@
+#pragma once
+
+#include "Render/Driver.hpp"
+
+/**
+ * @brief Resources and work tracked by `RenderingDriverNull`.
+ */
+struct NullDriverStats
+{
+    size_t buffer_count = 0;
+    size_t buffer_bytes = 0;
+    size_t texture_count = 0;
+    size_t texture_bytes = 0;
+    size_t mesh_count = 0;
+    size_t material_count = 0;
+
+    /**
+     * @brief Work of the last graph.
+     */
+    size_t pass_count = 0;
+    size_t culled_pass_count = 0;
+    size_t draw_count = 0;
+    size_t instance_count = 0;
+    size_t copy_count = 0;
+    size_t copy_bytes = 0;
+
+    size_t frame_count = 0;
+};
+
+/**
+ * @brief A driver which does not render anything.
+ *
+ * Resources live in host memory and render graphs are consumed as if they were recorded, so everything but the GPU
+ * work can be measured on machines without a GPU or a display.
+ */
+class RenderingDriverNull final : public RenderingDriver
+{
+public:
+    RenderingDriverNull() {}
+    virtual ~RenderingDriverNull() override {}
+
+    static RenderingDriverNull *get()
+    {
+        return (RenderingDriverNull *)RenderingDriver::get();
+    }
+
+    [[nodiscard]]
+    virtual Expected<void> initialize(const Window& window) override;
+
+    [[nodiscard]]
+    virtual Expected<void> configure_surface(const Window& window, VSync vsync) override;
+
+    virtual void limit_frames(uint32_t limit) override;
+    virtual void set_low_latency(bool enabled) override;
+    virtual void begin_frame() override;
+
+    virtual FrameTimeStats get_frame_time_stats() const override;
+
+    [[nodiscard]]
+    virtual Expected<Ref<Buffer>> create_buffer(size_t size, BufferUsage usage = {}, BufferVisibility visibility = BufferVisibility::GPUOnly) override;
+
+    [[nodiscard]]
+    virtual Expected<Ref<Texture>> create_texture(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage) override;
+
+    [[nodiscard]]
+    virtual Expected<Ref<Texture>> create_texture_array(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage, uint32_t layers) override;
+
+    [[nodiscard]]
+    virtual Expected<Ref<Texture>> create_texture_cube(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage) override;
+
+    using RenderingDriver::create_mesh;
+
+    [[nodiscard]]
+    virtual Expected<Ref<Mesh>> create_mesh(IndexType index_type, Span<uint8_t> indices, const VertexLayout& layout, Span<Span<uint8_t>> streams) override;
+
+    [[nodiscard]]
+    virtual Expected<Ref<Mesh>> create_pulled_mesh(uint32_t first_quad, uint32_t quad_count, uint32_t first_instance = 0) override;
+
+    [[nodiscard]]
+    virtual Expected<Ref<MaterialLayout>> create_material_layout(Span<ShaderRef> shaders, Span<MaterialParam> params = {}, MaterialFlags flags = {}, std::optional<InstanceLayout> instance_layout = std::nullopt, CullMode cull_mode = CullMode::Back, PolygonMode polygon_mode = PolygonMode::Fill, bool transparency = false, bool always_draw_before = false, const VertexLayout& vertex_layout = VertexLayout::separate()) override;
+
+    [[nodiscard]]
+    virtual Expected<Ref<Material>> create_material(MaterialLayout *layout) override;
+
+    virtual bool supports_bindless() const override;
+
+    [[nodiscard]]
+    virtual Expected<uint32_t> add_bindless_texture(Texture *texture, Sampler sampler = {}) override;
+
+    [[nodiscard]]
+    virtual Expected<uint32_t> add_bindless_buffer(Buffer *buffer) override;
+
+    virtual void remove_bindless_texture(uint32_t index) override;
+    virtual void remove_bindless_buffer(uint32_t index) override;
+
+    virtual void draw_graph(const RenderGraph& graph) override;
+
+    inline const NullDriverStats& get_stats() const
+    {
+        return m_stats;
+    }
+
+    inline NullDriverStats& get_stats()
+    {
+        return m_stats;
+    }
+
+private:
+    NullDriverStats m_stats;
+
+    FramePacer m_frame_pacer;
+    bool m_frame_began = false;
+
+    std::vector<bool> m_culled_passes;
+
+    // Indices of the bindless set, handed out like the Vulkan driver does but reused right away.
+    uint32_t m_bindless_texture_count = 0;
+    uint32_t m_bindless_buffer_count = 0;
+    std::vector<uint32_t> m_free_bindless_textures;
+    std::vector<uint32_t> m_free_bindless_buffers;
+};
+
+class BufferNull : public Buffer
+{
+public:
+    BufferNull(size_t size, bool dynamic)
+        : data(size), dynamic(dynamic)
+    {
+        m_size = size;
+    }
+
+    virtual ~BufferNull();
+
+    virtual void update(Span<uint8_t> view, size_t offset) override;
+    virtual uint8_t *map() override;
+
+    std::vector<uint8_t> data;
+    bool dynamic;
+};
+
+class TextureNull : public Texture
+{
+public:
+    TextureNull(uint32_t width, uint32_t height, size_t size, uint32_t layers)
+        : size(size), layers(layers)
+    {
+        m_width = width;
+        m_height = height;
+        m_layout = TextureLayout::Undefined;
+    }
+
+    virtual ~TextureNull();
+
+    virtual void update(Span<uint8_t> view, uint32_t layer) override;
+    virtual void transition_layout(TextureLayout new_layout) override;
+
+    size_t size;
+    uint32_t layers;
+};
+
+class MeshNull : public Mesh
+{
+public:
+    MeshNull(IndexType index_type, size_t vertex_count)
+    {
+        this->m_index_type = index_type;
+        this->m_vertex_count = vertex_count;
+    }
+};
+
+class MaterialLayoutNull : public MaterialLayout
+{
+public:
+    MaterialLayoutNull(std::optional<InstanceLayout> instance_layout, std::vector<MaterialParam> params, MaterialFlags flags, bool transparency, bool always_draw_before)
+        : m_instance_layout(instance_layout)
+    {
+        m_transparent = transparency;
+        m_drawn_first = always_draw_before;
+        m_instanced_view_matrix = flags.instanced_view_matrix;
+        m_params = params;
+    }
+
+    std::optional<InstanceLayout> m_instance_layout;
+};
+
+class MaterialNull : public Material
+{
+public:
+    MaterialNull(MaterialLayout *layout)
+    {
+        m_layout = layout;
+    }
+
+    using Material::set_param;
+
+    virtual void set_param(MaterialParamHandle param, Ref<Texture>& texture) override;
+    virtual void set_param(MaterialParamHandle param, Ref<Buffer>& buffer) override;
+};
@@ -2,7 +2,9 @@
 #include "Core/StackVector.hpp"
 
 #include <chrono>
+#include <filesystem>
 #include <fstream>
+#include <numeric>
 #include <print>
 
 #include <SDL3/SDL_vulkan.h>
@@ -19,8 +21,11 @@ static inline vk::BufferUsageFlags convert_buffer_usage(BufferUsage usage)
         flags |= vk::BufferUsageFlagBits::eUniformBuffer;
     if (usage.index)
         flags |= vk::BufferUsageFlagBits::eIndexBuffer;
+    // Vertex buffers can be the source of the instances gathered for merged draws.
     if (usage.vertex)
-        flags |= vk::BufferUsageFlagBits::eVertexBuffer;
+        flags |= vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferSrc;
+    if (usage.storage)
+        flags |= vk::BufferUsageFlagBits::eStorageBuffer;
 
     return flags;
 }
@@ -39,6 +44,8 @@ static inline vk::ImageUsageFlags convert_texture_usage(TextureUsage usage)
         flags |= vk::ImageUsageFlagBits::eColorAttachment;
     if (usage.depth_attachment)
         flags |= vk::ImageUsageFlagBits::eDepthStencilAttachment;
+    if (usage.transient)
+        flags |= vk::ImageUsageFlagBits::eTransientAttachment;
 
     return flags;
 }
@@ -80,7 +87,21 @@ static inline vk::Format convert_shader_type(ShaderType type)
         return vk::Format::eR32G32B32A32Sfloat;
     case ShaderType::Uint:
         return vk::Format::eR32Uint;
+    case ShaderType::Half2:
+        return vk::Format::eR16G16Sfloat;
+    case ShaderType::Half4:
+        return vk::Format::eR16G16B16A16Sfloat;
+    case ShaderType::Snorm8x4:
+        return vk::Format::eR8G8B8A8Snorm;
+    case ShaderType::Unorm8x4:
+        return vk::Format::eR8G8B8A8Unorm;
+    case ShaderType::Uint8x4:
+        return vk::Format::eR8G8B8A8Uint;
+    case ShaderType::Uint16x2:
+        return vk::Format::eR16G16Uint;
     }
+
+    return vk::Format::eUndefined;
 }
 
 static inline vk::PolygonMode convert_polygon_mode(PolygonMode polygon_mode)
@@ -171,6 +192,8 @@ static vk::ImageLayout convert_texture_layout(TextureLayout layout)
     {
     case TextureLayout::Undefined:
         return vk::ImageLayout::eUndefined;
+    case TextureLayout::ColorAttachment:
+        return vk::ImageLayout::eColorAttachmentOptimal;
     case TextureLayout::DepthStencilAttachment:
         return vk::ImageLayout::eDepthStencilAttachmentOptimal;
     case TextureLayout::CopyDst:
@@ -199,732 +222,2928 @@ static vk::SamplerCreateInfo convert_sampler(Sampler sampler)
         vk::False);
 }
 
-PipelineCache::PipelineCache()
-{
-}
-
-Expected<vk::Pipeline> PipelineCache::get_or_create(Material *material, vk::RenderPass render_pass)
+static std::vector<uint32_t> read_shader_code(const char *filename)
 {
-    auto iter = m_pipelines.find({.material = material, .render_pass = render_pass});
+    std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+    ERR_COND_V(!ifs.is_open(), "Shader %s does not exists", filename);
 
-    if (iter != m_pipelines.end())
+    if (!ifs)
     {
-        return iter->second;
+        return {};
     }
-    else
-    {
-        MaterialVulkan *material_vk = (MaterialVulkan *)material;
-        Ref<MaterialLayoutVulkan> layout = material_vk->get_layout().cast_to<MaterialLayoutVulkan>();
 
-        auto pipeline_result = RenderingDriverVulkan::get()->create_graphics_pipeline(layout->m_shaders, layout->m_instance_layout, layout->m_polygon_mode, layout->m_cull_mode, layout->m_transparency, layout->m_always_draw_before, layout->m_pipeline_layout, render_pass);
-        YEET(pipeline_result);
+    size_t size = ifs.tellg();
 
-        m_pipelines[{.material = material, .render_pass = render_pass}] = pipeline_result.value();
-        return pipeline_result.value();
-    }
-}
+    ifs.seekg(0, std::ios::beg);
 
-SamplerCache::SamplerCache()
-{
+    // SPIR-V is a stream of 32-bit words.
+    std::vector<uint32_t> data(size / sizeof(uint32_t));
+
+    ifs.read((char *)data.data(), (std::streamsize)(data.size() * sizeof(uint32_t)));
+
+    return data;
 }
 
-Expected<vk::Sampler> SamplerCache::get_or_create(Sampler sampler)
+static uint64_t hash_shader_code(const std::vector<uint32_t>& code)
 {
-    auto iter = m_samplers.find(sampler);
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
 
-    if (iter != m_samplers.end())
+    for (uint32_t word : code)
     {
-        return iter->second;
+        hash ^= word;
+        hash *= 0x100000001b3;
     }
-    else
-    {
-        auto sampler_vk_result = RenderingDriverVulkan::get()->get_device().createSampler(convert_sampler(sampler));
-        YEET_RESULT(sampler_vk_result);
 
-        m_samplers[sampler] = sampler_vk_result.value;
-        return sampler_vk_result.value;
-    }
+    return hash;
 }
 
-RenderingDriverVulkan::RenderingDriverVulkan()
+ShaderModuleCache::ShaderModuleCache()
 {
 }
 
-RenderingDriverVulkan::~RenderingDriverVulkan()
+Expected<vk::ShaderModule> ShaderModuleCache::acquire(const char *filename)
 {
-    if (m_device)
-    {
-        destroy_swapchain();
+    std::lock_guard<std::mutex> guard(m_mutex);
 
-        m_device.destroyRenderPass(m_render_pass);
+    auto hash_iter = m_hashes.find(filename);
 
-        m_device.destroyQueryPool(m_timestamp_query_pool);
+    if (hash_iter != m_hashes.end())
+    {
+        Module& module = m_modules[hash_iter->second];
+        module.ref_count += 1;
+        return module.module;
+    }
 
-        for (size_t i = 0; i < max_frames_in_flight; i++)
-        {
-            m_device.destroySemaphore(m_acquire_semaphores[i]);
-            m_device.destroySemaphore(m_submit_semaphores[i]);
-            m_device.destroyFence(m_frame_fences[i]);
-        }
+    std::vector<uint32_t> code = read_shader_code(filename);
 
-        m_device.freeCommandBuffers(m_graphics_command_pool, m_command_buffers);
-        m_device.destroyCommandPool(m_graphics_command_pool);
+    if (code.empty())
+        return Error::unexpected<vk::ShaderModule>(ErrorKind::Unknown);
 
-        m_device.destroy();
-    }
+    const uint64_t hash = hash_shader_code(code);
+    auto module_iter = m_modules.find(hash);
 
-    if (m_instance)
+    if (module_iter == m_modules.end())
     {
-        m_instance.destroySurfaceKHR(m_surface);
-        m_instance.destroy();
+        auto module_result = RenderingDriverVulkan::get()->get_device().createShaderModule(vk::ShaderModuleCreateInfo({}, code.size() * sizeof(uint32_t), code.data()));
+        YEET_RESULT(module_result);
+
+        module_iter = m_modules.emplace(hash, Module{.module = module_result.value, .ref_count = 0}).first;
     }
+
+    m_hashes[filename] = hash;
+    module_iter->second.ref_count += 1;
+
+    return module_iter->second.module;
 }
 
-std::expected<void, Error> RenderingDriverVulkan::initialize(const Window& window)
+void ShaderModuleCache::release(const char *filename)
 {
-    Uint32 instance_extensions_count = 0;
-    auto instance_extensions = SDL_Vulkan_GetInstanceExtensions(&instance_extensions_count);
+    std::lock_guard<std::mutex> guard(m_mutex);
 
-    vk::ApplicationInfo app_info("ft_vox", 0, "No engine", 0, VK_API_VERSION_1_2);
+    auto hash_iter = m_hashes.find(filename);
+    ERR_COND_VR(hash_iter == m_hashes.end(), "Shader %s was never acquired", filename);
 
-    std::vector<const char *> validation_layers;
+    const uint64_t hash = hash_iter->second;
+    Module& module = m_modules[hash];
 
-#ifdef __DEBUG__
-    validation_layers.push_back("VK_LAYER_KHRONOS_validation");
-#endif
+    module.ref_count -= 1;
 
-    std::vector<char *> required_instance_extensions(instance_extensions_count);
-    for (size_t i = 0; i < instance_extensions_count; i++)
-        required_instance_extensions[i] = (char *)instance_extensions[i];
+    if (module.ref_count > 0)
+        return;
 
-    auto instance_result = vk::createInstance(vk::InstanceCreateInfo({}, &app_info, validation_layers.size(), validation_layers.data(), required_instance_extensions.size(), required_instance_extensions.data()));
-    YEET_RESULT(instance_result);
-    if (instance_result.result != vk::Result::eSuccess)
-        return std::unexpected(instance_result.result);
-    m_instance = instance_result.value;
+    RenderingDriverVulkan::get()->get_device().destroyShaderModule(module.module);
+    m_modules.erase(hash);
 
-    VkSurfaceKHR surface;
+    std::erase_if(m_hashes, [hash](const auto& pair)
+                  { return pair.second == hash; });
+}
 
-    if (!SDL_Vulkan_CreateSurface(window.get_window_ptr(), m_instance, nullptr, &surface))
-        return std::unexpected(ErrorKind::BadDriver);
-    m_surface = surface;
+void ShaderModuleCache::destroy()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
 
-    // Select the best physical device
-    vk::PhysicalDeviceFeatures required_features = {};
-    vk::PhysicalDeviceFeatures optional_features = {};
+    for (const auto& [hash, module] : m_modules)
+        RenderingDriverVulkan::get()->get_device().destroyShaderModule(module.module);
 
-    std::vector<const char *> required_extensions;
-    std::vector<const char *> optional_extensions;
+    m_modules.clear();
+    m_hashes.clear();
+}
 
-    required_extensions.push_back("VK_KHR_swapchain");
+PipelineCache::PipelineCache()
+{
+}
 
-#ifdef __TARGET_APPLE__
-    required_extensions.push_back("VK_KHR_portability_subset");
-#endif
+void PipelineCache::start_workers(size_t worker_count)
+{
+    for (size_t i = 0; i < worker_count; i++)
+        m_workers.push_back(std::thread(&PipelineCache::worker_loop, this));
+}
 
-    vk::PhysicalDeviceHostQueryResetFeatures host_query_reset_features{};
+void PipelineCache::request(MaterialLayout *layout, vk::RenderPass render_pass)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
 
-#ifdef __DEBUG__
-    host_query_reset_features.hostQueryReset = vk::True;
-#endif
+    const Key key{.layout = layout, .render_pass = render_pass};
 
-#ifdef __TARGET_APPLE__
-    vk::PhysicalDevicePortabilitySubsetFeaturesKHR portability_subset_features;
-    portability_subset_features.imageViewFormatSwizzle = vk::True;
+    if (m_pipelines.contains(key))
+        return;
 
-    host_query_reset_features.pNext = &portability_subset_features;
-#endif
+    m_pipelines[key] = Entry{};
 
-    std::vector<vk::PhysicalDevice> physical_devices = m_instance.enumeratePhysicalDevices().value;
-    std::optional<PhysicalDeviceWithInfo> physical_device_with_info_result = pick_best_device(physical_devices, required_extensions, optional_extensions);
+    // Without workers the pipeline is compiled by the next call to `get`.
+    if (m_workers.empty())
+        return;
 
-    if (!physical_device_with_info_result.has_value())
-        return std::unexpected(ErrorKind::NoSuitableDevice);
+    m_queue.push_back(key);
+    m_condition.notify_one();
+}
 
-    m_physical_device = physical_device_with_info_result->physical_device;
-    m_physical_device_properties = physical_device_with_info_result->properties;
-    m_surface_format = physical_device_with_info_result->surface_format;
+Expected<vk::Pipeline> PipelineCache::get(MaterialLayout *layout, vk::RenderPass render_pass)
+{
+    const Key key{.layout = layout, .render_pass = render_pass};
 
-    std::println("info: GPU selected: {}", m_physical_device_properties.deviceName.data());
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
 
-    auto surface_capabilities_result = m_physical_device.getSurfaceCapabilitiesKHR(m_surface);
-    if (surface_capabilities_result.result != vk::Result::eSuccess)
-        return std::unexpected(surface_capabilities_result.result);
-    m_surface_capabilities = surface_capabilities_result.value;
+        auto iter = m_pipelines.find(key);
 
-    auto surface_present_modes_result = m_physical_device.getSurfacePresentModesKHR(m_surface);
-    if (surface_present_modes_result.result != vk::Result::eSuccess)
-        return std::unexpected(surface_present_modes_result.result);
-    m_surface_present_modes = surface_present_modes_result.value;
+        if (iter != m_pipelines.end())
+        {
+            switch (iter->second.state)
+            {
+            case State::Ready:
+                return iter->second.pipeline;
+            case State::Failed:
+                return std::unexpected(iter->second.error.value());
+            case State::Compiling:
+                return vk::Pipeline();
+            case State::Pending:
+                if (!m_workers.empty())
+                    return vk::Pipeline();
+                break;
+            }
+        }
+    }
 
-    // Create the actual device used to interact with vulkan
-    m_graphics_queue_index = physical_device_with_info_result->queue_info.graphics_index.value();
-    m_compute_queue_index = physical_device_with_info_result->queue_info.compute_index.value();
+    if (m_workers.empty())
+    {
+        request(layout, render_pass);
+        // A failure is kept in the entry and returned by the next `get`.
+        (void)compile(key);
+        return get(layout, render_pass);
+    }
 
-    float queue_priority = 1.0f;
-    std::array<vk::DeviceQueueCreateInfo, 2> queue_infos{
-        vk::DeviceQueueCreateInfo({}, m_graphics_queue_index, 1, &queue_priority),
-        vk::DeviceQueueCreateInfo({}, m_compute_queue_index, 1, &queue_priority),
-    };
+    request(layout, render_pass);
+    return vk::Pipeline();
+}
 
-    std::vector<const char *> device_extensions;
-    device_extensions.reserve(required_extensions.size() + optional_extensions.size());
+void PipelineCache::worker_loop()
+{
+    while (true)
+    {
+        Key key;
 
-    for (const auto& ext : required_extensions)
-        device_extensions.push_back(ext);
-    for (const auto& ext : optional_extensions)
-        device_extensions.push_back(ext);
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]()
+                             { return m_stopping || !m_queue.empty(); });
 
-    // TODO: device features
-    vk::PhysicalDeviceFeatures device_features{};
+            if (m_stopping)
+                return;
 
-    auto device_result = m_physical_device.createDevice(vk::DeviceCreateInfo({}, queue_infos.size(), queue_infos.data(), validation_layers.size(), validation_layers.data(), device_extensions.size(), device_extensions.data(), &device_features, &host_query_reset_features));
-    YEET_RESULT(device_result);
-    m_device = device_result.value;
+            key = m_queue.front();
+            m_queue.pop_front();
 
-    m_graphics_queue = m_device.getQueue(m_graphics_queue_index, 0);
-    m_compute_queue = m_device.getQueue(m_compute_queue_index, 0);
+            // Marked while the lock is held so `evict` never misses a compilation about to start.
+            m_pipelines[key].state = State::Compiling;
+        }
 
-    // Allocate enough command buffers and synchronization primitives for each frame in flight.
-    auto gcp_result = m_device.createCommandPool(vk::CommandPoolCreateInfo(vk::CommandPoolCreateFlagBits::eResetCommandBuffer, m_graphics_queue_index));
-    YEET_RESULT(gcp_result);
-    m_graphics_command_pool = gcp_result.value;
+        // The error is kept in the entry and also returned by `get`.
+        auto compile_result = compile(key);
+        if (!compile_result.has_value())
+            compile_result.error().print();
+    }
+}
 
-    auto buffer_alloc_result = m_device.allocateCommandBuffers(vk::CommandBufferAllocateInfo(m_graphics_command_pool, vk::CommandBufferLevel::ePrimary, max_frames_in_flight));
-    YEET_RESULT(buffer_alloc_result);
+Expected<void> PipelineCache::compile(Key key)
+{
+    MaterialLayoutVulkan *layout = (MaterialLayoutVulkan *)key.layout;
 
-    for (size_t i = 0; i < max_frames_in_flight; i++)
-    {
-        m_acquire_semaphores[i] = m_device.createSemaphore(vk::SemaphoreCreateInfo()).value;
-        m_frame_fences[i] = m_device.createFence(vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled)).value;
-        m_command_buffers[i] = buffer_alloc_result.value[i];
-    }
+    auto pipeline_result = RenderingDriverVulkan::get()->create_graphics_pipeline(layout->m_shaders, layout->m_vertex_layout, layout->m_instance_layout, layout->m_flags.instanced_view_matrix, layout->m_polygon_mode, layout->m_cull_mode, layout->m_transparency, layout->m_always_draw_before, layout->m_pipeline_layout, key.render_pass);
 
-    m_swapchain_image_count = m_surface_capabilities.maxImageCount == 0 ? m_surface_capabilities.minImageCount + 1 : std::min(m_surface_capabilities.maxImageCount, m_surface_capabilities.minImageCount + 1);
+    std::lock_guard<std::mutex> guard(m_mutex);
+    Entry& entry = m_pipelines[key];
 
-    // We need one submit semaphore per swapchain images.
-    m_submit_semaphores.resize(m_swapchain_image_count);
+    m_compiled_condition.notify_all();
 
-    for (size_t i = 0; i < m_swapchain_image_count; i++)
+    if (!pipeline_result.has_value())
     {
-        m_submit_semaphores[i] = m_device.createSemaphore(vk::SemaphoreCreateInfo()).value;
+        entry.state = State::Failed;
+        entry.error = pipeline_result.error();
+        return std::unexpected(pipeline_result.error());
     }
 
-    auto transfer_buffer_result = m_device.allocateCommandBuffers(vk::CommandBufferAllocateInfo(m_graphics_command_pool, vk::CommandBufferLevel::ePrimary, 1));
-    YEET_RESULT(transfer_buffer_result);
-    m_transfer_buffer = transfer_buffer_result.value[0];
+    entry.state = State::Ready;
+    entry.pipeline = pipeline_result.value();
 
-    m_timestamp_query_pool = m_device.createQueryPool(vk::QueryPoolCreateInfo({}, vk::QueryType::eTimestamp, max_frames_in_flight * 2)).value;
-    for (size_t i = 0; i < max_frames_in_flight; i++)
-        m_device.resetQueryPool(m_timestamp_query_pool, i * 2, 2);
+    for (const auto& shader : layout->m_shaders)
+        entry.shader_files.push_back(shader.filename);
 
-    m_memory_properties = m_physical_device.getMemoryProperties();
+    return {};
+}
 
-    // Create a render pass for the output
-    std::array<vk::AttachmentDescription, 2> attachments{
-        vk::AttachmentDescription(
-            {},
-            m_surface_format.format, vk::SampleCountFlagBits::e1,
-            vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eStore,
-            vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
-            vk::ImageLayout::eUndefined, vk::ImageLayout::ePresentSrcKHR),
-        vk::AttachmentDescription(
-            {},
-            vk::Format::eD32Sfloat, vk::SampleCountFlagBits::e1,
-            vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eDontCare,
-            vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
-            vk::ImageLayout::eUndefined, vk::ImageLayout::eDepthStencilAttachmentOptimal),
-    };
+void PipelineCache::evict(const MaterialLayout *layout, uint64_t last_use)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
 
-    const vk::AttachmentReference color_attach(0, vk::ImageLayout::eColorAttachmentOptimal);
-    const vk::AttachmentReference depth_attach(1, vk::ImageLayout::eDepthStencilAttachmentOptimal);
+    std::erase_if(m_queue, [layout](const Key& key)
+                  { return key.layout == layout; });
 
-    vk::SubpassDescription subpass({}, vk::PipelineBindPoint::eGraphics, {}, {color_attach}, {}, &depth_attach);
+    // A worker may still read the layout, wait for it before the layout is freed.
+    m_compiled_condition.wait(lock, [this, layout]()
+                              { return std::none_of(m_pipelines.begin(), m_pipelines.end(), [layout](const auto& pair)
+                                                    { return pair.first.layout == layout && pair.second.state == State::Compiling; }); });
 
-    vk::SubpassDependency dependency(
-        vk::SubpassExternal, 0,
-        vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests, vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests,
-        {}, vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite);
+    for (auto iter = m_pipelines.begin(); iter != m_pipelines.end();)
+    {
+        if (iter->first.layout != layout)
+        {
+            iter++;
+            continue;
+        }
 
-    auto render_pass_result = m_device.createRenderPass(vk::RenderPassCreateInfo({}, attachments, {subpass}, {dependency}));
-    YEET_RESULT(render_pass_result);
-    m_render_pass = render_pass_result.value;
+        // Frames in flight may still bind the pipeline.
+        if (iter->second.state == State::Ready)
+            m_retired.push_back({last_use, std::move(iter->second)});
 
-    YEET(configure_surface(window, VSync::On));
+        iter = m_pipelines.erase(iter);
+    }
+}
 
-    m_start_time = std::chrono::high_resolution_clock::now();
+void PipelineCache::reclaim(uint64_t completed)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
 
-    return {};
+    while (!m_retired.empty() && m_retired.front().first <= completed)
+    {
+        destroy_entry(m_retired.front().second);
+        m_retired.pop_front();
+    }
 }
 
-Expected<void> RenderingDriverVulkan::configure_surface(const Window& window, VSync vsync)
+void PipelineCache::destroy()
 {
-    (void)m_device.waitIdle();
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stopping = true;
+        m_queue.clear();
+    }
 
-    vk::PresentModeKHR present_mode;
+    m_condition.notify_all();
 
-    switch (vsync)
+    for (auto& worker : m_workers)
+        worker.join();
+
+    m_workers.clear();
+
+    for (const auto& [key, entry] : m_pipelines)
     {
-    case VSync::Off:
-        present_mode = vk::PresentModeKHR::eImmediate;
-        break;
-    case VSync::On:
-        present_mode = vk::PresentModeKHR::eFifoRelaxed;
-        break;
+        if (entry.state == State::Ready)
+            destroy_entry(entry);
     }
 
-    // According to the vulkan spec only FIFO is required to be supported so we fallback on that if other modes are not supported.
-    if (std::find(m_surface_present_modes.begin(), m_surface_present_modes.end(), present_mode) == m_surface_present_modes.end())
-        present_mode = vk::PresentModeKHR::eFifo;
+    for (const auto& [last_use, entry] : m_retired)
+        destroy_entry(entry);
 
-    const auto& size = window.size();
+    m_pipelines.clear();
+    m_retired.clear();
+}
 
-    const vk::Extent2D surface_extent(std::clamp(size.width, m_surface_capabilities.minImageExtent.width, m_surface_capabilities.maxImageExtent.width),
-                                      std::clamp(size.height, m_surface_capabilities.minImageExtent.height, m_surface_capabilities.maxImageExtent.height));
+void PipelineCache::destroy_entry(const Entry& entry)
+{
+    RenderingDriverVulkan *driver = RenderingDriverVulkan::get();
 
-    auto swapchain_result = m_device.createSwapchainKHR(vk::SwapchainCreateInfoKHR(
-        {},
-        m_surface,
-        m_swapchain_image_count,
-        m_surface_format.format, m_surface_format.colorSpace,
-        surface_extent,
-        1,
-        vk::ImageUsageFlagBits::eColorAttachment,
-        vk::SharingMode::eExclusive,
-        0, nullptr,
-        m_surface_capabilities.currentTransform,
-        vk::CompositeAlphaFlagBitsKHR::eOpaque,
-        present_mode,
-        vk::True,
-        m_swapchain));
-    YEET_RESULT(swapchain_result);
+    driver->get_device().destroyPipeline(entry.pipeline);
 
-    auto depth_texture_result = create_texture(surface_extent.width, surface_extent.height, TextureFormat::D32, {.depth_attachment = 1});
-    YEET(depth_texture_result);
+    for (const auto& filename : entry.shader_files)
+        driver->get_shader_module_cache().release(filename.c_str());
+}
 
-    Ref<TextureVulkan> depth_texture_vk = depth_texture_result.value().cast_to<TextureVulkan>();
+RecordingWorkers::RecordingWorkers()
+{
+}
 
-    auto swapchain_images_result = m_device.getSwapchainImagesKHR(swapchain_result.value);
-    YEET_RESULT(swapchain_images_result);
+void RecordingWorkers::start(size_t worker_count)
+{
+    for (size_t i = 0; i < worker_count; i++)
+        m_threads.push_back(std::thread(&RecordingWorkers::worker_loop, this));
+}
 
-    std::vector<Ref<Texture>> swapchain_textures;
-    swapchain_textures.reserve(swapchain_images_result.value.size());
+void RecordingWorkers::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stopping = true;
+    }
 
-    std::vector<vk::Framebuffer> swapchain_framebuffers;
-    swapchain_framebuffers.reserve(swapchain_images_result.value.size());
+    m_condition.notify_all();
 
-    for (const auto& swapchain_image : swapchain_images_result.value)
+    for (auto& thread : m_threads)
+        thread.join();
+
+    m_threads.clear();
+}
+
+void RecordingWorkers::run(size_t count, const std::function<void(size_t)>& job)
+{
+    if (m_threads.empty() || count <= 1)
     {
-        auto texture_result = create_texture_from_vk_image(swapchain_image, surface_extent.width, surface_extent.height, m_surface_format.format);
-        YEET(texture_result);
+        for (size_t i = 0; i < count; i++)
+            job(i);
+        return;
+    }
 
-        Ref<TextureVulkan> texture = texture_result.value().cast_to<TextureVulkan>();
+    std::unique_lock<std::mutex> lock(m_mutex);
 
-        swapchain_textures.push_back(texture.cast_to<Texture>());
+    // A late worker from the previous job may still be reading the fields.
+    m_done_condition.wait(lock, [this]()
+                          { return m_active == 0; });
 
-        std::array<vk::ImageView, 2> attachments = {texture->image_view, depth_texture_vk->image_view};
+    m_job = &job;
+    m_count = count;
+    m_next = 0;
+    m_generation += 1;
 
-        auto framebuffer_result = m_device.createFramebuffer(vk::FramebufferCreateInfo({}, m_render_pass, attachments, surface_extent.width, surface_extent.height, 1));
-        YEET_RESULT(framebuffer_result);
+    lock.unlock();
+    m_condition.notify_all();
+
+    work();
+
+    lock.lock();
+    m_done_condition.wait(lock, [this]()
+                          { return m_active == 0; });
+
+    m_job = nullptr;
+}
+
+void RecordingWorkers::worker_loop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t generation = m_generation;
+
+    while (true)
+    {
+        m_condition.wait(lock, [&]()
+                         { return m_stopping || m_generation != generation; });
+
+        if (m_stopping)
+            return;
+
+        generation = m_generation;
+        m_active += 1;
+
+        lock.unlock();
+        work();
+        lock.lock();
+
+        m_active -= 1;
+
+        if (m_active == 0)
+            m_done_condition.notify_all();
+    }
+}
+
+void RecordingWorkers::work()
+{
+    while (true)
+    {
+        const size_t index = m_next.fetch_add(1);
+
+        if (index >= m_count)
+            break;
+
+        (*m_job)(index);
+    }
+}
+
+SamplerCache::SamplerCache()
+{
+}
+
+Expected<vk::Sampler> SamplerCache::get_or_create(Sampler sampler)
+{
+    auto iter = m_samplers.find(sampler);
+
+    if (iter != m_samplers.end())
+    {
+        return iter->second;
+    }
+    else
+    {
+        auto sampler_vk_result = RenderingDriverVulkan::get()->get_device().createSampler(convert_sampler(sampler));
+        YEET_RESULT(sampler_vk_result);
+
+        m_samplers[sampler] = sampler_vk_result.value;
+        return sampler_vk_result.value;
+    }
+}
+
+void StagingBuffer::destroy(vk::Device device, MemoryAllocator& allocator)
+{
+    if (!m_buffer)
+        return;
+
+    allocator.free(m_memory);
+    device.destroyBuffer(m_buffer);
+}
+
+std::optional<StagingBuffer::Allocation> StagingBuffer::allocate(size_t size, size_t alignment, size_t frame)
+{
+    if (m_used == 0)
+        m_head = 0;
+
+    // The occupied region is `[tail, head)`, possibly wrapping around the end of the ring.
+    const size_t tail = (m_head + m_capacity - m_used) % m_capacity;
+    const size_t aligned_head = (m_head + alignment - 1) & ~(alignment - 1);
+
+    size_t offset;
+    size_t consumed;
+
+    if (tail <= m_head && m_used < m_capacity)
+    {
+        if (aligned_head + size <= m_capacity)
+        {
+            offset = aligned_head;
+            consumed = aligned_head + size - m_head;
+        }
+        else if (size <= tail)
+        {
+            // Skip the end of the ring and restart from the beginning.
+            offset = 0;
+            consumed = m_capacity - m_head + size;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+    else if (aligned_head + size <= tail)
+    {
+        offset = aligned_head;
+        consumed = aligned_head + size - m_head;
+    }
+    else
+    {
+        return std::nullopt;
+    }
+
+    m_head = (offset + size) % m_capacity;
+    m_used += consumed;
+    m_frame_used[frame] += consumed;
+
+    return Allocation{.buffer = m_buffer, .offset = offset, .ptr = m_mapped + offset};
+}
+
+void StagingBuffer::reclaim(size_t frame)
+{
+    m_used -= m_frame_used[frame];
+    m_frame_used[frame] = 0;
+}
+
+Expected<void> BindlessHeap::create(vk::Device device, uint32_t max_textures, uint32_t max_buffers)
+{
+    std::array<vk::DescriptorSetLayoutBinding, 2> bindings{
+        vk::DescriptorSetLayoutBinding(texture_binding, vk::DescriptorType::eCombinedImageSampler, max_textures, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment, nullptr),
+        vk::DescriptorSetLayoutBinding(buffer_binding, vk::DescriptorType::eStorageBuffer, max_buffers, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment, nullptr),
+    };
+
+    // Only the indices in use are valid, and new ones are written while frames reading other indices are in flight.
+    const vk::DescriptorBindingFlags binding_flags = vk::DescriptorBindingFlagBits::ePartiallyBound | vk::DescriptorBindingFlagBits::eUpdateAfterBind | vk::DescriptorBindingFlagBits::eUpdateUnusedWhilePending;
+    std::array<vk::DescriptorBindingFlags, 2> bindings_flags{binding_flags, binding_flags};
+
+    vk::DescriptorSetLayoutBindingFlagsCreateInfo bindings_flags_info(bindings_flags);
+
+    auto layout_result = device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo(vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPool, bindings, &bindings_flags_info));
+    YEET_RESULT(layout_result);
+    m_layout = layout_result.value;
+
+    std::array<vk::DescriptorPoolSize, 2> sizes{
+        vk::DescriptorPoolSize(vk::DescriptorType::eCombinedImageSampler, max_textures),
+        vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, max_buffers),
+    };
+
+    auto pool_result = device.createDescriptorPool(vk::DescriptorPoolCreateInfo(vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind, 1, sizes));
+    YEET_RESULT(pool_result);
+    m_pool = pool_result.value;
+
+    auto set_result = device.allocateDescriptorSets(vk::DescriptorSetAllocateInfo(m_pool, 1, &m_layout));
+    YEET_RESULT(set_result);
+    m_set = set_result.value[0];
+
+    m_textures.capacity = max_textures;
+    m_buffers.capacity = max_buffers;
+
+    return {};
+}
+
+void BindlessHeap::destroy(vk::Device device)
+{
+    device.destroyDescriptorPool(m_pool);
+    device.destroyDescriptorSetLayout(m_layout);
+}
+
+Expected<uint32_t> BindlessHeap::add_texture(vk::Device device, vk::ImageView image_view, vk::Sampler sampler)
+{
+    std::optional<uint32_t> index = m_textures.take();
+
+    if (!index.has_value())
+        return std::unexpected(vk::Result::eErrorOutOfPoolMemory);
+
+    vk::DescriptorImageInfo image_info(sampler, image_view, vk::ImageLayout::eShaderReadOnlyOptimal);
+    device.updateDescriptorSets({vk::WriteDescriptorSet(m_set, texture_binding, index.value(), 1, vk::DescriptorType::eCombinedImageSampler, &image_info, nullptr, nullptr)}, {});
+
+    return index.value();
+}
+
+Expected<uint32_t> BindlessHeap::add_buffer(vk::Device device, vk::Buffer buffer, vk::DeviceSize size)
+{
+    std::optional<uint32_t> index = m_buffers.take();
+
+    if (!index.has_value())
+        return std::unexpected(vk::Result::eErrorOutOfPoolMemory);
+
+    vk::DescriptorBufferInfo buffer_info(buffer, 0, size);
+    device.updateDescriptorSets({vk::WriteDescriptorSet(m_set, buffer_binding, index.value(), 1, vk::DescriptorType::eStorageBuffer, nullptr, &buffer_info, nullptr)}, {});
+
+    return index.value();
+}
+
+void BindlessHeap::remove_texture(uint32_t index, uint64_t last_use)
+{
+    m_textures.retired.push_back({last_use, index});
+}
+
+void BindlessHeap::remove_buffer(uint32_t index, uint64_t last_use)
+{
+    m_buffers.retired.push_back({last_use, index});
+}
+
+void BindlessHeap::reclaim(uint64_t completed)
+{
+    m_textures.reclaim(completed);
+    m_buffers.reclaim(completed);
+}
+
+std::optional<uint32_t> BindlessHeap::Slots::take()
+{
+    if (!free.empty())
+    {
+        const uint32_t index = free.back();
+        free.pop_back();
+        return index;
+    }
+
+    if (next < capacity)
+        return next++;
+
+    return std::nullopt;
+}
+
+void BindlessHeap::Slots::reclaim(uint64_t completed)
+{
+    while (!retired.empty() && retired.front().first <= completed)
+    {
+        free.push_back(retired.front().second);
+        retired.pop_front();
+    }
+}
+
+RenderingDriverVulkan::RenderingDriverVulkan()
+{
+}
+
+RenderingDriverVulkan::~RenderingDriverVulkan()
+{
+    if (m_device)
+    {
+        (void)m_device.waitIdle();
+
+        // Stop the compilation workers before the cache they use is destroyed.
+        m_pipeline_cache.destroy();
+        m_shader_module_cache.destroy();
+
+        for (const auto& layout : m_retired_material_layouts)
+            destroy_material_layout(layout);
+        m_retired_material_layouts.clear();
+
+        save_pipeline_cache();
+        m_device.destroyPipelineCache(m_vk_pipeline_cache);
+
+        if (m_pipeline_creation_count > 0)
+            std::println("info: {} pipelines created in {} ms", m_pipeline_creation_count.load(), m_pipeline_creation_time_us / 1000.0);
+
+        for (size_t i = 0; i < max_frames_in_flight; i++)
+        {
+            for (const auto& [buffer, memory] : m_staging_overflow[i])
+            {
+                m_allocator.free(memory);
+                m_device.destroyBuffer(buffer);
+            }
+        }
+
+        m_staging_buffer.destroy(m_device, m_allocator);
+
+        m_allocator.free(m_instance_memory);
+        m_device.destroyBuffer(m_instance_buffer);
+
+        // Buffers owned by the driver must be released while the allocator and the device still exist.
+        m_mesh_pool.destroy();
+        m_quad_indices = nullptr;
+
+        destroy_swapchain();
+
+        m_device.destroyRenderPass(m_render_pass);
+
+        m_device.destroyPipelineLayout(m_bindless_pipeline_layout);
+        m_bindless_heap.destroy(m_device);
+
+        m_device.destroyQueryPool(m_timestamp_query_pool);
+
+#ifdef TRACY_ENABLE
+        if (m_tracy_context)
+            TracyVkDestroy(m_tracy_context);
+#endif
+
+        for (size_t i = 0; i < max_frames_in_flight; i++)
+        {
+            m_device.destroySemaphore(m_acquire_semaphores[i]);
+            m_device.destroySemaphore(m_submit_semaphores[i]);
+            m_device.destroyFence(m_frame_fences[i]);
+        }
+
+        m_recording_workers.stop();
+
+        for (const auto& context : m_recording_contexts)
+        {
+            for (const auto& pool : context.command_pools)
+                m_device.destroyCommandPool(pool);
+        }
+
+        m_device.freeCommandBuffers(m_graphics_command_pool, m_command_buffers);
+        m_device.freeCommandBuffers(m_transfer_command_pool, m_upload_buffers);
+        m_device.destroyCommandPool(m_graphics_command_pool);
+
+        if (m_async_transfer)
+            m_device.destroyCommandPool(m_transfer_command_pool);
+
+        m_device.destroySemaphore(m_graphics_timeline);
+        m_device.destroySemaphore(m_transfer_timeline);
+
+        m_allocator.destroy();
+
+        m_device.destroy();
+    }
+
+    if (m_instance)
+    {
+        m_instance.destroySurfaceKHR(m_surface);
+        m_instance.destroy();
+    }
+}
+
+std::expected<void, Error> RenderingDriverVulkan::initialize(const Window& window)
+{
+    // Headless windows have no surface to present to, frames are rendered offscreen and read back instead.
+    m_offscreen = window.is_headless();
+
+    Uint32 instance_extensions_count = 0;
+    const char *const *instance_extensions = nullptr;
+
+    if (!m_offscreen)
+        instance_extensions = SDL_Vulkan_GetInstanceExtensions(&instance_extensions_count);
+
+    vk::ApplicationInfo app_info("ft_vox", 0, "No engine", 0, VK_API_VERSION_1_2);
+
+    std::vector<const char *> validation_layers;
+
+#ifdef __DEBUG__
+    validation_layers.push_back("VK_LAYER_KHRONOS_validation");
+#endif
+
+    std::vector<char *> required_instance_extensions(instance_extensions_count);
+    for (size_t i = 0; i < instance_extensions_count; i++)
+        required_instance_extensions[i] = (char *)instance_extensions[i];
+
+    auto instance_result = vk::createInstance(vk::InstanceCreateInfo({}, &app_info, validation_layers.size(), validation_layers.data(), required_instance_extensions.size(), required_instance_extensions.data()));
+    YEET_RESULT(instance_result);
+    if (instance_result.result != vk::Result::eSuccess)
+        return std::unexpected(instance_result.result);
+    m_instance = instance_result.value;
+
+    if (!m_offscreen)
+    {
+        VkSurfaceKHR surface;
+
+        if (!SDL_Vulkan_CreateSurface(window.get_window_ptr(), m_instance, nullptr, &surface))
+            return std::unexpected(ErrorKind::BadDriver);
+        m_surface = surface;
+    }
+
+    // Select the best physical device
+    vk::PhysicalDeviceFeatures required_features = {};
+    vk::PhysicalDeviceFeatures optional_features = {};
+
+    std::vector<const char *> required_extensions;
+    std::vector<const char *> optional_extensions;
+
+    if (!m_offscreen)
+        required_extensions.push_back("VK_KHR_swapchain");
+
+#ifdef __TARGET_APPLE__
+    required_extensions.push_back("VK_KHR_portability_subset");
+#endif
+
+    vk::PhysicalDeviceHostQueryResetFeatures host_query_reset_features{};
+
+#ifdef __DEBUG__
+    host_query_reset_features.hostQueryReset = vk::True;
+#endif
+
+    // Timeline semaphores are core since Vulkan 1.2 and used to synchronize uploads with rendering.
+    vk::PhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features{};
+    timeline_semaphore_features.timelineSemaphore = vk::True;
+
+    host_query_reset_features.pNext = &timeline_semaphore_features;
+
+    // Descriptor indexing is core since Vulkan 1.2 but optional, it is only enabled when everything bindless
+    // materials need is supported.
+    vk::PhysicalDeviceDescriptorIndexingFeatures descriptor_indexing_features{};
+
+    timeline_semaphore_features.pNext = &descriptor_indexing_features;
+
+#ifdef __TARGET_APPLE__
+    vk::PhysicalDevicePortabilitySubsetFeaturesKHR portability_subset_features;
+    portability_subset_features.imageViewFormatSwizzle = vk::True;
+
+    descriptor_indexing_features.pNext = &portability_subset_features;
+#endif
+
+    std::vector<vk::PhysicalDevice> physical_devices = m_instance.enumeratePhysicalDevices().value;
+    std::optional<PhysicalDeviceWithInfo> physical_device_with_info_result = pick_best_device(physical_devices, required_extensions, optional_extensions);
+
+    if (!physical_device_with_info_result.has_value())
+        return std::unexpected(ErrorKind::NoSuitableDevice);
+
+    m_physical_device = physical_device_with_info_result->physical_device;
+    m_physical_device_properties = physical_device_with_info_result->properties;
+    m_surface_format = physical_device_with_info_result->surface_format;
+
+    std::println("info: GPU selected: {}", m_physical_device_properties.deviceName.data());
+
+    {
+        const auto supported_chain = m_physical_device.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceDescriptorIndexingFeatures>();
+        const auto& supported = supported_chain.get<vk::PhysicalDeviceDescriptorIndexingFeatures>();
+
+        m_bindless_supported = supported.runtimeDescriptorArray && supported.descriptorBindingPartiallyBound && supported.descriptorBindingUpdateUnusedWhilePending && supported.descriptorBindingSampledImageUpdateAfterBind && supported.descriptorBindingStorageBufferUpdateAfterBind && supported.shaderSampledImageArrayNonUniformIndexing && supported.shaderStorageBufferArrayNonUniformIndexing;
+
+        if (m_bindless_supported)
+        {
+            descriptor_indexing_features.runtimeDescriptorArray = vk::True;
+            descriptor_indexing_features.descriptorBindingPartiallyBound = vk::True;
+            descriptor_indexing_features.descriptorBindingUpdateUnusedWhilePending = vk::True;
+            descriptor_indexing_features.descriptorBindingSampledImageUpdateAfterBind = vk::True;
+            descriptor_indexing_features.descriptorBindingStorageBufferUpdateAfterBind = vk::True;
+            descriptor_indexing_features.shaderSampledImageArrayNonUniformIndexing = vk::True;
+            descriptor_indexing_features.shaderStorageBufferArrayNonUniformIndexing = vk::True;
+        }
+    }
+
+    if (!m_offscreen)
+    {
+        auto surface_capabilities_result = m_physical_device.getSurfaceCapabilitiesKHR(m_surface);
+        if (surface_capabilities_result.result != vk::Result::eSuccess)
+            return std::unexpected(surface_capabilities_result.result);
+        m_surface_capabilities = surface_capabilities_result.value;
+
+        auto surface_present_modes_result = m_physical_device.getSurfacePresentModesKHR(m_surface);
+        if (surface_present_modes_result.result != vk::Result::eSuccess)
+            return std::unexpected(surface_present_modes_result.result);
+        m_surface_present_modes = surface_present_modes_result.value;
+    }
+    else
+    {
+        std::println("info: No surface, frames are rendered offscreen");
+    }
+
+    // Create the actual device used to interact with vulkan
+    m_graphics_queue_index = physical_device_with_info_result->queue_info.graphics_index.value();
+    m_compute_queue_index = physical_device_with_info_result->queue_info.compute_index.value_or(m_graphics_queue_index);
+    m_transfer_queue_index = physical_device_with_info_result->queue_info.transfer_index.value_or(m_graphics_queue_index);
+    m_async_transfer = m_transfer_queue_index != m_graphics_queue_index;
+    m_shared_queue_indices = {m_graphics_queue_index, m_transfer_queue_index};
+
+    if (m_async_transfer)
+        std::println("info: Uploads use the dedicated transfer queue family {}", m_transfer_queue_index);
+
+    // A queue family can only appear once when creating the device.
+    float queue_priority = 1.0f;
+    StackVector<vk::DeviceQueueCreateInfo, 3> queue_infos;
+
+    for (uint32_t family : {m_graphics_queue_index, m_compute_queue_index, m_transfer_queue_index})
+    {
+        bool duplicate = false;
+
+        for (size_t i = 0; i < queue_infos.size(); i++)
+            duplicate |= queue_infos.data()[i].queueFamilyIndex == family;
+
+        if (!duplicate)
+            queue_infos.push_back(vk::DeviceQueueCreateInfo({}, family, 1, &queue_priority));
+    }
+
+    std::vector<const char *> device_extensions;
+    device_extensions.reserve(required_extensions.size() + optional_extensions.size());
+
+    for (const auto& ext : required_extensions)
+        device_extensions.push_back(ext);
+    for (const auto& ext : optional_extensions)
+        device_extensions.push_back(ext);
+
+    // TODO: device features
+    vk::PhysicalDeviceFeatures device_features{};
+
+    auto device_result = m_physical_device.createDevice(vk::DeviceCreateInfo({}, queue_infos.size(), queue_infos.data(), validation_layers.size(), validation_layers.data(), device_extensions.size(), device_extensions.data(), &device_features, &host_query_reset_features));
+    YEET_RESULT(device_result);
+    m_device = device_result.value;
+
+    m_graphics_queue = m_device.getQueue(m_graphics_queue_index, 0);
+    m_compute_queue = m_device.getQueue(m_compute_queue_index, 0);
+    m_transfer_queue = m_device.getQueue(m_transfer_queue_index, 0);
+
+    vk::SemaphoreTypeCreateInfo timeline_type_info(vk::SemaphoreType::eTimeline, 0);
+
+    auto graphics_timeline_result = m_device.createSemaphore(vk::SemaphoreCreateInfo({}, &timeline_type_info));
+    YEET_RESULT(graphics_timeline_result);
+    m_graphics_timeline = graphics_timeline_result.value;
+
+    auto transfer_timeline_result = m_device.createSemaphore(vk::SemaphoreCreateInfo({}, &timeline_type_info));
+    YEET_RESULT(transfer_timeline_result);
+    m_transfer_timeline = transfer_timeline_result.value;
+
+    // Allocate enough command buffers and synchronization primitives for each frame in flight.
+    auto gcp_result = m_device.createCommandPool(vk::CommandPoolCreateInfo(vk::CommandPoolCreateFlagBits::eResetCommandBuffer, m_graphics_queue_index));
+    YEET_RESULT(gcp_result);
+    m_graphics_command_pool = gcp_result.value;
+
+    auto buffer_alloc_result = m_device.allocateCommandBuffers(vk::CommandBufferAllocateInfo(m_graphics_command_pool, vk::CommandBufferLevel::ePrimary, max_frames_in_flight));
+    YEET_RESULT(buffer_alloc_result);
+
+    for (size_t i = 0; i < max_frames_in_flight; i++)
+    {
+        m_acquire_semaphores[i] = m_device.createSemaphore(vk::SemaphoreCreateInfo()).value;
+        m_frame_fences[i] = m_device.createFence(vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled)).value;
+        m_command_buffers[i] = buffer_alloc_result.value[i];
+    }
+
+    // Offscreen, each frame in flight has its own target.
+    if (m_offscreen)
+        m_swapchain_image_count = max_frames_in_flight;
+    else
+        m_swapchain_image_count = m_surface_capabilities.maxImageCount == 0 ? m_surface_capabilities.minImageCount + 1 : std::min(m_surface_capabilities.maxImageCount, m_surface_capabilities.minImageCount + 1);
+
+    // We need one submit semaphore per swapchain images.
+    m_submit_semaphores.resize(m_swapchain_image_count);
+
+    for (size_t i = 0; i < m_swapchain_image_count; i++)
+    {
+        m_submit_semaphores[i] = m_device.createSemaphore(vk::SemaphoreCreateInfo()).value;
+    }
+
+    if (m_async_transfer)
+    {
+        auto tcp_result = m_device.createCommandPool(vk::CommandPoolCreateInfo(vk::CommandPoolCreateFlagBits::eResetCommandBuffer, m_transfer_queue_index));
+        YEET_RESULT(tcp_result);
+        m_transfer_command_pool = tcp_result.value;
+    }
+    else
+    {
+        m_transfer_command_pool = m_graphics_command_pool;
+    }
+
+    auto upload_buffers_result = m_device.allocateCommandBuffers(vk::CommandBufferAllocateInfo(m_transfer_command_pool, vk::CommandBufferLevel::ePrimary, max_frames_in_flight));
+    YEET_RESULT(upload_buffers_result);
+
+    for (size_t i = 0; i < max_frames_in_flight; i++)
+        m_upload_buffers[i] = upload_buffers_result.value[i];
+
+    // One context for each thread recording draws, including the main thread.
+    const size_t recording_worker_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()) - 1, 8);
+
+    m_recording_contexts.resize(recording_worker_count + 1);
+
+    for (auto& context : m_recording_contexts)
+    {
+        for (size_t i = 0; i < max_frames_in_flight; i++)
+        {
+            auto pool_result = m_device.createCommandPool(vk::CommandPoolCreateInfo(vk::CommandPoolCreateFlagBits::eTransient, m_graphics_queue_index));
+            YEET_RESULT(pool_result);
+            context.command_pools[i] = pool_result.value;
+        }
+    }
+
+    m_recording_workers.start(recording_worker_count);
+
+    YEET(load_pipeline_cache());
+
+    // Keep a core for the main thread.
+    m_pipeline_cache.start_workers(std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()) - 1, 4));
+
+    // Queries are reset by the command buffer of each frame, resetting them from the host needs an extra feature.
+    const uint32_t timestamp_valid_bits = m_physical_device.getQueueFamilyProperties()[m_graphics_queue_index].timestampValidBits;
+    m_timestamps_supported = timestamp_valid_bits > 0 && m_physical_device_properties.limits.timestampPeriod > 0.0f;
+    m_timestamp_mask = timestamp_valid_bits >= 64 ? UINT64_MAX : (1ull << timestamp_valid_bits) - 1;
+
+    auto query_pool_result = m_device.createQueryPool(vk::QueryPoolCreateInfo({}, vk::QueryType::eTimestamp, max_frames_in_flight * max_timestamps_per_frame));
+    YEET_RESULT(query_pool_result);
+    m_timestamp_query_pool = query_pool_result.value;
+
+#ifdef TRACY_ENABLE
+    if (m_timestamps_supported)
+    {
+        // Tracy calibrates its GPU clock with a command buffer submitted right away.
+        auto tracy_cb_result = m_device.allocateCommandBuffers(vk::CommandBufferAllocateInfo(m_graphics_command_pool, vk::CommandBufferLevel::ePrimary, 1));
+        YEET_RESULT(tracy_cb_result);
+
+        m_tracy_context = TracyVkContext(m_physical_device, m_device, m_graphics_queue, tracy_cb_result.value[0]);
+        m_device.freeCommandBuffers(m_graphics_command_pool, tracy_cb_result.value);
+    }
+#endif
+
+    m_memory_properties = m_physical_device.getMemoryProperties();
+    m_allocator.initialize(m_device, m_memory_properties);
+
+    if (m_bindless_supported)
+    {
+        const auto properties_chain = m_physical_device.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceDescriptorIndexingProperties>();
+        const auto& limits = properties_chain.get<vk::PhysicalDeviceDescriptorIndexingProperties>();
+
+        const uint32_t max_textures = std::min({bindless_max_textures, limits.maxDescriptorSetUpdateAfterBindSampledImages, limits.maxDescriptorSetUpdateAfterBindSamplers, limits.maxPerStageDescriptorUpdateAfterBindSampledImages, limits.maxPerStageDescriptorUpdateAfterBindSamplers});
+        const uint32_t max_buffers = std::min({bindless_max_buffers, limits.maxDescriptorSetUpdateAfterBindStorageBuffers, limits.maxPerStageDescriptorUpdateAfterBindStorageBuffers});
+
+        YEET(m_bindless_heap.create(m_device, max_textures, max_buffers));
+
+        std::array<vk::PushConstantRange, 1> push_constant_ranges{
+            vk::PushConstantRange(vk::ShaderStageFlagBits::eVertex, 0, sizeof(PushConstants)),
+        };
+        std::array<vk::DescriptorSetLayout, 1> descriptor_set_layouts{m_bindless_heap.layout()};
+
+        auto pipeline_layout_result = m_device.createPipelineLayout(vk::PipelineLayoutCreateInfo({}, descriptor_set_layouts, push_constant_ranges));
+        YEET_RESULT(pipeline_layout_result);
+        m_bindless_pipeline_layout = pipeline_layout_result.value;
+
+        std::println("info: Bindless materials are supported, with up to {} textures and {} storage buffers", max_textures, max_buffers);
+    }
+
+    // Buffers can be written directly by the CPU when the largest device local heap is also host visible, instead of
+    // the small BAR window found on discrete GPUs.
+    uint32_t largest_heap = 0;
+
+    for (uint32_t i = 0; i < m_memory_properties.memoryHeapCount; i++)
+    {
+        if (m_memory_properties.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal && m_memory_properties.memoryHeaps[i].size > m_memory_properties.memoryHeaps[largest_heap].size)
+            largest_heap = i;
+    }
+
+    for (uint32_t i = 0; i < m_memory_properties.memoryTypeCount; i++)
+    {
+        const vk::MemoryType& type = m_memory_properties.memoryTypes[i];
+
+        if (type.heapIndex == largest_heap && (type.propertyFlags & (vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible)) == (vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible))
+            m_direct_upload = true;
+    }
+
+    if (m_direct_upload)
+        std::println("info: Device local memory is host visible, buffers are written without staging");
+
+    // Create the staging ring used by every upload, it stays mapped for the lifetime of the driver.
+    auto staging_buffer_result = m_device.createBuffer(vk::BufferCreateInfo({}, staging_buffer_size, vk::BufferUsageFlagBits::eTransferSrc));
+    YEET_RESULT(staging_buffer_result);
+
+    auto staging_memory_result = allocate_memory_for_buffer(staging_buffer_result.value, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+    YEET(staging_memory_result);
+
+    m_staging_buffer = StagingBuffer(staging_buffer_result.value, staging_memory_result.value(), staging_buffer_size);
+
+    vk::BufferCreateInfo instance_buffer_info({}, instance_buffer_size * max_frames_in_flight, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst);
+    set_sharing_mode(instance_buffer_info);
+
+    auto instance_buffer_result = m_device.createBuffer(instance_buffer_info);
+    YEET_RESULT(instance_buffer_result);
+    m_instance_buffer = instance_buffer_result.value;
+
+    auto instance_memory_result = allocate_memory_for_buffer(m_instance_buffer, vk::MemoryPropertyFlagBits::eDeviceLocal);
+    YEET(instance_memory_result);
+    m_instance_memory = instance_memory_result.value();
+
+    // Create a render pass for the output, offscreen targets are left ready to be copied to their readback buffer.
+    const vk::ImageLayout color_final_layout = m_offscreen ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR;
+
+    std::array<vk::AttachmentDescription, 2> attachments{
+        vk::AttachmentDescription(
+            {},
+            m_surface_format.format, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eStore,
+            vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined, color_final_layout),
+        vk::AttachmentDescription(
+            {},
+            vk::Format::eD32Sfloat, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eDontCare,
+            vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined, vk::ImageLayout::eDepthStencilAttachmentOptimal),
+    };
+
+    const vk::AttachmentReference color_attach(0, vk::ImageLayout::eColorAttachmentOptimal);
+    const vk::AttachmentReference depth_attach(1, vk::ImageLayout::eDepthStencilAttachmentOptimal);
+
+    vk::SubpassDescription subpass({}, vk::PipelineBindPoint::eGraphics, {}, {color_attach}, {}, &depth_attach);
+
+    std::vector<vk::SubpassDependency> dependencies{
+        vk::SubpassDependency(
+            vk::SubpassExternal, 0,
+            vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests, vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests,
+            {}, vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite),
+    };
+
+    // The copy to the readback buffer must wait for the color writes of the pass.
+    if (m_offscreen)
+    {
+        dependencies.push_back(vk::SubpassDependency(
+            0, vk::SubpassExternal,
+            vk::PipelineStageFlagBits::eColorAttachmentOutput, vk::PipelineStageFlagBits::eTransfer,
+            vk::AccessFlagBits::eColorAttachmentWrite, vk::AccessFlagBits::eTransferRead));
+    }
+
+    auto render_pass_result = m_device.createRenderPass(vk::RenderPassCreateInfo({}, attachments, {subpass}, dependencies));
+    YEET_RESULT(render_pass_result);
+    m_render_pass = render_pass_result.value;
+
+    YEET(configure_surface(window, VSync::On));
+
+    return {};
+}
+
+Expected<void> RenderingDriverVulkan::configure_surface(const Window& window, VSync vsync)
+{
+    (void)m_device.waitIdle();
+
+    if (m_offscreen)
+        return configure_offscreen(window);
+
+    // Present modes by order of preference. According to the vulkan spec only FIFO is required to be supported so we
+    // fallback on that if other modes are not supported.
+    static constexpr std::array<vk::PresentModeKHR, 2> off_present_modes{vk::PresentModeKHR::eImmediate, vk::PresentModeKHR::eMailbox};
+    static constexpr std::array<vk::PresentModeKHR, 1> mailbox_present_modes{vk::PresentModeKHR::eMailbox};
+
+    Span<vk::PresentModeKHR> present_modes;
+
+    switch (vsync)
+    {
+    case VSync::Off:
+        present_modes = off_present_modes;
+        break;
+    case VSync::On:
+        // FIFO relaxed tears when a frame is late, which is not what vertical synchronization promises.
+        break;
+    case VSync::Mailbox:
+        present_modes = mailbox_present_modes;
+        break;
+    }
+
+    vk::PresentModeKHR present_mode = vk::PresentModeKHR::eFifo;
+
+    for (const auto& mode : present_modes)
+    {
+        if (std::find(m_surface_present_modes.begin(), m_surface_present_modes.end(), mode) != m_surface_present_modes.end())
+        {
+            present_mode = mode;
+            break;
+        }
+    }
+
+    const auto& size = window.size();
+
+    const vk::Extent2D surface_extent(std::clamp(size.width, m_surface_capabilities.minImageExtent.width, m_surface_capabilities.maxImageExtent.width),
+                                      std::clamp(size.height, m_surface_capabilities.minImageExtent.height, m_surface_capabilities.maxImageExtent.height));
+
+    auto swapchain_result = m_device.createSwapchainKHR(vk::SwapchainCreateInfoKHR(
+        {},
+        m_surface,
+        m_swapchain_image_count,
+        m_surface_format.format, m_surface_format.colorSpace,
+        surface_extent,
+        1,
+        vk::ImageUsageFlagBits::eColorAttachment,
+        vk::SharingMode::eExclusive,
+        0, nullptr,
+        m_surface_capabilities.currentTransform,
+        vk::CompositeAlphaFlagBitsKHR::eOpaque,
+        present_mode,
+        vk::True,
+        m_swapchain));
+    YEET_RESULT(swapchain_result);
+
+    auto depth_texture_result = create_texture(surface_extent.width, surface_extent.height, TextureFormat::D32, {.depth_attachment = 1, .transient = 1});
+    YEET(depth_texture_result);
+
+    Ref<TextureVulkan> depth_texture_vk = depth_texture_result.value().cast_to<TextureVulkan>();
+
+    auto swapchain_images_result = m_device.getSwapchainImagesKHR(swapchain_result.value);
+    YEET_RESULT(swapchain_images_result);
+
+    std::vector<Ref<Texture>> swapchain_textures;
+    swapchain_textures.reserve(swapchain_images_result.value.size());
+
+    std::vector<vk::Framebuffer> swapchain_framebuffers;
+    swapchain_framebuffers.reserve(swapchain_images_result.value.size());
+
+    for (const auto& swapchain_image : swapchain_images_result.value)
+    {
+        auto texture_result = create_texture_from_vk_image(swapchain_image, surface_extent.width, surface_extent.height, m_surface_format.format);
+        YEET(texture_result);
+
+        Ref<TextureVulkan> texture = texture_result.value().cast_to<TextureVulkan>();
+
+        swapchain_textures.push_back(texture.cast_to<Texture>());
+
+        std::array<vk::ImageView, 2> attachments = {texture->image_view, depth_texture_vk->image_view};
+
+        auto framebuffer_result = m_device.createFramebuffer(vk::FramebufferCreateInfo({}, m_render_pass, attachments, surface_extent.width, surface_extent.height, 1));
+        YEET_RESULT(framebuffer_result);
 
         swapchain_framebuffers.push_back(framebuffer_result.value);
     }
 
-    destroy_swapchain();
+    destroy_swapchain();
+
+    m_swapchain = swapchain_result.value;
+    m_depth_texture = depth_texture_result.value();
+    m_swapchain_images = std::move(swapchain_images_result.value);
+    m_swapchain_textures = std::move(swapchain_textures);
+    m_swapchain_framebuffers = std::move(swapchain_framebuffers);
+    m_surface_extent = Extent2D(surface_extent.width, surface_extent.height);
+
+    return {};
+}
+
+void RenderingDriverVulkan::destroy_swapchain()
+{
+    for (const auto& fb : m_swapchain_framebuffers)
+        m_device.destroyFramebuffer(fb);
+
+    m_swapchain_framebuffers.clear();
+    m_swapchain_textures.clear();
+    m_depth_texture = nullptr;
+    m_offscreen_targets.clear();
+
+    for (size_t i = 0; i < max_frames_in_flight; i++)
+    {
+        if (!m_readback_buffers[i])
+            continue;
+
+        m_allocator.free(m_readback_memory[i]);
+        m_device.destroyBuffer(m_readback_buffers[i]);
+
+        m_readback_buffers[i] = nullptr;
+        m_readback_memory[i] = MemoryAllocation();
+        m_readback_pending[i] = 0;
+    }
+
+    if (m_swapchain)
+        m_device.destroySwapchainKHR(m_swapchain);
+}
+
+Expected<void> RenderingDriverVulkan::configure_offscreen(const Window& window)
+{
+    const WindowSize size = window.size();
+    const vk::DeviceSize readback_size = (vk::DeviceSize)size.width * size.height * 4;
+
+    destroy_swapchain();
+
+    auto depth_texture_result = create_texture(size.width, size.height, TextureFormat::D32, {.depth_attachment = 1, .transient = 1});
+    YEET(depth_texture_result);
+
+    Ref<TextureVulkan> depth_texture_vk = depth_texture_result.value().cast_to<TextureVulkan>();
+
+    for (size_t i = 0; i < max_frames_in_flight; i++)
+    {
+        vk::ImageCreateInfo create_info({}, vk::ImageType::e2D, m_surface_format.format, vk::Extent3D(size.width, size.height, 1), 1, 1, vk::SampleCountFlagBits::e1, vk::ImageTiling::eOptimal, vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc, vk::SharingMode::eExclusive);
+        set_sharing_mode(create_info);
+
+        auto image_result = m_device.createImage(create_info);
+        YEET_RESULT(image_result);
+
+        auto memory_result = allocate_memory_for_image(image_result.value, vk::MemoryPropertyFlagBits::eDeviceLocal);
+        YEET(memory_result);
+
+        auto image_view_result = m_device.createImageView(vk::ImageViewCreateInfo({}, image_result.value, vk::ImageViewType::e2D, m_surface_format.format, {}, vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1)));
+        YEET_RESULT(image_view_result);
+
+        m_offscreen_targets.push_back(std::make_unique<TextureVulkan>(image_result.value, memory_result.value(), image_view_result.value, size.width, size.height, readback_size, vk::ImageAspectFlagBits::eColor, 1, true));
+
+        std::array<vk::ImageView, 2> attachments = {image_view_result.value, depth_texture_vk->image_view};
+
+        auto framebuffer_result = m_device.createFramebuffer(vk::FramebufferCreateInfo({}, m_render_pass, attachments, size.width, size.height, 1));
+        YEET_RESULT(framebuffer_result);
+
+        m_swapchain_framebuffers.push_back(framebuffer_result.value);
+
+        // Readback buffers are only read by the CPU, which is much faster from cached memory.
+        vk::BufferCreateInfo buffer_info({}, readback_size, vk::BufferUsageFlagBits::eTransferDst);
+        set_sharing_mode(buffer_info);
+
+        auto buffer_result = m_device.createBuffer(buffer_info);
+        YEET_RESULT(buffer_result);
+        m_readback_buffers[i] = buffer_result.value;
+
+        auto readback_memory_result = allocate_memory_for_buffer(buffer_result.value, vk::MemoryPropertyFlagBits::eHostVisible, vk::MemoryPropertyFlagBits::eHostCached);
+        YEET(readback_memory_result);
+        m_readback_memory[i] = readback_memory_result.value();
+    }
+
+    m_depth_texture = depth_texture_result.value();
+    m_surface_extent = Extent2D(size.width, size.height);
+
+    // The last frame read back does not have the size of the targets anymore.
+    m_readback_pixels.clear();
+    m_readback_frame = 0;
+
+    return {};
+}
+
+void RenderingDriverVulkan::record_readback(vk::CommandBuffer cb, uint32_t target)
+{
+    const TextureVulkan *texture = m_offscreen_targets[target].get();
+
+    vk::BufferImageCopy region(0, 0, 0, vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1), vk::Offset3D(0, 0, 0), vk::Extent3D(m_surface_extent.width, m_surface_extent.height, 1));
+    cb.copyImageToBuffer(texture->image, vk::ImageLayout::eTransferSrcOptimal, m_readback_buffers[m_current_frame], {region});
+
+    // The host reads the buffer once the fence of the frame is signaled.
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost, {}, {vk::MemoryBarrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead)}, {}, {});
+
+    m_readback_pending[m_current_frame] = m_graphics_timeline_value + 1;
+}
+
+void RenderingDriverVulkan::read_back(size_t frame)
+{
+    if (m_readback_pending[frame] == 0)
+        return;
+
+    const MemoryAllocation& memory = m_readback_memory[frame];
+    const vk::DeviceSize size = (vk::DeviceSize)m_surface_extent.width * m_surface_extent.height * 4;
+
+    if (!(m_memory_properties.memoryTypes[memory.memory_type].propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent))
+        invalidate_memory(memory, 0, size);
+
+    // Copied out right away, the buffer is written again by the next frame using this slot.
+    m_readback_pixels.assign(memory.ptr, memory.ptr + size);
+    m_readback_frame = m_readback_pending[frame];
+    m_readback_pending[frame] = 0;
+}
+
+std::optional<FrameReadback> RenderingDriverVulkan::get_readback()
+{
+    // Read the frames still in flight from the oldest to the most recent.
+    std::array<size_t, max_frames_in_flight> frames;
+    std::iota(frames.begin(), frames.end(), 0);
+    std::sort(frames.begin(), frames.end(), [this](size_t a, size_t b)
+              { return m_readback_pending[a] < m_readback_pending[b]; });
+
+    for (size_t frame : frames)
+    {
+        if (m_readback_pending[frame] != 0 && !wait_frame(frame).has_value())
+            return std::nullopt;
+    }
+
+    if (m_readback_frame == 0)
+        return std::nullopt;
+
+    return FrameReadback{
+        .pixels = Span<uint8_t>(m_readback_pixels),
+        .width = m_surface_extent.width,
+        .height = m_surface_extent.height,
+        .frame = m_readback_frame,
+    };
+}
+
+void RenderingDriverVulkan::limit_frames(uint32_t limit)
+{
+    m_frame_pacer.set_limit(limit);
+}
+
+void RenderingDriverVulkan::set_low_latency(bool enabled)
+{
+    m_low_latency = enabled;
+}
+
+void RenderingDriverVulkan::begin_frame()
+{
+    // The previous frame has to be finished on the GPU before the input of this one is sampled, so at most one frame
+    // is queued instead of `max_frames_in_flight`.
+    if (m_low_latency)
+        ERR_EXPECT_R(wait_frame((m_current_frame + max_frames_in_flight - 1) % max_frames_in_flight), "Failed to wait for the previous frame");
+
+    m_frame_pacer.wait();
+    m_frame_began = true;
+}
+
+FrameTimeStats RenderingDriverVulkan::get_frame_time_stats() const
+{
+    return m_frame_pacer.stats();
+}
+
+Expected<Ref<Buffer>> RenderingDriverVulkan::create_buffer(size_t size, BufferUsage usage, BufferVisibility visibility)
+{
+    vk::MemoryPropertyFlags memory_properties{};
+
+    switch (visibility)
+    {
+    case BufferVisibility::GPUOnly:
+        memory_properties = vk::MemoryPropertyFlagBits::eDeviceLocal;
+
+        // Buffers updated from the CPU are written in place when possible.
+        if (m_direct_upload && usage.copy_dst)
+            memory_properties |= vk::MemoryPropertyFlagBits::eHostVisible;
+        break;
+    case BufferVisibility::GPUAndCPU:
+    case BufferVisibility::Dynamic:
+        memory_properties = vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible;
+        break;
+    }
+
+    // Dynamic buffers hold one copy per frame in flight, each aligned so it can be bound or flushed on its own.
+    const bool dynamic = visibility == BufferVisibility::Dynamic;
+    const size_t alignment = std::max<size_t>({m_physical_device_properties.limits.minUniformBufferOffsetAlignment, m_physical_device_properties.limits.nonCoherentAtomSize, 16});
+    const size_t frame_stride = dynamic ? (size + alignment - 1) / alignment * alignment : 0;
+
+    vk::BufferCreateInfo create_info({}, dynamic ? frame_stride * max_frames_in_flight : size, convert_buffer_usage(usage));
+    set_sharing_mode(create_info);
+
+    auto buffer_result = m_device.createBuffer(create_info);
+    YEET_RESULT(buffer_result);
+
+    auto memory_result = allocate_memory_for_buffer(buffer_result.value, memory_properties, vk::MemoryPropertyFlagBits::eHostCoherent);
+
+    if (!memory_result.has_value() && visibility == BufferVisibility::GPUOnly)
+        memory_result = allocate_memory_for_buffer(buffer_result.value, vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+    // Device local memory visible from the host is not always available, host memory read through the bus is fine
+    // for data written every frame.
+    if (!memory_result.has_value() && dynamic)
+        memory_result = allocate_memory_for_buffer(buffer_result.value, vk::MemoryPropertyFlagBits::eHostVisible);
+
+    YEET(memory_result);
+
+    const bool coherent = (bool)(m_memory_properties.memoryTypes[memory_result->memory_type].propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent);
+
+    return make_ref<BufferVulkan>(buffer_result.value, memory_result.value(), size, dynamic, frame_stride, coherent).cast_to<Buffer>();
+}
+
+Expected<Ref<Texture>> RenderingDriverVulkan::create_texture(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage)
+{
+    const vk::Format vk_format = convert_texture_format(format);
+
+    vk::ImageCreateInfo create_info(
+        {},
+        vk::ImageType::e2D,
+        vk_format,
+        vk::Extent3D(width, height, 1),
+        1, // mipLevels
+        1,
+        vk::SampleCountFlagBits::e1,
+        vk::ImageTiling::eOptimal,
+        convert_texture_usage(usage),
+        vk::SharingMode::eExclusive);
+    set_sharing_mode(create_info);
+
+    auto image_result = m_device.createImage(create_info);
+    YEET_RESULT(image_result);
+
+    // Attachments which are never stored do not need physical memory on tilers.
+    const vk::MemoryPropertyFlags preferred = usage.transient ? vk::MemoryPropertyFlagBits::eLazilyAllocated : vk::MemoryPropertyFlags();
+
+    auto memory_result = allocate_memory_for_image(image_result.value, vk::MemoryPropertyFlagBits::eDeviceLocal, preferred);
+    YEET(memory_result);
+
+    // TODO: format_to_aspect_mask()
+    vk::ImageAspectFlags aspect_mask = format == TextureFormat::D32 ? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eColor;
+
+    auto image_view_result = m_device.createImageView(vk::ImageViewCreateInfo({}, image_result.value, vk::ImageViewType::e2D, vk_format, {}, vk::ImageSubresourceRange(aspect_mask, 0, 1, 0, 1)));
+    YEET_RESULT(image_view_result);
+
+    return make_ref<TextureVulkan>(image_result.value, memory_result.value(), image_view_result.value, width, height, width * height * size_of(format), aspect_mask, 1, true).cast_to<Texture>();
+}
+
+Expected<Ref<Texture>> RenderingDriverVulkan::create_texture_array(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage, uint32_t layers)
+{
+    const vk::Format vk_format = convert_texture_format(format);
+
+    vk::ImageCreateInfo create_info(
+        {},
+        vk::ImageType::e2D,
+        vk_format,
+        vk::Extent3D(width, height, 1),
+        1, // mipLevels
+        layers,
+        vk::SampleCountFlagBits::e1,
+        vk::ImageTiling::eOptimal,
+        convert_texture_usage(usage),
+        vk::SharingMode::eExclusive);
+    set_sharing_mode(create_info);
+
+    auto image_result = m_device.createImage(create_info);
+    YEET_RESULT(image_result);
+
+    auto memory_result = allocate_memory_for_image(image_result.value, vk::MemoryPropertyFlagBits::eDeviceLocal);
+    YEET(memory_result);
+
+    // TODO: format_to_aspect_mask()
+    vk::ImageAspectFlags aspect_mask = format == TextureFormat::D32 ? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eColor;
+
+    auto image_view_result = m_device.createImageView(vk::ImageViewCreateInfo({}, image_result.value, vk::ImageViewType::e2DArray, vk_format, {}, vk::ImageSubresourceRange(aspect_mask, 0, 1, 0, 1)));
+    YEET_RESULT(image_view_result);
+
+    return make_ref<TextureVulkan>(image_result.value, memory_result.value(), image_view_result.value, width, height, width * height * size_of(format), aspect_mask, layers, true).cast_to<Texture>();
+}
+
+Expected<Ref<Texture>> RenderingDriverVulkan::create_texture_cube(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage)
+{
+    const vk::Format vk_format = convert_texture_format(format);
+
+    vk::ImageCreateInfo create_info(
+        vk::ImageCreateFlagBits::eCubeCompatible,
+        vk::ImageType::e2D,
+        vk_format,
+        vk::Extent3D(width, height, 1),
+        1, // mipLevels
+        6,
+        vk::SampleCountFlagBits::e1,
+        vk::ImageTiling::eOptimal,
+        convert_texture_usage(usage),
+        vk::SharingMode::eExclusive);
+    set_sharing_mode(create_info);
+
+    auto image_result = m_device.createImage(create_info);
+    YEET_RESULT(image_result);
+
+    auto memory_result = allocate_memory_for_image(image_result.value, vk::MemoryPropertyFlagBits::eDeviceLocal);
+    YEET(memory_result);
+
+    // TODO: format_to_aspect_mask()
+    vk::ImageAspectFlags aspect_mask = format == TextureFormat::D32 ? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eColor;
+
+    auto image_view_result = m_device.createImageView(vk::ImageViewCreateInfo({}, image_result.value, vk::ImageViewType::eCube, vk_format, {}, vk::ImageSubresourceRange(aspect_mask, 0, 1, 0, 1)));
+    YEET_RESULT(image_view_result);
+
+    return make_ref<TextureVulkan>(image_result.value, memory_result.value(), image_view_result.value, width, height, width * height * size_of(format), aspect_mask, 1, true).cast_to<Texture>();
+}
+
+Expected<Ref<Mesh>> RenderingDriverVulkan::create_mesh(IndexType index_type, Span<uint8_t> indices, const VertexLayout& layout, Span<Span<uint8_t>> streams)
+{
+    if (streams.size() == 0 || streams.size() > VertexLayout::max_streams || streams.size() != layout.strides.size())
+        return Error::unexpected<Ref<Mesh>>(ErrorKind::Unknown);
+
+    const size_t vertex_count = streams[0].size() / layout.strides[0];
+
+    // The streams are read with the same vertex index, a shorter stream would read the next mesh of the page.
+    for (size_t stream = 0; stream < streams.size(); stream++)
+    {
+        if (streams[stream].size() != vertex_count * layout.strides[stream])
+            return Error::unexpected<Ref<Mesh>>(ErrorKind::Unknown);
+    }
+
+    const size_t index_count = indices.size() / size_of(index_type);
+
+    Ref<MeshVulkan> mesh = make_ref<MeshVulkan>(index_type, convert_index_type(index_type), index_count);
+    YEET(m_mesh_pool.add(mesh.ptr(), indices, layout.strides, streams, (uint32_t)vertex_count));
+
+    return mesh.cast_to<Mesh>();
+}
+
+Expected<Ref<Mesh>> RenderingDriverVulkan::create_pulled_mesh(uint32_t first_quad, uint32_t quad_count, uint32_t first_instance)
+{
+    if (m_quad_indices.is_null())
+    {
+        std::vector<uint16_t> indices;
+        indices.reserve(quad_pattern_count * 6);
+
+        for (uint32_t quad = 0; quad < quad_pattern_count; quad++)
+        {
+            const uint16_t base = (uint16_t)(quad * 4);
+
+            for (uint16_t corner : {0, 1, 2, 2, 3, 0})
+                indices.push_back(base + corner);
+        }
+
+        Span<uint16_t> indices_span = indices;
+
+        auto buffer_result = create_buffer_from_data(indices.size() * sizeof(uint16_t), indices_span.as_bytes(), {.copy_dst = 1, .index = 1});
+        YEET(buffer_result);
+
+        m_quad_indices = buffer_result.value();
+    }
+
+    Ref<MeshVulkan> mesh = make_ref<MeshVulkan>(IndexType::Uint16, vk::IndexType::eUint16, (size_t)quad_count * 6);
+    mesh->pulled = true;
+    mesh->first_quad = first_quad;
+    mesh->quad_count = quad_count;
+    mesh->first_instance = first_instance;
+
+    return mesh.cast_to<Mesh>();
+}
+
+Expected<Ref<MaterialLayout>> RenderingDriverVulkan::create_material_layout(Span<ShaderRef> shaders, Span<MaterialParam> params, MaterialFlags flags, std::optional<InstanceLayout> instance_layout, CullMode cull_mode, PolygonMode polygon_mode, bool transparency, bool always_draw_before, const VertexLayout& vertex_layout)
+{
+    // Pulled vertices are fetched by the shaders, their pipelines have no vertex input.
+    const VertexLayout input_layout = flags.vertex_pulling ? VertexLayout({}, {}) : vertex_layout;
+
+    if (flags.vertex_pulling)
+        instance_layout = std::nullopt;
+
+    if (flags.bindless)
+    {
+        if (!m_bindless_supported)
+            return Error::unexpected<Ref<MaterialLayout>>(ErrorKind::UnsupportedFeature);
+
+        // Resources are read from the bindless set, there is nothing to bind per material.
+        Ref<MaterialLayout> layout = make_ref<MaterialLayoutVulkan>(m_bindless_heap.layout(), DescriptorPool(), shaders.to_vector(), input_layout, instance_layout, std::vector<MaterialParam>(), convert_polygon_mode(polygon_mode), convert_cull_mode(cull_mode), flags, m_bindless_pipeline_layout, transparency, always_draw_before).cast_to<MaterialLayout>();
+
+        m_pipeline_cache.request(layout.ptr(), m_render_pass);
+
+        return layout;
+    }
+
+    std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    bindings.reserve(params.size());
+
+    uint32_t binding = 0;
+
+    for (const auto& param : params)
+    {
+        vk::DescriptorType type = vk::DescriptorType::eUniformBuffer;
+
+        if (param.kind == MaterialParamKind::Texture)
+            type = vk::DescriptorType::eCombinedImageSampler;
+        else if (param.kind == MaterialParamKind::StorageBuffer)
+            type = vk::DescriptorType::eStorageBuffer;
+
+        bindings.push_back(vk::DescriptorSetLayoutBinding(binding, type, 1, convert_shader_stage(param.shader_kind), nullptr));
+        binding += 1;
+    }
+
+    auto layout_result = RenderingDriverVulkan::get()->get_device().createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo({}, bindings));
+    YEET_RESULT(layout_result);
+
+    auto pool_result = DescriptorPool::create(layout_result.value, params);
+    YEET(pool_result);
+
+    std::array<vk::PushConstantRange, 1> push_constant_ranges{
+        vk::PushConstantRange(vk::ShaderStageFlagBits::eVertex, 0, sizeof(PushConstants)),
+    };
+    std::array<vk::DescriptorSetLayout, 1> descriptor_set_layouts{layout_result.value};
+
+    auto pipeline_layout_result = RenderingDriverVulkan::get()->get_device().createPipelineLayout(vk::PipelineLayoutCreateInfo({}, descriptor_set_layouts, push_constant_ranges));
+    YEET_RESULT(pipeline_layout_result);
+
+    Ref<MaterialLayout> layout = make_ref<MaterialLayoutVulkan>(layout_result.value, pool_result.value(), shaders.to_vector(), input_layout, instance_layout, params.to_vector(), convert_polygon_mode(polygon_mode), convert_cull_mode(cull_mode), flags, pipeline_layout_result.value, transparency, always_draw_before).cast_to<MaterialLayout>();
+
+    // Start compiling right away so the pipeline is likely ready by the time something is drawn with it.
+    m_pipeline_cache.request(layout.ptr(), m_render_pass);
+
+    return layout;
+}
+
+Expected<Ref<Material>> RenderingDriverVulkan::create_material(MaterialLayout *layout)
+{
+    MaterialLayoutVulkan *layout_vk = (MaterialLayoutVulkan *)layout;
+
+    if (layout_vk->m_flags.bindless)
+        return make_ref<MaterialVulkan>(layout, m_bindless_heap.set()).cast_to<Material>();
+
+    auto set_result = layout_vk->m_descriptor_pool.allocate();
+    YEET(set_result);
+
+    return make_ref<MaterialVulkan>(layout, set_result.value()).cast_to<Material>();
+}
+
+bool RenderingDriverVulkan::supports_bindless() const
+{
+    return m_bindless_supported;
+}
+
+Expected<uint32_t> RenderingDriverVulkan::add_bindless_texture(Texture *texture, Sampler sampler)
+{
+    if (!m_bindless_supported)
+        return Error::unexpected<uint32_t>(ErrorKind::UnsupportedFeature);
+
+    TextureVulkan *texture_vk = (TextureVulkan *)texture;
+
+    auto sampler_result = m_sampler_cache.get_or_create(sampler);
+    YEET(sampler_result);
+
+    return m_bindless_heap.add_texture(m_device, texture_vk->image_view, sampler_result.value());
+}
+
+Expected<uint32_t> RenderingDriverVulkan::add_bindless_buffer(Buffer *buffer)
+{
+    BufferVulkan *buffer_vk = (BufferVulkan *)buffer;
+
+    // Each frame in flight reads its own copy of a dynamic buffer, a single descriptor cannot follow it.
+    if (!m_bindless_supported || buffer_vk->dynamic)
+        return Error::unexpected<uint32_t>(ErrorKind::UnsupportedFeature);
+
+    return m_bindless_heap.add_buffer(m_device, buffer_vk->buffer, buffer_vk->size());
+}
+
+void RenderingDriverVulkan::remove_bindless_texture(uint32_t index)
+{
+    // The frame being recorded may still read it.
+    m_bindless_heap.remove_texture(index, get_recording_frame_value());
+}
+
+void RenderingDriverVulkan::remove_bindless_buffer(uint32_t index)
+{
+    m_bindless_heap.remove_buffer(index, get_recording_frame_value());
+}
+
+void RenderingDriverVulkan::retire_material_layout(const std::vector<vk::DescriptorPool>& descriptor_pools, vk::DescriptorSetLayout descriptor_set_layout, vk::PipelineLayout pipeline_layout)
+{
+    m_retired_material_layouts.push_back(RetiredMaterialLayout{
+        .last_use = get_recording_frame_value(),
+        .descriptor_pools = descriptor_pools,
+        .descriptor_set_layout = descriptor_set_layout,
+        .pipeline_layout = pipeline_layout,
+    });
+}
+
+void RenderingDriverVulkan::destroy_material_layout(const RetiredMaterialLayout& layout)
+{
+    for (const auto& pool : layout.descriptor_pools)
+        m_device.destroyDescriptorPool(pool);
+
+    m_device.destroyDescriptorSetLayout(layout.descriptor_set_layout);
+    m_device.destroyPipelineLayout(layout.pipeline_layout);
+}
+
+void RenderingDriverVulkan::draw_graph(const RenderGraph& graph)
+{
+    constexpr uint64_t timeout = 500'000'000; // 500 ms
+
+    if (!m_frame_began)
+        begin_frame();
+
+    m_frame_began = false;
+
+    vk::Fence frame_fence = m_frame_fences[m_current_frame];
+
+    ERR_EXPECT_R(wait_frame(m_current_frame), "Failed to wait for the frame");
+
+    flush_descriptor_writes();
+
+    // Fill the holes left by destroyed meshes once there are enough of them, compacting scans every mesh so it is
+    // not retried every frame.
+    if (m_mesh_pool.stats().free_range_count > MeshPool::compact_free_ranges && m_graphics_timeline_value >= m_mesh_pool_compacted + MeshPool::compact_interval)
+    {
+        ERR_EXPECT_R(m_mesh_pool.compact(), "Failed to compact the mesh pool");
+        m_mesh_pool_compacted = m_graphics_timeline_value;
+    }
+
+    vk::Semaphore acquire_semaphore = m_acquire_semaphores[m_current_frame];
+
+    // Offscreen, the frame renders into the target of its slot.
+    uint32_t image_index = (uint32_t)m_current_frame;
+
+    if (!m_offscreen)
+    {
+        auto image_index_result = m_device.acquireNextImageKHR(m_swapchain, timeout, acquire_semaphore, nullptr);
+
+        switch (image_index_result.result)
+        {
+        case vk::Result::eSuccess:
+            break;
+        case vk::Result::eSuboptimalKHR:
+        case vk::Result::eErrorOutOfDateKHR:
+            break;
+        default:
+            return;
+        }
+
+        image_index = image_index_result.value;
+    }
+
+    // Make CPU writes to dynamic buffers visible to the GPU.
+    if (!m_dynamic_flushes.empty())
+    {
+        ERR_RESULT_E_RET(m_device.flushMappedMemoryRanges(m_dynamic_flushes));
+        m_dynamic_flushes.clear();
+    }
+
+    // Only reset the fence once we know something will be submitted, otherwise the next wait would never end.
+    ERR_RESULT_E_RET(m_device.resetFences({frame_fence}));
+
+    if (m_pipeline_cache_dirty && std::chrono::high_resolution_clock::now() - m_pipeline_cache_save_time > pipeline_cache_save_interval)
+        save_pipeline_cache();
+
+    vk::Framebuffer fb = m_swapchain_framebuffers[image_index];
+
+    vk::CommandBuffer cb = m_command_buffers[m_current_frame];
+
+    // Zones left open by a frame which failed to record are dropped, its command buffer is still recording.
+    m_open_gpu_zones.clear();
+#ifdef TRACY_ENABLE
+    for (auto& zone : m_tracy_zones)
+        zone.reset();
+#endif
+
+    ERR_RESULT_E_RET(cb.reset());
+    ERR_RESULT_E_RET(cb.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit)));
+
+    m_frame_timestamps[m_current_frame].zones.clear();
+    m_frame_timestamps[m_current_frame].query_count = 0;
+    cb.resetQueryPool(m_timestamp_query_pool, m_current_frame * max_timestamps_per_frame, max_timestamps_per_frame);
+
+    begin_gpu_zone(cb, "Frame");
+
+    // Secondary command buffers of this frame slot are no longer executing.
+    for (auto& context : m_recording_contexts)
+    {
+        ERR_RESULT_E_RET(m_device.resetCommandPool(context.command_pools[m_current_frame]));
+        context.used = 0;
+    }
+
+    Span<Instruction> instructions = graph.get_instructions();
+    bool rendered = false;
+
+    graph.cull_passes(m_culled_passes);
+    prepare_draws(cb, graph);
+
+    for (size_t i = 0; i < instructions.size(); i++)
+    {
+        const Instruction& instruction = instructions[i];
+
+        if (m_culled_passes[i])
+            continue;
+
+        switch (instruction.kind)
+        {
+        case InstructionKind::BeginRenderPass:
+        {
+            begin_gpu_zone(cb, "Render pass");
+            rendered = true;
+
+            size_t end = i + 1;
+
+            while (end < instructions.size() && instructions[end].kind != InstructionKind::EndRenderPass)
+                end += 1;
+
+            // Everything the pass reads is made ready before it begins, barriers are not allowed in the render pass.
+            gather_pass_instances(cb, graph, i + 1, end);
+            record_barriers(cb, graph, instruction.renderpass.use_begin, instruction.renderpass.use_count);
+
+            // Large passes are split in ranges recorded in parallel into secondary command buffers.
+            const size_t draw_count = end - i - 1;
+            const size_t range_count = draw_count < parallel_draw_threshold ? 1 : std::min(m_recording_contexts.size(), draw_count / min_draws_per_range);
+
+            std::array<vk::ClearValue, 2> clear_values{
+                vk::ClearColorValue(0.0f, 0.0f, 0.0f, 1.0f),
+                vk::ClearDepthStencilValue(0.0),
+            };
+
+            // Secondary command buffers inherit the render pass and the framebuffer, they are recorded before it
+            // begins so a failure can still fall back to inline recording.
+            bool secondary = range_count > 1;
+
+            if (secondary)
+            {
+                m_secondary_results.assign(range_count, vk::CommandBuffer());
+
+                m_recording_workers.run(range_count, [&](size_t range)
+                                        {
+                                            const size_t range_begin = i + 1 + draw_count * range / range_count;
+                                            const size_t range_end = i + 1 + draw_count * (range + 1) / range_count;
+
+                                            m_secondary_results[range] = record_draws_secondary(m_recording_contexts[range], fb, graph, range_begin, range_end); });
+
+                m_secondary_command_buffers.clear();
+
+                for (const auto& secondary_result : m_secondary_results)
+                {
+                    // Executing the other ranges alone would drop geometry, the whole pass is recorded inline instead.
+                    // The frame is still submitted so the acquired image is presented.
+                    if (!secondary_result.has_value())
+                    {
+                        secondary_result.error().print();
+                        secondary = false;
+                        break;
+                    }
+
+                    m_secondary_command_buffers.push_back(secondary_result.value());
+                }
+            }
+
+            const vk::SubpassContents contents = secondary ? vk::SubpassContents::eSecondaryCommandBuffers : vk::SubpassContents::eInline;
+            cb.beginRenderPass(vk::RenderPassBeginInfo(m_render_pass, fb, vk::Rect2D(vk::Offset2D(0, 0), vk::Extent2D(m_surface_extent.width, m_surface_extent.height)), clear_values), contents);
+
+            if (secondary)
+                cb.executeCommands(m_secondary_command_buffers);
+            else
+                record_draws(cb, graph, i + 1, end);
+
+            // The `EndRenderPass` instruction is handled by the next iteration.
+            i = end - 1;
+            break;
+        }
+        case InstructionKind::EndRenderPass:
+        {
+            cb.endRenderPass();
+            end_gpu_zone(cb);
+            break;
+        }
+        case InstructionKind::Draw:
+        {
+            // Draws are recorded with their render pass.
+            break;
+        }
+        case InstructionKind::Copy:
+        {
+            BufferVulkan *src = (BufferVulkan *)instruction.copy.src;
+            BufferVulkan *dst = (BufferVulkan *)instruction.copy.dst;
+
+            begin_gpu_zone(cb, "Copy");
+            record_barriers(cb, graph, instruction.copy.use_begin, instruction.copy.use_count);
+
+            cb.copyBuffer(src->buffer, dst->buffer, {vk::BufferCopy(src->offset() + instruction.copy.src_offset, dst->offset() + instruction.copy.dst_offset, instruction.copy.size)});
+            end_gpu_zone(cb);
+
+            src->last_use = m_graphics_timeline_value + 1;
+            dst->last_use = m_graphics_timeline_value + 1;
+            break;
+        }
+        case InstructionKind::BeginRange:
+        {
+            begin_gpu_zone(cb, instruction.range.name);
+            break;
+        }
+        case InstructionKind::EndRange:
+        {
+            end_gpu_zone(cb);
+            break;
+        }
+        }
+    }
+
+    // Also closes the ranges the graph did not end.
+    while (!m_open_gpu_zones.empty())
+        end_gpu_zone(cb);
+
+    // The target is undefined when nothing was rendered into it this frame.
+    if (m_offscreen && rendered && m_readback_requested)
+    {
+        record_readback(cb, image_index);
+        m_readback_requested = false;
+    }
+
+#ifdef TRACY_ENABLE
+    if (m_tracy_context)
+        TracyVkCollect(m_tracy_context, cb);
+#endif
+
+    ERR_RESULT_E_RET(cb.end());
+
+    vk::Semaphore submit_semaphore = m_submit_semaphores[image_index];
+
+    // Uploads recorded since the last frame are either submitted to the transfer queue, or executed first in the
+    // same submission when there is no dedicated transfer queue.
+    StackVector<vk::CommandBuffer, 2> command_buffers;
+
+    // A batch that fails is reported and left out, the frame is still submitted so the acquired image is presented.
+    auto upload_result = end_upload();
+
+    if (!upload_result.has_value())
+    {
+        upload_result.error().print();
+    }
+    else if (std::optional<vk::CommandBuffer> upload_cb = upload_result.value(); upload_cb.has_value())
+    {
+        if (!m_async_transfer)
+            command_buffers.push_back(upload_cb.value());
+        else if (auto submit_result = submit_upload(upload_cb.value()); !submit_result.has_value())
+            submit_result.error().print();
+    }
+    command_buffers.push_back(cb);
+
+    m_graphics_timeline_value += 1;
+
+    std::array<vk::Semaphore, 2> wait_semaphores{acquire_semaphore, m_transfer_timeline};
+    std::array<vk::PipelineStageFlags, 2> wait_stage_masks{vk::PipelineStageFlagBits::eColorAttachmentOutput, vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eVertexShader | vk::PipelineStageFlagBits::eFragmentShader};
+    std::array<uint64_t, 2> wait_values{0, m_transfer_timeline_value};
+
+    std::array<vk::Semaphore, 2> signal_semaphores{submit_semaphore, m_graphics_timeline};
+    std::array<uint64_t, 2> signal_values{0, m_graphics_timeline_value};
+
+    // Offscreen frames are neither acquired nor presented, only the timelines are used.
+    const uint32_t skipped = m_offscreen ? 1 : 0;
+    const uint32_t wait_count = (m_transfer_timeline_value > 0 ? 2 : 1) - skipped;
+    const uint32_t signal_count = 2 - skipped;
+
+    vk::TimelineSemaphoreSubmitInfo timeline_info(wait_count, wait_values.data() + skipped, signal_count, signal_values.data() + skipped);
+    vk::SubmitInfo submit_info(wait_count, wait_semaphores.data() + skipped, wait_stage_masks.data() + skipped, command_buffers.size(), command_buffers.data(), signal_count, signal_semaphores.data() + skipped, &timeline_info);
+
+    ERR_RESULT_E_RET(m_graphics_queue.submit({submit_info}, frame_fence));
+    m_frame_submitted[m_current_frame] = true;
+
+    if (!m_offscreen)
+        ERR_RESULT_E_RET(m_graphics_queue.presentKHR(vk::PresentInfoKHR({submit_semaphore}, {m_swapchain}, {image_index})));
+
+    m_current_frame = (m_current_frame + 1) % max_frames_in_flight;
+}
+
+void RenderingDriverVulkan::prepare_draws(vk::CommandBuffer cb, const RenderGraph& graph)
+{
+    // Pipelines are resolved and buffer uses tracked on this thread only, since `Ref` and the bookkeeping of buffers
+    // are not thread safe.
+    Span<Instruction> instructions = graph.get_instructions();
+    Span<InstanceRange> instance_ranges = graph.get_instance_ranges();
+
+    m_draw_pipelines.resize(instructions.size());
+    m_draw_instance_offsets.resize(instructions.size());
+    m_draw_matrix_offsets.resize(instructions.size());
+    m_instance_head = 0;
+
+    const uint64_t frame_value = m_graphics_timeline_value + 1;
+
+    MaterialLayout *last_layout = nullptr;
+    vk::Pipeline last_pipeline;
+
+    for (size_t i = 0; i < instructions.size(); i++)
+    {
+        const Instruction& instruction = instructions[i];
+        m_draw_pipelines[i] = vk::Pipeline();
+        m_draw_instance_offsets[i] = invalid_instance_offset;
+        m_draw_matrix_offsets[i] = invalid_instance_offset;
+
+        if (instruction.kind != InstructionKind::Draw)
+            continue;
+
+        MaterialLayout *layout = instruction.draw.material->get_layout().ptr();
+
+        if (layout != last_layout)
+        {
+            auto pipeline_result = m_pipeline_cache.get(layout, m_render_pass);
+
+            last_layout = layout;
+            last_pipeline = pipeline_result.value_or(vk::Pipeline());
+        }
+
+        // Skip the draw until its pipeline is compiled instead of stalling the frame.
+        if (!last_pipeline)
+            continue;
+
+        m_draw_pipelines[i] = last_pipeline;
+
+        // Remember which frame reads the buffers so uploads overwriting them can wait for it.
+        MeshVulkan *mesh = (MeshVulkan *)instruction.draw.mesh;
+
+        if (mesh->pulled)
+            ((BufferVulkan *)m_quad_indices.ptr())->last_use = frame_value;
+        else
+            m_mesh_pool.mark_used(mesh->page, frame_value);
+
+        if (instruction.draw.instance_buffer)
+            ((BufferVulkan *)instruction.draw.instance_buffer)->last_use = frame_value;
+
+        for (uint32_t range = 0; range < instruction.draw.range_count; range++)
+        {
+            if (Buffer *buffer = instance_ranges[instruction.draw.range_begin + range].buffer)
+                ((BufferVulkan *)buffer)->last_use = frame_value;
+        }
+    }
+}
+
+void RenderingDriverVulkan::gather_pass_instances(vk::CommandBuffer cb, const RenderGraph& graph, size_t begin, size_t end)
+{
+    Span<Instruction> instructions = graph.get_instructions();
+    bool copied = false;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        if (instructions[i].kind == InstructionKind::Draw && instructions[i].draw.range_count > 0 && m_draw_pipelines[i])
+            gather_instances(cb, graph, i, copied);
+    }
+
+    if (copied)
+    {
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, {},
+                           {vk::MemoryBarrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eVertexAttributeRead)}, {}, {});
+    }
+}
+
+static void convert_resource_usage(ResourceUsage usage, vk::PipelineStageFlags& stage, vk::AccessFlags& access)
+{
+    switch (usage)
+    {
+    case ResourceUsage::Vertex:
+        stage = vk::PipelineStageFlagBits::eVertexInput;
+        access = vk::AccessFlagBits::eVertexAttributeRead;
+        break;
+    case ResourceUsage::Index:
+        stage = vk::PipelineStageFlagBits::eVertexInput;
+        access = vk::AccessFlagBits::eIndexRead;
+        break;
+    case ResourceUsage::Uniform:
+        stage = vk::PipelineStageFlagBits::eVertexShader | vk::PipelineStageFlagBits::eFragmentShader;
+        access = vk::AccessFlagBits::eUniformRead;
+        break;
+    case ResourceUsage::Sampled:
+        stage = vk::PipelineStageFlagBits::eVertexShader | vk::PipelineStageFlagBits::eFragmentShader;
+        access = vk::AccessFlagBits::eShaderRead;
+        break;
+    case ResourceUsage::CopySrc:
+        stage = vk::PipelineStageFlagBits::eTransfer;
+        access = vk::AccessFlagBits::eTransferRead;
+        break;
+    case ResourceUsage::CopyDst:
+        stage = vk::PipelineStageFlagBits::eTransfer;
+        access = vk::AccessFlagBits::eTransferWrite;
+        break;
+    case ResourceUsage::ColorAttachment:
+        stage = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+        access = vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite;
+        break;
+    case ResourceUsage::DepthAttachment:
+        stage = vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests;
+        access = vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+        break;
+    }
+}
+
+void RenderingDriverVulkan::record_barriers(vk::CommandBuffer cb, const RenderGraph& graph, uint32_t use_begin, uint32_t use_count)
+{
+    // All hazards of a pass are resolved with a single barrier, buffers share a global memory barrier.
+    vk::PipelineStageFlags src_stage_mask;
+    vk::PipelineStageFlags dst_stage_mask;
+    vk::AccessFlags src_access_mask;
+    vk::AccessFlags dst_access_mask;
+
+    m_image_barriers.clear();
+
+    Span<ResourceUse> uses = graph.get_resource_uses();
+
+    for (uint32_t i = use_begin; i < use_begin + use_count; i++)
+    {
+        const ResourceUse& use = uses[i];
+
+        vk::PipelineStageFlags stage;
+        vk::AccessFlags access;
+        convert_resource_usage(use.usage, stage, access);
+
+        if (use.texture)
+        {
+            TextureVulkan *texture = (TextureVulkan *)use.texture;
+
+            TextureLayout layout;
+
+            switch (use.usage)
+            {
+            case ResourceUsage::CopyDst:
+                layout = TextureLayout::CopyDst;
+                break;
+            case ResourceUsage::ColorAttachment:
+                layout = TextureLayout::ColorAttachment;
+                break;
+            case ResourceUsage::DepthAttachment:
+                layout = TextureLayout::DepthStencilAttachment;
+                break;
+            default:
+                layout = TextureLayout::ShaderReadOnly;
+                break;
+            }
+
+            if (texture->layout() == layout)
+                continue;
+
+            m_image_barriers.push_back(texture->transition_barrier(layout, src_stage_mask, dst_stage_mask));
+            continue;
+        }
+
+        BufferState& state = ((BufferVulkan *)use.buffer)->barrier_state;
+
+        if (state.write_stages)
+        {
+            // Read after write or write after write, the previous write has to be made visible.
+            src_stage_mask |= state.write_stages;
+            src_access_mask |= state.write_access;
+            dst_stage_mask |= stage;
+            dst_access_mask |= access;
+        }
+        else if (is_write(use.usage) && state.read_stages)
+        {
+            // Write after read only needs an execution dependency.
+            src_stage_mask |= state.read_stages;
+            dst_stage_mask |= stage;
+        }
+
+        if (is_write(use.usage))
+        {
+            state.write_stages = stage;
+            state.write_access = access;
+            state.read_stages = {};
+        }
+        else
+        {
+            state.write_stages = {};
+            state.write_access = {};
+            state.read_stages |= stage;
+        }
+    }
+
+    if (!src_stage_mask && m_image_barriers.empty())
+        return;
+
+    if (!src_stage_mask)
+        src_stage_mask = vk::PipelineStageFlagBits::eTopOfPipe;
+
+    const vk::MemoryBarrier memory_barrier(src_access_mask, dst_access_mask);
+    const uint32_t memory_barrier_count = src_access_mask || dst_access_mask ? 1 : 0;
+
+    cb.pipelineBarrier(src_stage_mask, dst_stage_mask, {}, vk::ArrayProxy<const vk::MemoryBarrier>(memory_barrier_count, &memory_barrier), {}, m_image_barriers);
+}
+
+void RenderingDriverVulkan::gather_instances(vk::CommandBuffer cb, const RenderGraph& graph, size_t index, bool& copied)
+{
+    const Instruction& instruction = graph.get_instructions()[index];
+    const MaterialLayoutVulkan *layout = (MaterialLayoutVulkan *)instruction.draw.material->get_layout().ptr();
+    const bool view_matrices = layout->m_flags.instanced_view_matrix;
+
+    if ((!layout->m_instance_layout.has_value() && !view_matrices) || instruction.draw.instance_count == 0)
+        return;
+
+    const vk::DeviceSize stride = layout->m_instance_layout.has_value() ? layout->m_instance_layout->stride : 0;
+    const vk::DeviceSize size = instruction.draw.instance_count * stride;
+    const vk::DeviceSize start = (m_instance_head + 15) / 16 * 16;
+
+    const vk::DeviceSize matrices_size = view_matrices ? instruction.draw.instance_count * sizeof(DrawInstance) : 0;
+    const vk::DeviceSize matrices_start = (start + size + 15) / 16 * 16;
+
+    // Draws that do not fit are drawn one range at a time, or skipped when they need their view matrices.
+    if (matrices_start + matrices_size > instance_buffer_size)
+        return;
+
+    // The view matrices are written by the CPU, then copied with the instances.
+    StagingBuffer::Allocation matrices_staging{};
+
+    if (view_matrices)
+    {
+        auto staging_result = allocate_staging(matrices_size);
+
+        if (!staging_result.has_value())
+        {
+            staging_result.error().print();
+            return;
+        }
+
+        matrices_staging = staging_result.value();
+    }
+
+    m_instance_head = matrices_start + matrices_size;
+
+    auto begin_copies = [&]()
+    {
+        // Instances are copied on the GPU, host visible device local memory is write combined and reading it from the
+        // CPU is very slow.
+        if (!copied)
+        {
+            // Uploads recorded before this frame may still be writing the source buffers.
+            cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {},
+                               {vk::MemoryBarrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eTransferRead)}, {}, {});
+            copied = true;
+        }
+    };
+
+    const vk::DeviceSize frame_base = m_current_frame * instance_buffer_size;
+    const MeshVulkan *mesh = (MeshVulkan *)instruction.draw.mesh;
+    Span<PushConstants> push_constants = graph.get_push_constants();
+
+    vk::DeviceSize offset = frame_base + start;
+    DrawInstance *matrices = (DrawInstance *)matrices_staging.ptr;
+
+    for (uint32_t range = 0; range < instruction.draw.range_count; range++)
+    {
+        const InstanceRange& instance_range = graph.get_instance_ranges()[instruction.draw.range_begin + range];
+        BufferVulkan *buffer = (BufferVulkan *)instance_range.buffer;
+
+        if (view_matrices)
+        {
+            const glm::mat4& view_matrix = push_constants[instance_range.push_constants].view_matrix;
+
+            // Each range restarts at the first instance of the mesh, as if it was drawn alone.
+            for (uint32_t instance = 0; instance < instance_range.instance_count; instance++)
+                *matrices++ = DrawInstance{.view_matrix = view_matrix, .instance = mesh->first_instance + instance};
+        }
+
+        const vk::DeviceSize range_size = instance_range.instance_count * stride;
+
+        if (range_size > 0 && buffer)
+        {
+            begin_copies();
+            cb.copyBuffer(buffer->buffer, m_instance_buffer, {vk::BufferCopy(buffer->offset(), offset, range_size)});
+        }
+
+        offset += range_size;
+    }
+
+    if (view_matrices)
+    {
+        begin_copies();
+        cb.copyBuffer(matrices_staging.buffer, m_instance_buffer, {vk::BufferCopy(matrices_staging.offset, frame_base + matrices_start, matrices_size)});
+
+        m_draw_matrix_offsets[index] = frame_base + matrices_start;
+    }
+
+    m_draw_instance_offsets[index] = frame_base + start;
+}
+
+void RenderingDriverVulkan::record_draws(vk::CommandBuffer cb, const RenderGraph& graph, size_t begin, size_t end)
+{
+    Span<Instruction> instructions = graph.get_instructions();
+    Span<InstanceRange> instance_ranges = graph.get_instance_ranges();
+    Span<PushConstants> push_constants = graph.get_push_constants();
+
+    cb.setViewport(0, {vk::Viewport(0.0, 0.0, (float)m_surface_extent.width, (float)m_surface_extent.height, 0.0, 1.0)});
+    cb.setScissor(0, {vk::Rect2D({0, 0}, {m_surface_extent.width, m_surface_extent.height})});
+
+    // Draws are sorted by pipeline, material and mesh, so only the state that changes between them is bound.
+    vk::Pipeline bound_pipeline;
+    vk::PipelineLayout bound_pipeline_layout;
+    vk::DescriptorSet bound_descriptor_set;
+    constexpr uint32_t quad_indices_page = UINT32_MAX - 1;
+
+    uint32_t bound_page = UINT32_MAX;
+    uint32_t bound_instance_binding = UINT32_MAX;
+    vk::IndexType bound_index_type = vk::IndexType::eNoneKHR;
+    vk::Buffer bound_instance_buffer;
+    vk::DeviceSize bound_instance_offset = 0;
+    const PushConstants *pushed_constants = nullptr;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        const Instruction& instruction = instructions[i];
+        const vk::Pipeline pipeline = m_draw_pipelines[i];
+
+        if (instruction.kind != InstructionKind::Draw || !pipeline)
+            continue;
+
+        // Only raw pointers are used here, copying a `Ref` from several threads would race on its counter.
+        MeshVulkan *mesh = (MeshVulkan *)instruction.draw.mesh;
+        MaterialVulkan *material = (MaterialVulkan *)instruction.draw.material;
+        MaterialLayoutVulkan *material_layout = (MaterialLayoutVulkan *)material->get_layout().ptr();
+
+        if (pipeline != bound_pipeline)
+        {
+            cb.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
+            bound_pipeline = pipeline;
+        }
+
+        // Descriptor sets and push constants may be disturbed when the pipeline layout changes.
+        if (material_layout->m_pipeline_layout != bound_pipeline_layout)
+        {
+            bound_pipeline_layout = material_layout->m_pipeline_layout;
+            bound_descriptor_set = nullptr;
+            pushed_constants = nullptr;
+        }
+
+        if (material->descriptor_set != bound_descriptor_set)
+        {
+            cb.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, bound_pipeline_layout, 0, {material->descriptor_set}, {});
+            bound_descriptor_set = material->descriptor_set;
+        }
+
+        // Meshes of the same page share their buffers, they are told apart by their first vertex and first index.
+        // Pulled meshes have no vertex buffer and all share the quad indices.
+        const uint32_t page_index = mesh->pulled ? quad_indices_page : mesh->page;
+
+        if (page_index != bound_page || mesh->index_type_vk != bound_index_type)
+        {
+            if (mesh->pulled)
+            {
+                cb.bindIndexBuffer(((BufferVulkan *)m_quad_indices.ptr())->buffer, 0, mesh->index_type_vk);
+            }
+            else
+            {
+                const MeshPool::Page& page = m_mesh_pool.get_page(mesh->page);
+
+                cb.bindIndexBuffer(((BufferVulkan *)page.indices.ptr())->buffer, 0, mesh->index_type_vk);
+
+                if (page_index != bound_page)
+                {
+                    StackVector<vk::Buffer, VertexLayout::max_streams> buffers;
+                    StackVector<vk::DeviceSize, VertexLayout::max_streams> offsets;
+
+                    for (const auto& stream : page.streams)
+                    {
+                        buffers.push_back(((BufferVulkan *)stream.ptr())->buffer);
+                        offsets.push_back(0);
+                    }
+
+                    cb.bindVertexBuffers(0, buffers.size(), buffers.data(), offsets.data());
+                }
+            }
+
+            bound_page = page_index;
+            bound_index_type = mesh->index_type_vk;
+        }
+
+        // The instance binding follows the vertex streams of the layout.
+        const uint32_t instance_binding = material_layout->m_vertex_layout.strides.size();
+
+        auto bind_instances = [&](vk::Buffer buffer, vk::DeviceSize offset)
+        {
+            if (buffer != bound_instance_buffer || offset != bound_instance_offset || instance_binding != bound_instance_binding)
+            {
+                cb.bindVertexBuffers(instance_binding, {buffer}, {offset});
+
+                bound_instance_buffer = buffer;
+                bound_instance_offset = offset;
+                bound_instance_binding = instance_binding;
+            }
+        };
 
-    m_swapchain = swapchain_result.value;
-    m_depth_texture = depth_texture_result.value();
-    m_swapchain_images = std::move(swapchain_images_result.value);
-    m_swapchain_textures = std::move(swapchain_textures);
-    m_swapchain_framebuffers = std::move(swapchain_framebuffers);
-    m_surface_extent = Extent2D(surface_extent.width, surface_extent.height);
+        const bool view_matrices = material_layout->m_flags.instanced_view_matrix;
 
-    return {};
+        if (view_matrices)
+        {
+            // The instances cannot be drawn without their view matrices, which did not fit in the instance buffer.
+            if (m_draw_matrix_offsets[i] == invalid_instance_offset)
+                continue;
+
+            cb.bindVertexBuffers(instance_binding + 1, {m_instance_buffer}, {m_draw_matrix_offsets[i]});
+        }
+
+        if (instruction.draw.instance_buffer)
+        {
+            BufferVulkan *instance_buffer = (BufferVulkan *)instruction.draw.instance_buffer;
+            bind_instances(instance_buffer->buffer, instance_buffer->offset());
+        }
+        else if (material_layout->m_instance_layout.has_value() && m_draw_instance_offsets[i] != invalid_instance_offset)
+        {
+            bind_instances(m_instance_buffer, m_draw_instance_offsets[i]);
+        }
+
+        const PushConstants *constants = &push_constants[instruction.draw.push_constants];
+
+        if (!view_matrices && constants != pushed_constants && (!pushed_constants || constants->view_matrix != pushed_constants->view_matrix))
+        {
+            cb.pushConstants(bound_pipeline_layout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(PushConstants), constants);
+            pushed_constants = constants;
+        }
+
+        // Merged draws whose instances could not be gathered are drawn one range at a time.
+        if (instruction.draw.range_count > 0 && m_draw_instance_offsets[i] == invalid_instance_offset)
+        {
+            for (uint32_t range = 0; range < instruction.draw.range_count; range++)
+            {
+                const InstanceRange& instance_range = instance_ranges[instruction.draw.range_begin + range];
+                BufferVulkan *instance_buffer = (BufferVulkan *)instance_range.buffer;
+
+                bind_instances(instance_buffer->buffer, instance_buffer->offset());
+                cb.drawIndexed(mesh->vertex_count(), instance_range.instance_count, mesh->first_index(), (int32_t)mesh->first_vertex, 0);
+            }
+
+            continue;
+        }
+
+        if (mesh->pulled)
+        {
+            // Per-instance inputs are fetched from the first instance onward, the instance index is in the view
+            // matrices instead.
+            const uint32_t first_instance = view_matrices ? 0 : mesh->first_instance;
+
+            // The vertex offset moves `gl_VertexIndex` to the first quad, larger meshes than the quad pattern are drawn
+            // in several parts.
+            for (uint32_t quad = 0; quad < mesh->quad_count; quad += quad_pattern_count)
+            {
+                const uint32_t quad_count = std::min(mesh->quad_count - quad, quad_pattern_count);
+                cb.drawIndexed(quad_count * 6, instruction.draw.instance_count, 0, (int32_t)((mesh->first_quad + quad) * 4), first_instance);
+            }
+
+            continue;
+        }
+
+        cb.drawIndexed(mesh->vertex_count(), instruction.draw.instance_count, mesh->first_index(), (int32_t)mesh->first_vertex, 0);
+    }
 }
 
-void RenderingDriverVulkan::destroy_swapchain()
+Expected<vk::CommandBuffer> RenderingDriverVulkan::record_draws_secondary(RecordingContext& context, vk::Framebuffer framebuffer, const RenderGraph& graph, size_t begin, size_t end)
 {
-    if (m_swapchain)
+    std::vector<vk::CommandBuffer>& command_buffers = context.command_buffers[m_current_frame];
+
+    if (context.used == command_buffers.size())
     {
-        for (const auto& fb : m_swapchain_framebuffers)
-            m_device.destroyFramebuffer(fb);
+        auto alloc_result = m_device.allocateCommandBuffers(vk::CommandBufferAllocateInfo(context.command_pools[m_current_frame], vk::CommandBufferLevel::eSecondary, 1));
+        YEET_RESULT(alloc_result);
 
-        m_swapchain_textures.clear();
+        command_buffers.push_back(alloc_result.value[0]);
+    }
 
-        m_device.destroySwapchainKHR(m_swapchain);
+    vk::CommandBuffer cb = command_buffers[context.used];
+    context.used += 1;
+
+    vk::CommandBufferInheritanceInfo inheritance_info(m_render_pass, 0, framebuffer);
+    YEET_RESULT_E(cb.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit | vk::CommandBufferUsageFlagBits::eRenderPassContinue, &inheritance_info)));
+
+    record_draws(cb, graph, begin, end);
+
+    YEET_RESULT_E(cb.end());
+
+    return cb;
+}
+
+void RenderingDriverVulkan::set_sharing_mode(vk::BufferCreateInfo& create_info) const
+{
+    // Resources are shared between the graphics and transfer queues to avoid queue family ownership transfers.
+    if (m_async_transfer)
+    {
+        create_info.setSharingMode(vk::SharingMode::eConcurrent);
+        create_info.setQueueFamilyIndices(m_shared_queue_indices);
     }
 }
 
-void RenderingDriverVulkan::limit_frames(uint32_t limit)
+void RenderingDriverVulkan::set_sharing_mode(vk::ImageCreateInfo& create_info) const
 {
-    m_frames_limit = limit;
-    m_time_between_frames = 1'000'000 / m_frames_limit;
+    if (m_async_transfer)
+    {
+        create_info.setSharingMode(vk::SharingMode::eConcurrent);
+        create_info.setQueueFamilyIndices(m_shared_queue_indices);
+    }
 }
 
-Expected<Ref<Buffer>> RenderingDriverVulkan::create_buffer(size_t size, BufferUsage usage, BufferVisibility visibility)
+Expected<void> RenderingDriverVulkan::wait_frame(size_t frame)
 {
-    vk::MemoryPropertyFlags memory_properties{};
+    constexpr uint64_t timeout = 500'000'000; // 500 ms
 
-    switch (visibility)
+    // Resources of the frame are only released once per submission, the next batch may already be recording.
+    if (!m_frame_submitted[frame])
+        return {};
+
+    YEET_RESULT_E(m_device.waitForFences({m_frame_fences[frame]}, true, timeout));
+    m_frame_submitted[frame] = false;
+
+    read_timestamps(frame);
+    read_back(frame);
+
+    // Bindless indices removed before the frame can be reused.
+    if (auto counter_result = m_device.getSemaphoreCounterValue(m_graphics_timeline); counter_result.result == vk::Result::eSuccess)
+        m_graphics_timeline_completed = counter_result.value;
+
+    m_bindless_heap.reclaim(m_graphics_timeline_completed);
+    m_mesh_pool.reclaim(m_graphics_timeline_completed);
+    m_pipeline_cache.reclaim(m_graphics_timeline_completed);
+
+    while (!m_retired_material_layouts.empty() && m_retired_material_layouts.front().last_use <= m_graphics_timeline_completed)
     {
-    case BufferVisibility::GPUOnly:
-        memory_properties = vk::MemoryPropertyFlagBits::eDeviceLocal;
-        break;
-    case BufferVisibility::GPUAndCPU:
-        memory_properties = vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible;
-        break;
+        destroy_material_layout(m_retired_material_layouts.front());
+        m_retired_material_layouts.pop_front();
     }
 
-    auto buffer_result = m_device.createBuffer(vk::BufferCreateInfo({}, size, convert_buffer_usage(usage)));
-    YEET_RESULT(buffer_result);
+    // Everything staged for this frame has been consumed by the GPU.
+    m_staging_buffer.reclaim(frame);
 
-    auto memory_result = allocate_memory_for_buffer(buffer_result.value, memory_properties);
-    YEET(memory_result);
+    for (const auto& [buffer, memory] : m_staging_overflow[frame])
+    {
+        m_allocator.free(memory);
+        m_device.destroyBuffer(buffer);
+    }
+    m_staging_overflow[frame].clear();
 
-    return make_ref<BufferVulkan>(buffer_result.value, memory_result.value(), size).cast_to<Buffer>();
+    return {};
 }
 
-Expected<Ref<Texture>> RenderingDriverVulkan::create_texture(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage)
+void RenderingDriverVulkan::begin_gpu_zone(vk::CommandBuffer cb, const char *name)
 {
-    const vk::Format vk_format = convert_texture_format(format);
+    FrameTimestamps& timestamps = m_frame_timestamps[m_current_frame];
+    const size_t depth = m_open_gpu_zones.size();
 
-    auto image_result = m_device.createImage(vk::ImageCreateInfo(
-        {},
-        vk::ImageType::e2D,
-        vk_format,
-        vk::Extent3D(width, height, 1),
-        1, // mipLevels
-        1,
-        vk::SampleCountFlagBits::e1,
-        vk::ImageTiling::eOptimal,
-        convert_texture_usage(usage),
-        vk::SharingMode::eExclusive));
-    YEET_RESULT(image_result);
+#ifdef TRACY_ENABLE
+    if (m_tracy_context && depth < max_gpu_zone_depth)
+        m_tracy_zones[depth].emplace(m_tracy_context, __LINE__, __FILE__, std::strlen(__FILE__), __func__, std::strlen(__func__), name, std::strlen(name), cb, true);
+#endif
 
-    auto memory_result = allocate_memory_for_image(image_result.value, vk::MemoryPropertyFlagBits::eDeviceLocal);
-    YEET(memory_result);
+    // Zones which do not fit in the queries of the frame are not timed, but still have to be balanced.
+    if (!m_timestamps_supported || timestamps.query_count + 2 > max_timestamps_per_frame)
+    {
+        m_open_gpu_zones.push_back(UINT32_MAX);
+        return;
+    }
 
-    // TODO: format_to_aspect_mask()
-    vk::ImageAspectFlags aspect_mask = format == TextureFormat::D32 ? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eColor;
+    // The end query is reserved now so a zone that started can always end.
+    const TimestampZone zone{.name = name, .depth = (uint32_t)depth, .begin_query = timestamps.query_count, .end_query = timestamps.query_count + 1};
+    timestamps.query_count += 2;
 
-    auto image_view_result = m_device.createImageView(vk::ImageViewCreateInfo({}, image_result.value, vk::ImageViewType::e2D, vk_format, {}, vk::ImageSubresourceRange(aspect_mask, 0, 1, 0, 1)));
-    YEET_RESULT(image_view_result);
+    cb.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, m_timestamp_query_pool, m_current_frame * max_timestamps_per_frame + zone.begin_query);
 
-    return make_ref<TextureVulkan>(image_result.value, memory_result.value(), image_view_result.value, width, height, width * height * size_of(format), aspect_mask, 1, true).cast_to<Texture>();
+    m_open_gpu_zones.push_back((uint32_t)timestamps.zones.size());
+    timestamps.zones.push_back(zone);
 }
 
-Expected<Ref<Texture>> RenderingDriverVulkan::create_texture_array(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage, uint32_t layers)
+void RenderingDriverVulkan::end_gpu_zone(vk::CommandBuffer cb)
 {
-    const vk::Format vk_format = convert_texture_format(format);
+    ERR_COND(m_open_gpu_zones.empty(), "No GPU zone to end");
 
-    auto image_result = m_device.createImage(vk::ImageCreateInfo(
-        {},
-        vk::ImageType::e2D,
-        vk_format,
-        vk::Extent3D(width, height, 1),
-        1, // mipLevels
-        layers,
-        vk::SampleCountFlagBits::e1,
-        vk::ImageTiling::eOptimal,
-        convert_texture_usage(usage),
-        vk::SharingMode::eExclusive));
-    YEET_RESULT(image_result);
+    const uint32_t zone = m_open_gpu_zones.back();
+    m_open_gpu_zones.pop_back();
 
-    auto memory_result = allocate_memory_for_image(image_result.value, vk::MemoryPropertyFlagBits::eDeviceLocal);
-    YEET(memory_result);
+#ifdef TRACY_ENABLE
+    if (m_open_gpu_zones.size() < max_gpu_zone_depth)
+        m_tracy_zones[m_open_gpu_zones.size()].reset();
+#endif
 
-    // TODO: format_to_aspect_mask()
-    vk::ImageAspectFlags aspect_mask = format == TextureFormat::D32 ? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eColor;
+    if (zone == UINT32_MAX)
+        return;
 
-    auto image_view_result = m_device.createImageView(vk::ImageViewCreateInfo({}, image_result.value, vk::ImageViewType::e2DArray, vk_format, {}, vk::ImageSubresourceRange(aspect_mask, 0, 1, 0, 1)));
-    YEET_RESULT(image_view_result);
+    const TimestampZone& timestamp_zone = m_frame_timestamps[m_current_frame].zones[zone];
+    cb.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, m_timestamp_query_pool, m_current_frame * max_timestamps_per_frame + timestamp_zone.end_query);
+}
 
-    return make_ref<TextureVulkan>(image_result.value, memory_result.value(), image_view_result.value, width, height, width * height * size_of(format), aspect_mask, layers, true).cast_to<Texture>();
+void RenderingDriverVulkan::read_timestamps(size_t frame)
+{
+    FrameTimestamps& timestamps = m_frame_timestamps[frame];
+
+    if (timestamps.query_count == 0)
+        return;
+
+    // The fence of the frame is signaled so the results are available, nothing waits here.
+    m_timestamp_results.resize(timestamps.query_count);
+
+    const vk::Result result = m_device.getQueryPoolResults(m_timestamp_query_pool, frame * max_timestamps_per_frame, timestamps.query_count,
+                                                           m_timestamp_results.size() * sizeof(uint64_t), m_timestamp_results.data(), sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+
+    if (result == vk::Result::eSuccess)
+    {
+        const double ms_per_tick = m_physical_device_properties.limits.timestampPeriod / 1'000'000.0;
+
+        m_gpu_timings.zones.clear();
+        m_gpu_timings.frame_ms = 0.0;
+
+        for (const auto& zone : timestamps.zones)
+        {
+            const uint64_t ticks = (m_timestamp_results[zone.end_query] - m_timestamp_results[zone.begin_query]) & m_timestamp_mask;
+            const double ms = (double)ticks * ms_per_tick;
+
+            m_gpu_timings.zones.push_back({.name = zone.name, .depth = zone.depth, .ms = ms});
+
+            if (zone.depth == 0)
+                m_gpu_timings.frame_ms = ms;
+        }
+    }
+
+    timestamps.zones.clear();
+    timestamps.query_count = 0;
 }
 
-Expected<Ref<Texture>> RenderingDriverVulkan::create_texture_cube(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage)
+Expected<void> RenderingDriverVulkan::prepare_dynamic_write(BufferVulkan *buffer)
 {
-    const vk::Format vk_format = convert_texture_format(format);
+    // The copy of the current frame may still be read by the previous use of this frame slot.
+    YEET(wait_frame(m_current_frame));
 
-    auto image_result = m_device.createImage(vk::ImageCreateInfo(
-        vk::ImageCreateFlagBits::eCubeCompatible,
-        vk::ImageType::e2D,
-        vk_format,
-        vk::Extent3D(width, height, 1),
-        1, // mipLevels
-        6,
-        vk::SampleCountFlagBits::e1,
-        vk::ImageTiling::eOptimal,
-        convert_texture_usage(usage),
-        vk::SharingMode::eExclusive));
-    YEET_RESULT(image_result);
+    if (buffer->coherent)
+        return {};
 
-    auto memory_result = allocate_memory_for_image(image_result.value, vk::MemoryPropertyFlagBits::eDeviceLocal);
-    YEET(memory_result);
+    // Copies are aligned on `nonCoherentAtomSize` so they can be flushed independently.
+    const MemoryAllocation& memory = buffer->memory;
+    const vk::DeviceSize offset = memory.offset + buffer->offset();
+    const vk::DeviceSize size = buffer->frame_stride;
 
-    // TODO: format_to_aspect_mask()
-    vk::ImageAspectFlags aspect_mask = format == TextureFormat::D32 ? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eColor;
+    const bool already_flushed = std::find_if(m_dynamic_flushes.begin(), m_dynamic_flushes.end(), [&](const vk::MappedMemoryRange& range)
+                                              { return range.memory == memory.memory && range.offset == offset; }) != m_dynamic_flushes.end();
 
-    auto image_view_result = m_device.createImageView(vk::ImageViewCreateInfo({}, image_result.value, vk::ImageViewType::eCube, vk_format, {}, vk::ImageSubresourceRange(aspect_mask, 0, 1, 0, 1)));
-    YEET_RESULT(image_view_result);
+    if (!already_flushed)
+        m_dynamic_flushes.push_back(vk::MappedMemoryRange(memory.memory, offset, size));
 
-    return make_ref<TextureVulkan>(image_result.value, memory_result.value(), image_view_result.value, width, height, width * height * size_of(format), aspect_mask, 1, true).cast_to<Texture>();
+    return {};
 }
 
-Expected<Ref<Mesh>> RenderingDriverVulkan::create_mesh(IndexType index_type, Span<uint8_t> indices, Span<glm::vec3> vertices, Span<glm::vec2> uvs, Span<glm::vec3> normals)
+bool RenderingDriverVulkan::is_buffer_idle(const BufferVulkan *buffer)
 {
-    const size_t vertex_count = indices.size() / size_of(index_type);
+    const uint64_t frame_value = std::max(buffer->last_use, buffer->last_upload);
+
+    if (frame_value <= m_graphics_timeline_completed)
+        return true;
 
-    auto index_buffer_result = create_buffer(indices.size(), {.copy_dst = 1, .index = 1});
-    YEET(index_buffer_result);
-    Ref<Buffer> index_buffer = index_buffer_result.value();
+    auto counter_result = m_device.getSemaphoreCounterValue(m_graphics_timeline);
 
-    auto vertex_buffer_result = create_buffer(vertices.size() * sizeof(glm::vec3), {.copy_dst = 1, .vertex = 1});
-    YEET(vertex_buffer_result);
-    Ref<Buffer> vertex_buffer = vertex_buffer_result.value();
+    if (counter_result.result != vk::Result::eSuccess)
+        return false;
 
-    auto uv_buffer_result = create_buffer(uvs.size() * sizeof(glm::vec2), {.copy_dst = 1, .vertex = 1});
-    YEET(uv_buffer_result);
-    Ref<Buffer> uv_buffer = uv_buffer_result.value();
+    m_graphics_timeline_completed = counter_result.value;
 
-    auto normal_buffer_result = create_buffer(normals.size() * sizeof(glm::vec3), {.copy_dst = 1, .vertex = 1});
-    YEET(normal_buffer_result);
-    Ref<Buffer> normal_buffer = normal_buffer_result.value();
+    return frame_value <= m_graphics_timeline_completed;
+}
+
+static vk::MappedMemoryRange non_coherent_range(const MemoryAllocation& memory, vk::DeviceSize offset, vk::DeviceSize size, vk::DeviceSize atom)
+{
+    // Blocks of the allocator are aligned on `nonCoherentAtomSize`, dedicated allocations may not end on it.
+    const vk::DeviceSize start = (memory.offset + offset) / atom * atom;
+    vk::DeviceSize end = (memory.offset + offset + size + atom - 1) / atom * atom;
 
-    index_buffer->update(indices.as_bytes());
-    vertex_buffer->update(vertices.as_bytes());
-    uv_buffer->update(uvs.as_bytes());
-    normal_buffer->update(normals.as_bytes());
+    if (memory.block == MemoryAllocation::dedicated_block && end > memory.size)
+        end = vk::WholeSize;
 
-    return make_ref<MeshVulkan>(index_type, convert_index_type(index_type), vertex_count, index_buffer, vertex_buffer, uv_buffer, normal_buffer).cast_to<Mesh>();
+    return vk::MappedMemoryRange(memory.memory, start, end == vk::WholeSize ? vk::WholeSize : end - start);
 }
 
-Expected<Ref<MaterialLayout>> RenderingDriverVulkan::create_material_layout(Span<ShaderRef> shaders, Span<MaterialParam> params, MaterialFlags flags, std::optional<InstanceLayout> instance_layout, CullMode cull_mode, PolygonMode polygon_mode, bool transparency, bool always_draw_before)
+void RenderingDriverVulkan::flush_memory(const MemoryAllocation& memory, vk::DeviceSize offset, vk::DeviceSize size)
 {
-    std::vector<vk::DescriptorSetLayoutBinding> bindings;
-    bindings.reserve(params.size());
+    vk::MappedMemoryRange range = non_coherent_range(memory, offset, size, m_physical_device_properties.limits.nonCoherentAtomSize);
+    ERR_RESULT_E_RET(m_device.flushMappedMemoryRanges({range}));
+}
 
-    uint32_t binding = 0;
+void RenderingDriverVulkan::invalidate_memory(const MemoryAllocation& memory, vk::DeviceSize offset, vk::DeviceSize size)
+{
+    vk::MappedMemoryRange range = non_coherent_range(memory, offset, size, m_physical_device_properties.limits.nonCoherentAtomSize);
+    ERR_RESULT_E_RET(m_device.invalidateMappedMemoryRanges({range}));
+}
 
-    for (const auto& param : params)
-    {
-        vk::DescriptorType type = param.kind == MaterialParamKind::Texture ? vk::DescriptorType::eCombinedImageSampler : vk::DescriptorType::eUniformBuffer;
+Expected<vk::CommandBuffer> RenderingDriverVulkan::begin_upload()
+{
+    vk::CommandBuffer cb = m_upload_buffers[m_current_frame];
 
-        bindings.push_back(vk::DescriptorSetLayoutBinding(binding, type, 1, convert_shader_stage(param.shader_kind), nullptr));
-        binding += 1;
-    }
+    if (m_upload_recording)
+        return cb;
 
-    auto layout_result = RenderingDriverVulkan::get()->get_device().createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo({}, bindings));
-    YEET_RESULT(layout_result);
+    // The command buffer may still be in use by the last submission of this frame slot.
+    YEET(wait_frame(m_current_frame));
 
-    auto pool_result = DescriptorPool::create(layout_result.value, params);
-    YEET(pool_result);
+    YEET_RESULT_E(cb.reset());
+    YEET_RESULT_E(cb.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit)));
 
-    std::array<vk::PushConstantRange, 1> push_constant_ranges{
-        vk::PushConstantRange(vk::ShaderStageFlagBits::eVertex, 0, sizeof(PushConstants)),
-    };
-    std::array<vk::DescriptorSetLayout, 1> descriptor_set_layouts{layout_result.value};
+    // Previous frames may still read resources we are about to overwrite.
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, {});
 
-    auto pipeline_layout_result = RenderingDriverVulkan::get()->get_device().createPipelineLayout(vk::PipelineLayoutCreateInfo({}, descriptor_set_layouts, push_constant_ranges));
-    YEET_RESULT(pipeline_layout_result);
+    m_upload_recording = true;
 
-    return make_ref<MaterialLayoutVulkan>(layout_result.value, pool_result.value(), shaders.to_vector(), instance_layout, params.to_vector(), convert_polygon_mode(polygon_mode), convert_cull_mode(cull_mode), flags, pipeline_layout_result.value, transparency, always_draw_before).cast_to<MaterialLayout>();
+    return cb;
 }
 
-Expected<Ref<Material>> RenderingDriverVulkan::create_material(MaterialLayout *layout)
+Expected<std::optional<vk::CommandBuffer>> RenderingDriverVulkan::end_upload()
 {
-    MaterialLayoutVulkan *layout_vk = (MaterialLayoutVulkan *)layout;
+    if (!m_upload_recording)
+        return std::nullopt;
 
-    auto set_result = layout_vk->m_descriptor_pool.allocate();
-    YEET(set_result);
+    vk::CommandBuffer cb = m_upload_buffers[m_current_frame];
 
-    return make_ref<MaterialVulkan>(layout, set_result.value()).cast_to<Material>();
+    // On a dedicated transfer queue, the timeline semaphore waited by the graphics queue makes the writes visible.
+    if (!m_async_transfer)
+    {
+        vk::MemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead | vk::AccessFlagBits::eUniformRead | vk::AccessFlagBits::eShaderRead);
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eVertexShader | vk::PipelineStageFlagBits::eFragmentShader, {}, {barrier}, {}, {});
+    }
+
+    m_upload_recording = false;
+    m_upload_targets.clear();
+
+    YEET_RESULT_E(cb.end());
+
+    return cb;
 }
 
-void RenderingDriverVulkan::draw_graph(const RenderGraph& graph)
+Expected<void> RenderingDriverVulkan::submit_upload(vk::CommandBuffer cb)
 {
-    constexpr uint64_t timeout = 500'000'000; // 500 ms
+    // The value is only published once submitted, the graphics queue would otherwise wait for it forever.
+    const uint64_t signal_value = m_transfer_timeline_value + 1;
 
-    // Limit frame when `m_frames_limit != 0`.
-    if (m_frames_limit > 0)
-    {
-        uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - m_start_time).count();
+    // Only wait for frames still reading resources overwritten by this batch.
+    vk::PipelineStageFlags wait_stage_mask = vk::PipelineStageFlagBits::eTransfer;
+    uint32_t wait_count = m_upload_wait_value > 0 ? 1 : 0;
 
-        if (elapsed < m_time_between_frames)
-            return;
+    vk::TimelineSemaphoreSubmitInfo timeline_info(wait_count, &m_upload_wait_value, 1, &signal_value);
+    vk::SubmitInfo submit_info(wait_count, &m_graphics_timeline, &wait_stage_mask, 1, &cb, 1, &m_transfer_timeline, &timeline_info);
 
-        m_last_frame_limit_time = std::chrono::high_resolution_clock::now();
-    }
+    YEET_RESULT_E(m_transfer_queue.submit({submit_info}));
 
-    vk::Fence frame_fence = m_frame_fences[m_current_frame];
+    m_transfer_timeline_value = signal_value;
+    m_upload_wait_value = 0;
 
-    ERR_RESULT_E_RET(m_device.waitForFences({frame_fence}, true, timeout));
-    ERR_RESULT_E_RET(m_device.resetFences({frame_fence}));
+    return {};
+}
 
-    vk::Semaphore acquire_semaphore = m_acquire_semaphores[m_current_frame];
+void RenderingDriverVulkan::wait_graphics_before_upload(uint64_t value)
+{
+    m_upload_wait_value = std::max(m_upload_wait_value, value);
+}
 
-    auto image_index_result = m_device.acquireNextImageKHR(m_swapchain, timeout, acquire_semaphore, nullptr);
+Expected<StagingBuffer::Allocation> RenderingDriverVulkan::allocate_staging(size_t size, size_t alignment)
+{
+    std::optional<StagingBuffer::Allocation> allocation = m_staging_buffer.allocate(size, alignment, m_current_frame);
 
-    switch (image_index_result.result)
-    {
-    case vk::Result::eSuccess:
-        break;
-    case vk::Result::eSuboptimalKHR:
-    case vk::Result::eErrorOutOfDateKHR:
-        break;
-    default:
-        return;
-    }
+    if (allocation.has_value())
+        return allocation.value();
 
-    uint32_t image_index = image_index_result.value;
-    vk::Framebuffer fb = m_swapchain_framebuffers[image_index];
+    // The ring is full or the upload is too large, fallback on a dedicated buffer destroyed with the frame.
+    auto buffer_result = m_device.createBuffer(vk::BufferCreateInfo({}, size, vk::BufferUsageFlagBits::eTransferSrc));
+    YEET_RESULT(buffer_result);
 
-    vk::CommandBuffer cb = m_command_buffers[m_current_frame];
+    auto memory_result = allocate_memory_for_buffer(buffer_result.value, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+    YEET(memory_result);
 
-    ERR_RESULT_E_RET(cb.reset());
-    ERR_RESULT_E_RET(cb.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit)));
+    m_staging_overflow[m_current_frame].push_back({buffer_result.value, memory_result.value()});
 
-    // TODO: Add synchronization
+    return StagingBuffer::Allocation{.buffer = buffer_result.value, .offset = 0, .ptr = memory_result->ptr};
+}
 
-    for (const auto& instruction : graph.get_instructions())
+void RenderingDriverVulkan::track_upload_target(vk::CommandBuffer cb, vk::Buffer buffer)
+{
+    if (!m_upload_targets.contains(buffer))
     {
-        switch (instruction.kind)
-        {
-        case InstructionKind::BeginRenderPass:
-        {
-            std::array<vk::ClearValue, 2> clear_values{
-                vk::ClearColorValue(0.0f, 0.0f, 0.0f, 1.0f),
-                vk::ClearDepthStencilValue(0.0),
-            };
-
-            cb.beginRenderPass(vk::RenderPassBeginInfo(m_render_pass, fb, vk::Rect2D(vk::Offset2D(0, 0), vk::Extent2D(m_surface_extent.width, m_surface_extent.height)), clear_values), vk::SubpassContents::eInline);
-            break;
-        }
-        case InstructionKind::EndRenderPass:
-        {
-            cb.endRenderPass();
-            break;
-        }
-        case InstructionKind::Draw:
-        {
-            MeshVulkan *mesh = (MeshVulkan *)instruction.draw.mesh;
+        m_upload_targets.insert(buffer);
+        return;
+    }
 
-            MaterialVulkan *material = (MaterialVulkan *)instruction.draw.material;
-            const Ref<MaterialLayoutVulkan>& material_layout = material->get_layout().cast_to<MaterialLayoutVulkan>();
+    // Copies are not ordered between each other, two writes to the same buffer need a barrier.
+    vk::MemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eTransferWrite);
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {}, {barrier}, {}, {});
 
-            std::optional<Buffer *> instance_buffer = instruction.draw.instance_buffer;
+    m_upload_targets.clear();
+    m_upload_targets.insert(buffer);
+}
 
-            auto pipeline_result = m_pipeline_cache.get_or_create(material, m_render_pass);
-            ERR_EXPECT_B(pipeline_result, "Failed to create a pipeline for the material");
+/**
+ * @brief Header written before the data of the pipeline cache. The driver version is not part of the header defined by
+ * Vulkan, so it is stored here to discard caches from older drivers.
+ */
+struct PipelineCacheFileHeader
+{
+    static constexpr uint32_t magic_value = 0x50435846; // "FXCP"
 
-            cb.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline_result.value());
-            cb.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, material_layout->m_pipeline_layout, 0, {material->descriptor_set}, {});
+    uint32_t magic;
+    uint32_t driver_version;
+    uint64_t data_size;
+};
 
-            Ref<BufferVulkan> index_buffer = mesh->index_buffer.cast_to<BufferVulkan>();
-            Ref<BufferVulkan> vertex_buffer = mesh->vertex_buffer.cast_to<BufferVulkan>();
-            Ref<BufferVulkan> normal_buffer = mesh->normal_buffer.cast_to<BufferVulkan>();
-            Ref<BufferVulkan> uv_buffer = mesh->uv_buffer.cast_to<BufferVulkan>();
+Expected<void> RenderingDriverVulkan::load_pipeline_cache()
+{
+    char *pref_path = SDL_GetPrefPath("ft_vox", "ft_vox");
+    m_pipeline_cache_path = std::string(pref_path ? pref_path : "") + "pipeline_cache.bin";
+    SDL_free(pref_path);
 
-            cb.bindIndexBuffer(index_buffer->buffer, 0, mesh->index_type_vk);
-            cb.bindVertexBuffers(0, {vertex_buffer->buffer, normal_buffer->buffer, uv_buffer->buffer}, {0, 0, 0});
+    std::vector<uint8_t> data;
+    std::ifstream ifs(m_pipeline_cache_path, std::ios::binary | std::ios::ate);
 
-            if (instance_buffer.has_value())
-            {
-                cb.bindVertexBuffers(3, {((BufferVulkan *)instance_buffer.value())->buffer}, {0});
-            }
+    PipelineCacheFileHeader header{};
+    const std::streamoff file_size = ifs.is_open() ? (std::streamoff)ifs.tellg() : 0;
 
-            cb.setViewport(0, {vk::Viewport(0.0, 0.0, (float)m_surface_extent.width, (float)m_surface_extent.height, 0.0, 1.0)});
-            cb.setScissor(0, {vk::Rect2D({0, 0}, {m_surface_extent.width, m_surface_extent.height})});
+    ifs.seekg(0);
 
-            PushConstants push_constants{
-                .view_matrix = instruction.draw.view_matrix,
-            };
+    // The size stored in the file is only trusted when the file actually contains that many bytes.
+    if (ifs.is_open() && file_size >= (std::streamoff)sizeof(header) && ifs.read((char *)&header, sizeof(header)) && header.magic == PipelineCacheFileHeader::magic_value && header.driver_version == m_physical_device_properties.driverVersion && header.data_size == (uint64_t)(file_size - (std::streamoff)sizeof(header)))
+    {
+        data.resize(header.data_size);
+        ifs.read((char *)data.data(), (std::streamsize)data.size());
 
-            cb.pushConstants(material_layout->m_pipeline_layout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(PushConstants), &push_constants);
+        // Validate the header defined by Vulkan, some drivers do not handle caches from other devices well.
+        constexpr size_t vk_header_size = 16 + vk::UuidSize;
+        bool valid = ifs && data.size() >= vk_header_size;
 
-            cb.drawIndexed(mesh->vertex_count(), instruction.draw.instance_count, 0, 0, 0);
+        if (valid)
+        {
+            uint32_t header_size, header_version;
+            std::memcpy(&header_size, data.data(), sizeof(uint32_t));
+            std::memcpy(&header_version, data.data() + 4, sizeof(uint32_t));
 
-            break;
+            valid = header_size >= vk_header_size && header_size <= data.size() && header_version == (uint32_t)vk::PipelineCacheHeaderVersion::eOne;
         }
-        case InstructionKind::Copy:
+
+        if (valid)
         {
-            // TODO
-            break;
-        }
+            uint32_t vendor_id, device_id;
+            std::memcpy(&vendor_id, data.data() + 8, sizeof(uint32_t));
+            std::memcpy(&device_id, data.data() + 12, sizeof(uint32_t));
+
+            valid = vendor_id == m_physical_device_properties.vendorID && device_id == m_physical_device_properties.deviceID && std::memcmp(data.data() + 16, m_physical_device_properties.pipelineCacheUUID.data(), vk::UuidSize) == 0;
         }
+
+        if (!valid)
+            data.clear();
     }
 
-    ERR_RESULT_E_RET(cb.end());
+    if (!data.empty())
+        std::println("info: Loaded pipeline cache from `{}` ({} bytes)", m_pipeline_cache_path, data.size());
 
-    vk::PipelineStageFlags wait_stage_mask = vk::PipelineStageFlagBits::eColorAttachmentOutput;
-    vk::Semaphore submit_semaphore = m_submit_semaphores[image_index];
+    auto cache_result = m_device.createPipelineCache(vk::PipelineCacheCreateInfo({}, data.size(), data.data()));
+    YEET_RESULT(cache_result);
+    m_vk_pipeline_cache = cache_result.value;
 
-    ERR_RESULT_E_RET(m_graphics_queue.submit({vk::SubmitInfo({acquire_semaphore}, {wait_stage_mask}, {cb}, {submit_semaphore})}, m_frame_fences[m_current_frame]));
-    ERR_RESULT_E_RET(m_graphics_queue.presentKHR(vk::PresentInfoKHR({submit_semaphore}, {m_swapchain}, {image_index})));
+    m_pipeline_cache_save_time = std::chrono::high_resolution_clock::now();
 
-    m_current_frame = (m_current_frame + 1) % max_frames_in_flight;
+    return {};
 }
 
-static std::vector<uint32_t> read_shader_code(const char *filename)
+void RenderingDriverVulkan::save_pipeline_cache()
 {
-    std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
-    ERR_COND_V(!ifs.is_open(), "Shader %s does not exists", filename);
+    if (!m_vk_pipeline_cache || !m_pipeline_cache_dirty)
+        return;
 
-    if (!ifs)
-    {
-        return {};
-    }
+    m_pipeline_cache_dirty = false;
+    m_pipeline_cache_save_time = std::chrono::high_resolution_clock::now();
 
-    size_t size = ifs.tellg();
+    auto data_result = m_device.getPipelineCacheData(m_vk_pipeline_cache);
+    if (data_result.result != vk::Result::eSuccess)
+        return;
 
-    ifs.seekg(0, std::ios::beg);
+    PipelineCacheFileHeader header{
+        .magic = PipelineCacheFileHeader::magic_value,
+        .driver_version = m_physical_device_properties.driverVersion,
+        .data_size = data_result.value.size(),
+    };
 
-    std::vector<uint32_t> data(size);
+    // Write to a temporary file first so a crash never leaves a truncated cache behind.
+    const std::string tmp_path = m_pipeline_cache_path + ".tmp";
 
-    ifs.read((char *)data.data(), (ssize_t)size);
+    {
+        std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+        ERR_COND_VR(!ofs.is_open(), "Cannot write the pipeline cache to `%s`", tmp_path.c_str());
 
-    return data;
+        ofs.write((const char *)&header, sizeof(header));
+        ofs.write((const char *)data_result.value.data(), (std::streamsize)data_result.value.size());
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tmp_path, m_pipeline_cache_path, error);
 }
 
-Expected<vk::Pipeline> RenderingDriverVulkan::create_graphics_pipeline(Span<ShaderRef> shaders, std::optional<InstanceLayout> instance_layout, vk::PolygonMode polygon_mode, vk::CullModeFlags cull_mode, bool transparency, bool always_draw_before, vk::PipelineLayout pipeline_layout, vk::RenderPass render_pass)
+Expected<vk::Pipeline> RenderingDriverVulkan::create_graphics_pipeline(Span<ShaderRef> shaders, const VertexLayout& vertex_layout, std::optional<InstanceLayout> instance_layout, bool instanced_view_matrix, vk::PolygonMode polygon_mode, vk::CullModeFlags cull_mode, bool transparency, bool always_draw_before, vk::PipelineLayout pipeline_layout, vk::RenderPass render_pass)
 {
     StackVector<vk::PipelineShaderStageCreateInfo, 4> shader_stages;
 
+    // Modules are owned by the pipeline cache entry, which releases them when the pipeline is destroyed.
     for (const auto& shader : shaders)
     {
-        std::vector<uint32_t> code = read_shader_code(shader.filename);
+        auto shader_module_result = m_shader_module_cache.acquire(shader.filename);
+
+        if (!shader_module_result.has_value())
+        {
+            for (size_t i = 0; i < shader_stages.size(); i++)
+                m_shader_module_cache.release(shaders[i].filename);
 
-        auto shader_model_result = m_device.createShaderModule(vk::ShaderModuleCreateInfo({}, code.size(), code.data()));
-        YEET_RESULT(shader_model_result);
+            return std::unexpected(shader_module_result.error());
+        }
 
-        shader_stages.push_back(vk::PipelineShaderStageCreateInfo({}, convert_shader_stage(shader.kind), shader_model_result.value, "main"));
+        shader_stages.push_back(vk::PipelineShaderStageCreateInfo({}, convert_shader_stage(shader.kind), shader_module_result.value(), "main"));
     }
 
+    // Vertex streams use the first bindings, the instance buffer the one after them and the view matrices the last.
+    const uint32_t instance_binding = vertex_layout.strides.size();
+    const uint32_t matrix_binding = instance_binding + 1;
+
     std::vector<vk::VertexInputBindingDescription> input_bindings;
-    input_bindings.reserve(instance_layout.has_value() ? 4 : 3);
+    input_bindings.reserve(matrix_binding + 1);
 
     std::vector<vk::VertexInputAttributeDescription> input_attribs;
-    input_attribs.reserve(3 + (instance_layout.has_value() ? instance_layout->inputs.size() : 0));
+    input_attribs.reserve(vertex_layout.inputs.size() + (instance_layout.has_value() ? instance_layout->inputs.size() : 0) + 5);
 
-    input_bindings.push_back(vk::VertexInputBindingDescription(0, sizeof(glm::vec3), vk::VertexInputRate::eVertex));
-    input_bindings.push_back(vk::VertexInputBindingDescription(1, sizeof(glm::vec3), vk::VertexInputRate::eVertex));
-    input_bindings.push_back(vk::VertexInputBindingDescription(2, sizeof(glm::vec2), vk::VertexInputRate::eVertex));
+    for (uint32_t stream = 0; stream < vertex_layout.strides.size(); stream++)
+        input_bindings.push_back(vk::VertexInputBindingDescription(stream, vertex_layout.strides[stream], vk::VertexInputRate::eVertex));
 
-    input_attribs.push_back(vk::VertexInputAttributeDescription(0, 0, vk::Format::eR32G32B32Sfloat, 0));
-    input_attribs.push_back(vk::VertexInputAttributeDescription(1, 1, vk::Format::eR32G32B32Sfloat, 0));
-    input_attribs.push_back(vk::VertexInputAttributeDescription(2, 2, vk::Format::eR32G32Sfloat, 0));
+    uint32_t location = 0;
 
-    if (instance_layout.has_value())
+    for (const auto& input : vertex_layout.inputs)
     {
-        input_bindings.push_back(vk::VertexInputBindingDescription(3, instance_layout->stride, vk::VertexInputRate::eInstance));
+        input_attribs.push_back(vk::VertexInputAttributeDescription(location, input.stream, convert_shader_type(input.type), input.offset));
+        location += 1;
+    }
 
-        size_t location = 3;
+    if (instance_layout.has_value())
+    {
+        input_bindings.push_back(vk::VertexInputBindingDescription(instance_binding, instance_layout->stride, vk::VertexInputRate::eInstance));
 
         for (const auto& input : instance_layout->inputs)
         {
-            input_attribs.push_back(vk::VertexInputAttributeDescription(location, 3, convert_shader_type(input.type), input.offset));
+            input_attribs.push_back(vk::VertexInputAttributeDescription(location, instance_binding, convert_shader_type(input.type), input.offset));
+            location += 1;
+        }
+    }
+
+    if (instanced_view_matrix)
+    {
+        input_bindings.push_back(vk::VertexInputBindingDescription(matrix_binding, sizeof(DrawInstance), vk::VertexInputRate::eInstance));
+
+        // A matrix input takes one location per column.
+        for (uint32_t column = 0; column < 4; column++)
+        {
+            input_attribs.push_back(vk::VertexInputAttributeDescription(location, matrix_binding, vk::Format::eR32G32B32A32Sfloat, offsetof(DrawInstance, view_matrix) + column * sizeof(glm::vec4)));
             location += 1;
         }
+
+        input_attribs.push_back(vk::VertexInputAttributeDescription(location, matrix_binding, vk::Format::eR32Uint, offsetof(DrawInstance, instance)));
     }
 
     std::array<vk::DynamicState, 2> dynamic_states{vk::DynamicState::eViewport, vk::DynamicState::eScissor};
@@ -957,7 +3176,9 @@ Expected<vk::Pipeline> RenderingDriverVulkan::create_graphics_pipeline(Span<Shad
     vk::PipelineColorBlendStateCreateInfo blend_info({}, vk::False, vk::LogicOp::eCopy, {color_blend_state});
     vk::PipelineDepthStencilStateCreateInfo depth_info({}, vk::True, vk::True, always_draw_before ? vk::CompareOp::eLessOrEqual : vk::CompareOp::eLess, vk::False, vk::False);
 
-    auto pipeline_result = m_device.createGraphicsPipeline(nullptr, vk::GraphicsPipelineCreateInfo(
+    const auto start_time = std::chrono::high_resolution_clock::now();
+
+    auto pipeline_result = m_device.createGraphicsPipeline(m_vk_pipeline_cache, vk::GraphicsPipelineCreateInfo(
                                                                         {},
                                                                         shader_stages.size(),
                                                                         shader_stages.data(),
@@ -974,8 +3195,21 @@ Expected<vk::Pipeline> RenderingDriverVulkan::create_graphics_pipeline(Span<Shad
                                                                         render_pass,
                                                                         0, // subpass
                                                                         nullptr, 0));
+
+    if (pipeline_result.result != vk::Result::eSuccess)
+    {
+        for (const auto& shader : shaders)
+            m_shader_module_cache.release(shader.filename);
+    }
+
     YEET_RESULT(pipeline_result);
 
+    const auto creation_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start_time);
+
+    m_pipeline_creation_time_us += creation_time.count();
+    m_pipeline_creation_count += 1;
+    m_pipeline_cache_dirty = true;
+
     return pipeline_result.value;
 }
 
@@ -986,57 +3220,73 @@ Expected<Ref<Texture>> RenderingDriverVulkan::create_texture_from_vk_image(vk::I
     auto image_view_result = m_device.createImageView(vk::ImageViewCreateInfo({}, image, vk::ImageViewType::e2D, format, {}, vk::ImageSubresourceRange(aspect_mask, 0, 1, 0, 1)));
     YEET_RESULT(image_view_result);
 
-    return make_ref<TextureVulkan>(image, nullptr, image_view_result.value, width, height, 0, aspect_mask, 1, false).cast_to<Texture>();
+    return make_ref<TextureVulkan>(image, MemoryAllocation{}, image_view_result.value, width, height, 0, aspect_mask, 1, false).cast_to<Texture>();
 }
 
-std::optional<uint32_t> RenderingDriverVulkan::find_memory_type_index(uint32_t type_bits, vk::MemoryPropertyFlags properties)
+std::optional<uint32_t> RenderingDriverVulkan::find_memory_type_index(uint32_t type_bits, vk::MemoryPropertyFlags properties, vk::MemoryPropertyFlags preferred)
 {
     uint32_t bits = type_bits;
+    std::optional<uint32_t> fallback = std::nullopt;
 
     for (size_t i = 0; i < m_memory_properties.memoryTypeCount; i++)
     {
-        if (bits & 1 && (m_memory_properties.memoryTypes[i].propertyFlags & properties) == properties)
-            return i;
+        const vk::MemoryPropertyFlags flags = m_memory_properties.memoryTypes[i].propertyFlags;
+
+        if (bits & 1 && (flags & properties) == properties)
+        {
+            if ((flags & preferred) == preferred)
+                return i;
+            else if (!fallback.has_value())
+                fallback = i;
+        }
         bits >>= 1;
     }
 
-    return std::nullopt;
+    return fallback;
 }
 
-std::expected<vk::DeviceMemory, Error> RenderingDriverVulkan::allocate_memory_for_buffer(vk::Buffer buffer, vk::MemoryPropertyFlags properties)
+std::expected<MemoryAllocation, Error> RenderingDriverVulkan::allocate_memory_for_buffer(vk::Buffer buffer, vk::MemoryPropertyFlags properties, vk::MemoryPropertyFlags preferred)
 {
     vk::MemoryRequirements requirements = m_device.getBufferMemoryRequirements(buffer);
-    auto memory_type_index_opt = find_memory_type_index(requirements.memoryTypeBits, properties);
+    auto memory_type_index_opt = find_memory_type_index(requirements.memoryTypeBits, properties, preferred);
 
     if (!memory_type_index_opt.has_value())
-        return Error::unexpected<vk::DeviceMemory>(ErrorKind::OutOfDeviceMemory);
+        return Error::unexpected<MemoryAllocation>(ErrorKind::OutOfDeviceMemory);
 
-    uint32_t memory_type_index = memory_type_index_opt.value();
-    auto memory_result = m_device.allocateMemory(vk::MemoryAllocateInfo(requirements.size, memory_type_index));
-    YEET_RESULT(memory_result);
+    auto memory_result = m_allocator.allocate(requirements, memory_type_index_opt.value(), true);
+    YEET(memory_result);
+
+    auto bind_result = m_device.bindBufferMemory(buffer, memory_result->memory, memory_result->offset);
 
-    auto bind_result = m_device.bindBufferMemory(buffer, memory_result.value, 0);
-    YEET_RESULT_E(bind_result);
+    if (bind_result != vk::Result::eSuccess)
+    {
+        m_allocator.free(memory_result.value());
+        return std::unexpected(bind_result);
+    }
 
-    return memory_result.value;
+    return memory_result.value();
 }
 
-std::expected<vk::DeviceMemory, Error> RenderingDriverVulkan::allocate_memory_for_image(vk::Image image, vk::MemoryPropertyFlags properties)
+std::expected<MemoryAllocation, Error> RenderingDriverVulkan::allocate_memory_for_image(vk::Image image, vk::MemoryPropertyFlags properties, vk::MemoryPropertyFlags preferred)
 {
     vk::MemoryRequirements requirements = m_device.getImageMemoryRequirements(image);
-    auto memory_type_index_opt = find_memory_type_index(requirements.memoryTypeBits, properties);
+    auto memory_type_index_opt = find_memory_type_index(requirements.memoryTypeBits, properties, preferred);
 
     if (!memory_type_index_opt.has_value())
-        return Error::unexpected<vk::DeviceMemory>(ErrorKind::OutOfDeviceMemory);
+        return Error::unexpected<MemoryAllocation>(ErrorKind::OutOfDeviceMemory);
 
-    uint32_t memory_type_index = memory_type_index_opt.value();
-    auto memory_result = m_device.allocateMemory(vk::MemoryAllocateInfo(requirements.size, memory_type_index));
-    YEET_RESULT(memory_result);
+    auto memory_result = m_allocator.allocate(requirements, memory_type_index_opt.value(), false);
+    YEET(memory_result);
+
+    auto bind_result = m_device.bindImageMemory(image, memory_result->memory, memory_result->offset);
 
-    auto bind_result = m_device.bindImageMemory(image, memory_result.value, 0);
-    YEET_RESULT_E(bind_result);
+    if (bind_result != vk::Result::eSuccess)
+    {
+        m_allocator.free(memory_result.value());
+        return std::unexpected(bind_result);
+    }
 
-    return memory_result.value;
+    return memory_result.value();
 }
 
 static bool contains_ext(const std::vector<vk::ExtensionProperties>& extensions, const char *ext)
@@ -1095,7 +3345,8 @@ std::expected<QueueInfo, bool> RenderingDriverVulkan::find_queue(vk::PhysicalDev
         {
             queue_info.graphics_index = i;
 
-            bool present_support = physical_device.getSurfaceSupportKHR(i, m_surface).value;
+            // Offscreen rendering has nothing to present to.
+            bool present_support = !m_surface || physical_device.getSurfaceSupportKHR(i, m_surface).value;
 
             if (!present_support)
                 return std::unexpected(false);
@@ -1115,6 +3366,18 @@ std::expected<QueueInfo, bool> RenderingDriverVulkan::find_queue(vk::PhysicalDev
         }
     }
 
+    // Select a transfer queue which does nothing else
+    for (size_t i = 0; i < queue_properties.size(); i++)
+    {
+        const auto& queue_property = queue_properties[i];
+
+        if (queue_property.queueFlags & vk::QueueFlagBits::eTransfer && !(queue_property.queueFlags & (vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute)))
+        {
+            queue_info.transfer_index = i;
+            break;
+        }
+    }
+
     return queue_info;
 }
 
@@ -1155,41 +3418,99 @@ std::optional<PhysicalDeviceWithInfo> RenderingDriverVulkan::pick_best_device(co
 
 BufferVulkan::~BufferVulkan()
 {
-    RenderingDriverVulkan::get()->get_device().freeMemory(memory);
+    RenderingDriverVulkan::get()->get_allocator().free(memory);
     RenderingDriverVulkan::get()->get_device().destroyBuffer(buffer);
 }
 
 void BufferVulkan::update(Span<uint8_t> view, size_t offset)
 {
-    ERR_COND_VR(view.size() > m_size - offset, "Out of bounds: %zu vs %zu", view.size(), m_size - offset);
+    ERR_COND_VR(offset > m_size || view.size() > m_size - offset, "Out of bounds: %zu + %zu vs %zu", offset, view.size(), m_size);
+
+    if (view.size() == 0)
+        return;
+
+    if (dynamic)
+    {
+        write(view, offset);
+        return;
+    }
+
+    // Write in place when the memory is mapped and nothing uses the buffer, the submission makes the writes visible.
+    if (memory.ptr != nullptr && RenderingDriverVulkan::get()->is_buffer_idle(this))
+    {
+        std::memcpy(memory.ptr + offset, view.data(), view.size());
+
+        if (!coherent)
+            RenderingDriverVulkan::get()->flush_memory(memory, offset, view.size());
+
+        return;
+    }
+
+    RenderingDriverVulkan::get()->wait_graphics_before_upload(last_use);
+    stage(view, offset, true);
+}
+
+void BufferVulkan::update_range(Span<uint8_t> view, size_t offset)
+{
+    ERR_COND_VR(offset > m_size || view.size() > m_size - offset, "Out of bounds: %zu + %zu vs %zu", offset, view.size(), m_size);
 
     if (view.size() == 0)
         return;
 
-    auto buffer_result = RenderingDriverVulkan::get()->create_buffer(view.size(), {.copy_src = true}, BufferVisibility::GPUAndCPU);
-    ERR_EXPECT_R(buffer_result, "failed to create the staging buffer");
+    // No frame reads the range, so it can be written in place even when the rest of the buffer is in use.
+    if (memory.ptr != nullptr)
+    {
+        std::memcpy(memory.ptr + offset, view.data(), view.size());
+
+        if (!coherent)
+            RenderingDriverVulkan::get()->flush_memory(memory, offset, view.size());
+
+        return;
+    }
+
+    // The range is not written by other copies of the batch, they do not need to be ordered with this one.
+    stage(view, offset, false);
+}
+
+void BufferVulkan::stage(Span<uint8_t> view, size_t offset, bool ordered)
+{
+    auto cb_result = RenderingDriverVulkan::get()->begin_upload();
+    ERR_EXPECT_R(cb_result, "failed to begin the upload");
 
-    Ref<BufferVulkan> staging_buffer_vk = buffer_result.value().cast_to<BufferVulkan>();
+    auto staging_result = RenderingDriverVulkan::get()->allocate_staging(view.size());
+    ERR_EXPECT_R(staging_result, "failed to allocate staging memory");
 
     // Copy the data into the staging buffer.
-    auto map_result = RenderingDriverVulkan::get()->get_device().mapMemory(staging_buffer_vk->memory, 0, view.size(), {});
-    ERR_RESULT_RET(map_result);
-    std::memcpy(map_result.value, view.data(), view.size());
-    RenderingDriverVulkan::get()->get_device().unmapMemory(staging_buffer_vk->memory);
+    std::memcpy(staging_result->ptr, view.data(), view.size());
 
-    // Copy from the staging buffer to the final buffer
-    vk::CommandBuffer cb = RenderingDriverVulkan::get()->get_transfer_buffer();
+    // Copy from the staging buffer to the final buffer when the batch is executed.
+    vk::CommandBuffer cb = cb_result.value();
 
-    ERR_RESULT_E_RET(cb.reset());
-    ERR_RESULT_E_RET(cb.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit)));
+    if (ordered)
+        RenderingDriverVulkan::get()->track_upload_target(cb, buffer);
 
-    vk::BufferCopy region(0, offset, std::min(view.size(), m_size - offset));
+    last_upload = RenderingDriverVulkan::get()->get_graphics_timeline_value() + 1;
 
-    cb.copyBuffer(staging_buffer_vk->buffer, buffer, {region});
-    ERR_RESULT_E_RET(cb.end());
+    vk::BufferCopy region(staging_result->offset, offset, std::min(view.size(), m_size - offset));
+    cb.copyBuffer(staging_result->buffer, buffer, {region});
+}
+
+uint8_t *BufferVulkan::map()
+{
+    if (!dynamic)
+        return nullptr;
+
+    auto prepare_result = RenderingDriverVulkan::get()->prepare_dynamic_write(this);
+
+    if (!prepare_result.has_value())
+        return nullptr;
+
+    return memory.ptr + offset();
+}
 
-    ERR_RESULT_E_RET(RenderingDriverVulkan::get()->get_graphics_queue().submit({vk::SubmitInfo(0, nullptr, nullptr, 1, &cb)}));
-    ERR_RESULT_E_RET(RenderingDriverVulkan::get()->get_graphics_queue().waitIdle());
+vk::DeviceSize BufferVulkan::offset() const
+{
+    return dynamic ? RenderingDriverVulkan::get()->get_current_frame() * frame_stride : 0;
 }
 
 TextureVulkan::~TextureVulkan()
@@ -1198,7 +3519,7 @@ TextureVulkan::~TextureVulkan()
 
     if (owned)
     {
-        RenderingDriverVulkan::get()->get_device().freeMemory(memory);
+        RenderingDriverVulkan::get()->get_allocator().free(memory);
         RenderingDriverVulkan::get()->get_device().destroyImage(image);
     }
 }
@@ -1210,30 +3531,22 @@ void TextureVulkan::update(Span<uint8_t> view, uint32_t layer)
     if (view.size() == 0)
         return;
 
-    auto buffer_result = RenderingDriverVulkan::get()->create_buffer(view.size(), {.copy_src = true}, BufferVisibility::GPUAndCPU);
-    ERR_EXPECT_R(buffer_result, "failed to create the staging buffer");
+    auto cb_result = RenderingDriverVulkan::get()->begin_upload();
+    ERR_EXPECT_R(cb_result, "failed to begin the upload");
 
-    Ref<BufferVulkan> staging_buffer_vk = buffer_result.value().cast_to<BufferVulkan>();
+    auto staging_result = RenderingDriverVulkan::get()->allocate_staging(view.size());
+    ERR_EXPECT_R(staging_result, "failed to allocate staging memory");
 
     // Copy the data into the staging buffer.
-    auto map_result = RenderingDriverVulkan::get()->get_device().mapMemory(staging_buffer_vk->memory, 0, view.size(), {});
-    ERR_RESULT_RET(map_result);
-    std::memcpy(map_result.value, view.data(), view.size());
-    RenderingDriverVulkan::get()->get_device().unmapMemory(staging_buffer_vk->memory);
-
-    // Copy from the staging buffer to the final buffer
-    vk::CommandBuffer cb = RenderingDriverVulkan::get()->get_transfer_buffer();
-
-    ERR_RESULT_E_RET(cb.reset());
-    ERR_RESULT_E_RET(cb.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit)));
+    std::memcpy(staging_result->ptr, view.data(), view.size());
 
-    vk::BufferImageCopy region(0, 0, 0, vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, layer, 1), {}, vk::Extent3D(m_width, m_height, 1));
-
-    cb.copyBufferToImage(staging_buffer_vk->buffer, image, vk::ImageLayout::eTransferDstOptimal, {region});
-    ERR_RESULT_E_RET(cb.end());
+    // Copy from the staging buffer to the final image when the batch is executed.
+    // Reads of textures are not tracked, so wait for every submitted frame.
+    vk::CommandBuffer cb = cb_result.value();
+    RenderingDriverVulkan::get()->wait_graphics_before_upload(RenderingDriverVulkan::get()->get_graphics_timeline_value());
 
-    ERR_RESULT_E_RET(RenderingDriverVulkan::get()->get_graphics_queue().submit({vk::SubmitInfo(0, nullptr, nullptr, 1, &cb)}));
-    ERR_RESULT_E_RET(RenderingDriverVulkan::get()->get_graphics_queue().waitIdle());
+    vk::BufferImageCopy region(staging_result->offset, 0, 0, vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, layer, 1), {}, vk::Extent3D(m_width, m_height, 1));
+    cb.copyBufferToImage(staging_result->buffer, image, vk::ImageLayout::eTransferDstOptimal, {region});
 }
 
 static vk::AccessFlags layout_to_access_mask(TextureLayout layout)
@@ -1242,6 +3555,8 @@ static vk::AccessFlags layout_to_access_mask(TextureLayout layout)
     {
     case TextureLayout::Undefined:
         return {};
+    case TextureLayout::ColorAttachment:
+        return vk::AccessFlagBits::eColorAttachmentWrite;
     case TextureLayout::DepthStencilAttachment:
         return vk::AccessFlagBits::eDepthStencilAttachmentRead;
     case TextureLayout::CopyDst:
@@ -1262,6 +3577,8 @@ static vk::PipelineStageFlags layout_to_stage_mask(TextureLayout layout)
     {
     case TextureLayout::Undefined:
         return vk::PipelineStageFlagBits::eTopOfPipe;
+    case TextureLayout::ColorAttachment:
+        return vk::PipelineStageFlagBits::eColorAttachmentOutput;
     case TextureLayout::DepthStencilAttachment:
         return vk::PipelineStageFlagBits::eEarlyFragmentTests;
     case TextureLayout::CopyDst:
@@ -1279,10 +3596,40 @@ static vk::PipelineStageFlags layout_to_stage_mask(TextureLayout layout)
 
 void TextureVulkan::transition_layout(TextureLayout new_layout)
 {
-    vk::CommandBuffer cb = RenderingDriverVulkan::get()->get_transfer_buffer();
+    // Layout transitions are recorded in the upload batch so they stay ordered with texture updates.
+    auto cb_result = RenderingDriverVulkan::get()->begin_upload();
+    ERR_EXPECT_R(cb_result, "failed to begin the upload");
+
+    vk::CommandBuffer cb = cb_result.value();
+
+    vk::PipelineStageFlags src_stage_mask;
+    vk::PipelineStageFlags dst_stage_mask;
+
+    vk::ImageMemoryBarrier barrier = transition_barrier(new_layout, src_stage_mask, dst_stage_mask);
+
+    // A transfer queue only supports transfer stages, semaphores take care of the rest.
+    if (RenderingDriverVulkan::get()->has_async_transfer())
+    {
+        RenderingDriverVulkan::get()->wait_graphics_before_upload(RenderingDriverVulkan::get()->get_graphics_timeline_value());
+
+        if (src_stage_mask != vk::PipelineStageFlagBits::eTransfer)
+        {
+            src_stage_mask = vk::PipelineStageFlagBits::eTopOfPipe;
+            barrier.srcAccessMask = {};
+        }
 
-    ERR_RESULT_E_RET(cb.begin(vk::CommandBufferBeginInfo()));
+        if (dst_stage_mask != vk::PipelineStageFlagBits::eTransfer)
+        {
+            dst_stage_mask = vk::PipelineStageFlagBits::eBottomOfPipe;
+            barrier.dstAccessMask = {};
+        }
+    }
+
+    cb.pipelineBarrier(src_stage_mask, dst_stage_mask, {}, {}, {}, {barrier});
+}
 
+vk::ImageMemoryBarrier TextureVulkan::transition_barrier(TextureLayout new_layout, vk::PipelineStageFlags& src_stage_mask, vk::PipelineStageFlags& dst_stage_mask)
+{
     vk::ImageMemoryBarrier barrier(
         layout_to_access_mask(m_layout), layout_to_access_mask(new_layout),
         convert_texture_layout(m_layout), convert_texture_layout(new_layout),
@@ -1290,22 +3637,19 @@ void TextureVulkan::transition_layout(TextureLayout new_layout)
         image,
         vk::ImageSubresourceRange(aspect_mask, 0, 1, 0, layers));
 
-    vk::PipelineStageFlags src_stage_mask = layout_to_stage_mask(m_layout);
-    vk::PipelineStageFlags dst_stage_mask = layout_to_stage_mask(new_layout);
-
-    cb.pipelineBarrier(src_stage_mask, dst_stage_mask, {}, {}, {}, {barrier});
-    ERR_RESULT_E_RET(cb.end());
-
-    ERR_RESULT_E_RET(RenderingDriverVulkan::get()->get_graphics_queue().submit({vk::SubmitInfo({}, {}, {cb}, {})}));
-    ERR_RESULT_E_RET(RenderingDriverVulkan::get()->get_graphics_queue().waitIdle());
+    src_stage_mask |= layout_to_stage_mask(m_layout);
+    dst_stage_mask |= layout_to_stage_mask(new_layout);
 
     m_layout = new_layout;
+
+    return barrier;
 }
 
 Expected<DescriptorPool> DescriptorPool::create(vk::DescriptorSetLayout layout, Span<MaterialParam> params)
 {
     uint32_t image_sampler_count = 0;
     uint32_t uniform_buffer_count = 0;
+    uint32_t storage_buffer_count = 0;
 
     for (const auto& param : params)
     {
@@ -1317,6 +3661,9 @@ Expected<DescriptorPool> DescriptorPool::create(vk::DescriptorSetLayout layout,
         case MaterialParamKind::UniformBuffer:
             uniform_buffer_count += 1;
             break;
+        case MaterialParamKind::StorageBuffer:
+            storage_buffer_count += 1;
+            break;
         }
     }
 
@@ -1325,97 +3672,403 @@ Expected<DescriptorPool> DescriptorPool::create(vk::DescriptorSetLayout layout,
         sizes.push_back(vk::DescriptorPoolSize(vk::DescriptorType::eCombinedImageSampler, image_sampler_count));
     if (uniform_buffer_count > 0)
         sizes.push_back(vk::DescriptorPoolSize(vk::DescriptorType::eUniformBuffer, uniform_buffer_count));
+    if (storage_buffer_count > 0)
+        sizes.push_back(vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, storage_buffer_count));
 
-    auto pool_result = RenderingDriverVulkan::get()->get_device().createDescriptorPool(vk::DescriptorPoolCreateInfo({}, max_sets, sizes.size(), sizes.data()));
-    YEET_RESULT(pool_result);
+    // A pool needs at least one size, even when its sets have no descriptor.
+    if (sizes.empty())
+        sizes.push_back(vk::DescriptorPoolSize(vk::DescriptorType::eUniformBuffer, 1));
 
+    // Pools are created on the first allocation, layouts without materials cost nothing.
     return DescriptorPool(layout, std::move(sizes));
 }
 
 Expected<vk::DescriptorSet> DescriptorPool::allocate()
 {
-    if (m_allocation_count / max_sets >= m_pools.size())
+    const uint64_t completed = RenderingDriverVulkan::get()->get_completed_frame_value();
+
+    while (!m_retired.empty() && m_retired.front().first <= completed)
     {
-        YEET(add_pool());
+        m_free.push_back(m_retired.front().second);
+        m_retired.pop_front();
     }
 
-    vk::DescriptorPool pool = m_pools[m_allocation_count / max_sets];
+    if (!m_free.empty())
+    {
+        const vk::DescriptorSet set = m_free.back();
+        m_free.pop_back();
+        return set;
+    }
+
+    if (m_pool_remaining == 0)
+        YEET(add_pool());
 
-    auto descriptor_set_result = RenderingDriverVulkan::get()->get_device().allocateDescriptorSets(vk::DescriptorSetAllocateInfo(pool, 1, &m_layout));
+    auto descriptor_set_result = RenderingDriverVulkan::get()->get_device().allocateDescriptorSets(vk::DescriptorSetAllocateInfo(m_pools.back(), 1, &m_layout));
     YEET_RESULT(descriptor_set_result);
 
-    m_allocation_count += 1;
+    m_pool_remaining -= 1;
 
     return descriptor_set_result.value[0];
 }
 
+void DescriptorPool::free(vk::DescriptorSet set, uint64_t last_use)
+{
+    m_retired.push_back({last_use, set});
+}
+
 Expected<void> DescriptorPool::add_pool()
 {
-    auto pool_result = RenderingDriverVulkan::get()->get_device().createDescriptorPool(vk::DescriptorPoolCreateInfo({}, max_sets, m_sizes.size(), m_sizes.data()));
+    const uint32_t set_count = m_pool_sets == 0 ? initial_sets : std::min(m_pool_sets * 2, max_sets_per_pool);
+
+    std::vector<vk::DescriptorPoolSize> pool_sizes = m_sizes;
+    for (auto& size : pool_sizes)
+        size.descriptorCount *= set_count;
+
+    auto pool_result = RenderingDriverVulkan::get()->get_device().createDescriptorPool(vk::DescriptorPoolCreateInfo({}, set_count, pool_sizes.size(), pool_sizes.data()));
     YEET_RESULT(pool_result);
 
     m_pools.push_back(pool_result.value);
+    m_pool_sets = set_count;
+    m_pool_remaining = set_count;
 
     return {};
 }
 
-std::optional<uint32_t> MaterialLayoutVulkan::get_param_binding(const std::string& name)
+MeshVulkan::~MeshVulkan()
 {
-    uint32_t binding = 0;
+    RenderingDriverVulkan::get()->get_mesh_pool().remove(this, RenderingDriverVulkan::get()->get_recording_frame_value());
+}
+
+Expected<void> MeshPool::add(MeshVulkan *mesh, Span<uint8_t> indices, const std::vector<uint32_t>& strides, Span<Span<uint8_t>> streams, uint32_t vertex_count)
+{
+    const uint64_t index_size = indices.size();
+
+    std::optional<uint64_t> first_vertex;
+    std::optional<uint64_t> index_offset;
+    uint32_t page_index = 0;
 
-    for (const auto& param : m_params)
+    for (; page_index < m_pages.size(); page_index++)
     {
-        if (!std::strcmp(name.c_str(), param.name))
-            return binding;
+        Page& page = *m_pages[page_index];
 
-        binding += 1;
+        if (page.strides != strides)
+            continue;
+
+        first_vertex = page.vertex_ranges.allocate(vertex_count);
+        if (!first_vertex.has_value())
+            continue;
+
+        index_offset = page.index_ranges.allocate(index_size, index_alignment);
+        if (index_offset.has_value())
+            break;
+
+        page.vertex_ranges.free(first_vertex.value(), vertex_count);
+        first_vertex.reset();
     }
 
-    return std::nullopt;
+    if (!index_offset.has_value())
+    {
+        auto page_result = add_page(strides, std::max(vertex_count, page_vertex_count), std::max(index_size, page_index_size));
+        YEET(page_result);
+
+        page_index = page_result.value();
+        first_vertex = m_pages[page_index]->vertex_ranges.allocate(vertex_count);
+        index_offset = m_pages[page_index]->index_ranges.allocate(index_size, index_alignment);
+    }
+
+    Page& page = *m_pages[page_index];
+    page.meshes.insert(mesh);
+
+    mesh->page = page_index;
+    mesh->first_vertex = (uint32_t)first_vertex.value();
+    mesh->page_vertex_count = vertex_count;
+    mesh->index_offset = index_offset.value();
+    mesh->index_size = index_size;
+
+    // The ranges are not read by any frame, the copies do not wait for the frames drawing other meshes of the page.
+    for (size_t stream = 0; stream < page.streams.size(); stream++)
+        ((BufferVulkan *)page.streams[stream].ptr())->update_range(streams[stream], (size_t)mesh->first_vertex * page.strides[stream]);
+
+    ((BufferVulkan *)page.indices.ptr())->update_range(indices, mesh->index_offset);
+
+    return {};
 }
 
-std::optional<MaterialParam> MaterialLayoutVulkan::get_param(const std::string& name)
+void MeshPool::remove(MeshVulkan *mesh, uint64_t last_use)
 {
+    if (mesh->page >= m_pages.size() || !m_pages[mesh->page]->meshes.erase(mesh))
+        return;
+
+    m_retired.push_back(RetiredRange{
+        .last_use = last_use,
+        .page = mesh->page,
+        .first_vertex = mesh->first_vertex,
+        .vertex_count = mesh->page_vertex_count,
+        .index_offset = mesh->index_offset,
+        .index_size = mesh->index_size,
+    });
+}
 
-    for (const auto& param : m_params)
+void MeshPool::reclaim(uint64_t completed)
+{
+    while (!m_retired.empty() && m_retired.front().last_use <= completed)
     {
-        if (!std::strcmp(name.c_str(), param.name))
-            return param;
+        const RetiredRange& range = m_retired.front();
+        Page& page = *m_pages[range.page];
+
+        page.vertex_ranges.free(range.first_vertex, range.vertex_count);
+        page.index_ranges.free(range.index_offset, range.index_size);
+
+        m_retired.pop_front();
     }
+}
 
-    return std::nullopt;
+void MeshPool::destroy()
+{
+    m_pages.clear();
+    m_retired.clear();
+}
+
+Expected<size_t> MeshPool::compact()
+{
+    const uint64_t last_use = RenderingDriverVulkan::get()->get_recording_frame_value();
+    size_t moved = 0;
+
+    for (uint32_t page_index = 0; page_index < m_pages.size(); page_index++)
+    {
+        Page& page = *m_pages[page_index];
+
+        if (page.vertex_ranges.free_range_count() == 0 && page.index_ranges.free_range_count() == 0)
+            continue;
+
+        auto cb_result = RenderingDriverVulkan::get()->begin_upload();
+        YEET(cb_result);
+
+        // Meshes at the end of the page are moved first, first fit then places them in the lowest holes.
+        std::vector<MeshVulkan *> meshes(page.meshes.begin(), page.meshes.end());
+        std::sort(meshes.begin(), meshes.end(), [](MeshVulkan *a, MeshVulkan *b)
+                  { return a->first_vertex > b->first_vertex; });
+
+        // Copies in vertices, scaled to the stride of each stream below.
+        std::vector<vk::BufferCopy> vertex_copies;
+        std::vector<vk::BufferCopy> index_copies;
+
+        for (MeshVulkan *mesh : meshes)
+        {
+            RetiredRange old_range{.last_use = last_use, .page = page_index};
+
+            std::optional<uint64_t> first_vertex = page.vertex_ranges.allocate(mesh->page_vertex_count);
+
+            if (first_vertex.has_value() && first_vertex.value() < mesh->first_vertex)
+            {
+                vertex_copies.push_back(vk::BufferCopy(mesh->first_vertex, first_vertex.value(), mesh->page_vertex_count));
+
+                old_range.first_vertex = mesh->first_vertex;
+                old_range.vertex_count = mesh->page_vertex_count;
+                mesh->first_vertex = (uint32_t)first_vertex.value();
+            }
+            else if (first_vertex.has_value())
+            {
+                page.vertex_ranges.free(first_vertex.value(), mesh->page_vertex_count);
+            }
+
+            std::optional<uint64_t> index_offset = page.index_ranges.allocate(mesh->index_size, index_alignment);
+
+            if (index_offset.has_value() && index_offset.value() < mesh->index_offset)
+            {
+                index_copies.push_back(vk::BufferCopy(mesh->index_offset, index_offset.value(), mesh->index_size));
+
+                old_range.index_offset = mesh->index_offset;
+                old_range.index_size = mesh->index_size;
+                mesh->index_offset = index_offset.value();
+            }
+            else if (index_offset.has_value())
+            {
+                page.index_ranges.free(index_offset.value(), mesh->index_size);
+            }
+
+            // Frames already submitted still read the old ranges.
+            if (old_range.vertex_count > 0 || old_range.index_size > 0)
+            {
+                m_retired.push_back(old_range);
+                moved += 1;
+            }
+        }
+
+        if (vertex_copies.empty() && index_copies.empty())
+            continue;
+
+        vk::CommandBuffer cb = cb_result.value();
+
+        // The moved ranges may have been written by earlier copies.
+        vk::MemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite);
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {}, {barrier}, {}, {});
+
+        const uint64_t upload_value = RenderingDriverVulkan::get()->get_graphics_timeline_value() + 1;
+
+        auto copy_within = [&](Ref<Buffer>& buffer, const std::vector<vk::BufferCopy>& copies, vk::DeviceSize stride)
+        {
+            if (copies.empty())
+                return;
+
+            std::vector<vk::BufferCopy> regions = copies;
+            for (auto& region : regions)
+                region = vk::BufferCopy(region.srcOffset * stride, region.dstOffset * stride, region.size * stride);
+
+            BufferVulkan *buffer_vk = (BufferVulkan *)buffer.ptr();
+            cb.copyBuffer(buffer_vk->buffer, buffer_vk->buffer, regions);
+            buffer_vk->last_upload = upload_value;
+        };
+
+        for (size_t stream = 0; stream < page.streams.size(); stream++)
+            copy_within(page.streams[stream], vertex_copies, page.strides[stream]);
+
+        copy_within(page.indices, index_copies, 1);
+    }
+
+    if (moved > 0)
+        std::println("info: moved {} meshes to compact the mesh pool", moved);
+
+    return moved;
+}
+
+void MeshPool::mark_used(uint32_t page, uint64_t frame_value)
+{
+    Page& p = *m_pages[page];
+
+    for (auto& stream : p.streams)
+        ((BufferVulkan *)stream.ptr())->last_use = frame_value;
+
+    ((BufferVulkan *)p.indices.ptr())->last_use = frame_value;
+}
+
+MeshPoolStats MeshPool::stats() const
+{
+    MeshPoolStats stats{.page_count = m_pages.size()};
+
+    for (const auto& page : m_pages)
+    {
+        stats.mesh_count += page->meshes.size();
+        stats.vertex_capacity += page->vertex_ranges.capacity();
+        stats.vertices_used += page->vertex_ranges.used();
+        stats.index_capacity += page->index_ranges.capacity();
+        stats.index_bytes_used += page->index_ranges.used();
+        stats.free_range_count += page->vertex_ranges.free_range_count() + page->index_ranges.free_range_count();
+    }
+
+    return stats;
+}
+
+Expected<uint32_t> MeshPool::add_page(const std::vector<uint32_t>& strides, uint32_t vertex_count, uint64_t index_size)
+{
+    RenderingDriverVulkan *driver = RenderingDriverVulkan::get();
+    auto page = std::make_unique<Page>();
+
+    for (uint32_t stride : strides)
+    {
+        auto stream_result = driver->create_buffer((size_t)vertex_count * stride, {.copy_src = 1, .copy_dst = 1, .vertex = 1});
+        YEET(stream_result);
+
+        page->streams.push_back(stream_result.value());
+    }
+
+    auto indices_result = driver->create_buffer(index_size, {.copy_src = 1, .copy_dst = 1, .index = 1});
+    YEET(indices_result);
+
+    page->strides = strides;
+    page->indices = indices_result.value();
+    page->vertex_ranges = RangeAllocator(vertex_count);
+    page->index_ranges = RangeAllocator(index_size);
+
+    m_pages.push_back(std::move(page));
+
+    std::println("info: mesh pool page {} allocated with {} vertices in {} streams and {} bytes of indices", m_pages.size() - 1, vertex_count, strides.size(), index_size);
+
+    return (uint32_t)(m_pages.size() - 1);
+}
+
+void RenderingDriverVulkan::write_descriptor(vk::DescriptorSet set, uint32_t binding, const vk::DescriptorImageInfo& image_info)
+{
+    m_descriptor_writes.push_back(vk::WriteDescriptorSet(set, binding, 0, 1, vk::DescriptorType::eCombinedImageSampler));
+    m_descriptor_write_infos.push_back((uint32_t)m_descriptor_image_infos.size());
+    m_descriptor_image_infos.push_back(image_info);
+}
+
+void RenderingDriverVulkan::write_descriptor(vk::DescriptorSet set, uint32_t binding, const vk::DescriptorBufferInfo& buffer_info, vk::DescriptorType type)
+{
+    m_descriptor_writes.push_back(vk::WriteDescriptorSet(set, binding, 0, 1, type));
+    m_descriptor_write_infos.push_back((uint32_t)m_descriptor_buffer_infos.size());
+    m_descriptor_buffer_infos.push_back(buffer_info);
+}
+
+void RenderingDriverVulkan::flush_descriptor_writes()
+{
+    if (m_descriptor_writes.empty())
+        return;
+
+    // The infos are only pointed to now, their vectors may have been reallocated while writes were queued.
+    for (size_t i = 0; i < m_descriptor_writes.size(); i++)
+    {
+        vk::WriteDescriptorSet& write = m_descriptor_writes[i];
+
+        if (write.descriptorType == vk::DescriptorType::eCombinedImageSampler)
+            write.pImageInfo = &m_descriptor_image_infos[m_descriptor_write_infos[i]];
+        else
+            write.pBufferInfo = &m_descriptor_buffer_infos[m_descriptor_write_infos[i]];
+    }
+
+    m_device.updateDescriptorSets(m_descriptor_writes, {});
+
+    m_descriptor_writes.clear();
+    m_descriptor_write_infos.clear();
+    m_descriptor_image_infos.clear();
+    m_descriptor_buffer_infos.clear();
 }
 
-void MaterialVulkan::set_param(const std::string& name, Ref<Texture>& texture)
+MaterialLayoutVulkan::~MaterialLayoutVulkan()
 {
-    Ref<MaterialLayoutVulkan> layout_vk = m_layout.cast_to<MaterialLayoutVulkan>();
+    RenderingDriverVulkan::get()->get_pipeline_cache().evict(this, RenderingDriverVulkan::get()->get_recording_frame_value());
 
-    std::optional<uint32_t> binding_result = layout_vk->get_param_binding(name);
-    std::optional<MaterialParam> param = layout_vk->get_param(name);
-    ERR_COND_V(!binding_result.has_value() || !param.has_value(), "Invalid parameter name `%s`", name.c_str());
+    // The set layout and the pipeline layout of bindless materials belong to the driver.
+    if (m_flags.bindless)
+        return;
+
+    // Frames in flight may still bind sets allocated from the pools.
+    RenderingDriverVulkan::get()->retire_material_layout(m_descriptor_pool.pools(), m_descriptor_set_layout, m_pipeline_layout);
+}
+
+MaterialVulkan::~MaterialVulkan()
+{
+    MaterialLayoutVulkan *layout_vk = (MaterialLayoutVulkan *)m_layout.ptr();
+
+    // The set of bindless materials belongs to the driver.
+    if (!layout_vk->m_flags.bindless)
+        layout_vk->m_descriptor_pool.free(descriptor_set, RenderingDriverVulkan::get()->get_recording_frame_value());
+}
 
-    Ref<TextureVulkan> texture_vk = texture.cast_to<TextureVulkan>();
+void MaterialVulkan::set_param(MaterialParamHandle param, Ref<Texture>& texture)
+{
+    ERR_COND_R(!param.is_valid() || param.kind != MaterialParamKind::Texture, "Invalid texture parameter");
 
-    auto sampler_result = RenderingDriverVulkan::get()->get_sampler_cache().get_or_create(param->image_opts.sampler);
-    ERR_COND_V(!sampler_result.has_value(), "Failed to create sampler for parameter `%s`", name.c_str());
+    MaterialLayoutVulkan *layout_vk = (MaterialLayoutVulkan *)m_layout.ptr();
+    TextureVulkan *texture_vk = (TextureVulkan *)texture.ptr();
 
-    vk::DescriptorImageInfo image_info(sampler_result.value(), texture_vk->image_view, vk::ImageLayout::eShaderReadOnlyOptimal);
-    vk::WriteDescriptorSet write_image(descriptor_set, binding_result.value(), 0, 1, vk::DescriptorType::eCombinedImageSampler, &image_info, nullptr, nullptr);
+    auto sampler_result = RenderingDriverVulkan::get()->get_sampler_cache().get_or_create(layout_vk->get_params()[param.index].image_opts.sampler);
+    ERR_COND_R(!sampler_result.has_value(), "Failed to create the sampler of a parameter");
 
-    RenderingDriverVulkan::get()->get_device().updateDescriptorSets({write_image}, {});
+    RenderingDriverVulkan::get()->write_descriptor(descriptor_set, param.index, vk::DescriptorImageInfo(sampler_result.value(), texture_vk->image_view, vk::ImageLayout::eShaderReadOnlyOptimal));
 }
 
-void MaterialVulkan::set_param(const std::string& name, Ref<Buffer>& buffer)
+void MaterialVulkan::set_param(MaterialParamHandle param, Ref<Buffer>& buffer)
 {
-    Ref<MaterialLayoutVulkan> layout_vk = m_layout.cast_to<MaterialLayoutVulkan>();
+    ERR_COND_R(!param.is_valid() || param.kind == MaterialParamKind::Texture, "Invalid buffer parameter");
 
-    std::optional<uint32_t> binding_result = layout_vk->get_param_binding(name);
-    ERR_COND_V(!binding_result.has_value(), "Invalid parameter name `%s`", name.c_str());
+    BufferVulkan *buffer_vk = (BufferVulkan *)buffer.ptr();
 
-    Ref<BufferVulkan> buffer_vk = buffer.cast_to<BufferVulkan>();
+    // Each frame in flight reads its own copy of a dynamic buffer, a single descriptor cannot follow it.
+    ERR_COND_R(buffer_vk->dynamic, "Dynamic buffers cannot be bound to material parameters");
 
-    vk::DescriptorBufferInfo buffer_info(buffer_vk->buffer, 0, buffer_vk->size());
-    vk::WriteDescriptorSet write_image(descriptor_set, binding_result.value(), 0, 1, vk::DescriptorType::eCombinedImageSampler, nullptr, &buffer_info, nullptr);
+    const vk::DescriptorType type = param.kind == MaterialParamKind::StorageBuffer ? vk::DescriptorType::eStorageBuffer : vk::DescriptorType::eUniformBuffer;
 
-    RenderingDriverVulkan::get()->get_device().updateDescriptorSets({write_image}, {});
+    RenderingDriverVulkan::get()->write_descriptor(descriptor_set, param.index, vk::DescriptorBufferInfo(buffer_vk->buffer, 0, buffer_vk->size()), type);
 }
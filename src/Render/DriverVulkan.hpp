@@ -1,14 +1,35 @@
 #pragma once
 
+#include "Render/AllocatorVulkan.hpp"
 #include "Render/Driver.hpp"
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include <tracy/TracyVulkan.hpp>
+
+constexpr size_t max_frames_in_flight = 2;
+
+class BufferVulkan;
+class MeshVulkan;
+class TextureVulkan;
 
 struct QueueInfo
 {
     std::optional<uint32_t> graphics_index;
     std::optional<uint32_t> compute_index;
+
+    /**
+     * @brief A queue family dedicated to transfers, usually backed by the copy engines of the GPU.
+     */
+    std::optional<uint32_t> transfer_index;
 };
 
 struct PhysicalDeviceWithInfo
@@ -23,26 +44,266 @@ struct PhysicalDeviceWithInfo
     vk::SurfaceFormatKHR surface_format;
 };
 
+/**
+ * @brief Shader modules shared between pipelines.
+ *
+ * A file is only read once, and files with the same content share a module. A module is destroyed when the last
+ * pipeline using it releases it.
+ */
+class ShaderModuleCache
+{
+public:
+    ShaderModuleCache();
+
+    Expected<vk::ShaderModule> acquire(const char *filename);
+    void release(const char *filename);
+
+    void destroy();
+
+private:
+    struct Module
+    {
+        vk::ShaderModule module;
+        size_t ref_count;
+    };
+
+    // Content hash of the files already read.
+    std::map<std::string, uint64_t> m_hashes;
+    std::map<uint64_t, Module> m_modules;
+
+    // Pipelines are compiled from the workers of `PipelineCache`.
+    std::mutex m_mutex;
+};
+
+/**
+ * @brief Compile pipelines on worker threads.
+ *
+ * Pipelines only depend on the material layout, so they are requested as soon as the layout is created and the frame
+ * never has to wait for the compilation.
+ */
 class PipelineCache
 {
 public:
     struct Key
     {
-        Material *material;
+        MaterialLayout *layout;
         vk::RenderPass render_pass;
 
         bool operator<(const Key& key) const
         {
-            return key.material < material || key.render_pass < render_pass;
+            return std::tie(layout, render_pass) < std::tie(key.layout, key.render_pass);
         }
     };
 
     PipelineCache();
 
-    Expected<vk::Pipeline> get_or_create(Material *material, vk::RenderPass render_pass);
+    void start_workers(size_t worker_count);
+
+    /**
+     * @brief Queue the compilation of the pipeline, does nothing if it was already requested.
+     */
+    void request(MaterialLayout *layout, vk::RenderPass render_pass);
+
+    /**
+     * @brief Returns the pipeline of the layout, or a null handle while it is still compiling. The compilation is
+     * requested if needed.
+     */
+    Expected<vk::Pipeline> get(MaterialLayout *layout, vk::RenderPass render_pass);
+
+    /**
+     * @brief Remove the pipelines of a layout being destroyed. Pending compilations are cancelled and running ones are
+     * waited for, the pipelines are destroyed once the graphics timeline reaches `last_use`.
+     */
+    void evict(const MaterialLayout *layout, uint64_t last_use);
+
+    /**
+     * @brief Destroy the pipelines evicted before the graphics timeline reached `completed`.
+     */
+    void reclaim(uint64_t completed);
+
+    /**
+     * @brief Stop the workers, destroy all pipelines and release their shader modules.
+     */
+    void destroy();
 
 private:
-    std::map<Key, vk::Pipeline> m_pipelines;
+    enum class State
+    {
+        Pending,
+        Compiling,
+        Ready,
+        Failed,
+    };
+
+    struct Entry
+    {
+        State state = State::Pending;
+        vk::Pipeline pipeline;
+        std::vector<std::string> shader_files;
+        std::optional<Error> error;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::condition_variable m_compiled_condition;
+    std::deque<Key> m_queue;
+    std::vector<std::thread> m_workers;
+    bool m_stopping = false;
+
+    std::map<Key, Entry> m_pipelines;
+
+    // Pipelines of evicted layouts with the timeline value after which they can be destroyed, in increasing order.
+    std::deque<std::pair<uint64_t, Entry>> m_retired;
+
+    void worker_loop();
+    Expected<void> compile(Key key);
+    void destroy_entry(const Entry& entry);
+};
+
+/**
+ * @brief Threads used to record parts of a frame in parallel.
+ *
+ * `run` calls a job for every index in `[0, count)` and returns once they are all done. The calling thread also takes
+ * part in the work.
+ */
+class RecordingWorkers
+{
+public:
+    RecordingWorkers();
+
+    void start(size_t worker_count);
+    void stop();
+
+    void run(size_t count, const std::function<void(size_t)>& job);
+
+    inline size_t thread_count() const
+    {
+        return m_threads.size() + 1;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::condition_variable m_done_condition;
+    std::vector<std::thread> m_threads;
+
+    const std::function<void(size_t)> *m_job = nullptr;
+    size_t m_count = 0;
+    std::atomic<size_t> m_next = 0;
+
+    // Number of workers inside `work`, fields of the job are not touched while it is non zero.
+    size_t m_active = 0;
+    uint64_t m_generation = 0;
+    bool m_stopping = false;
+
+    void worker_loop();
+    void work();
+};
+
+/**
+ * @brief Command pools of a recording job. Each job of `RecordingWorkers::run` uses its own context so pools are never
+ * accessed from two threads at the same time.
+ */
+struct RecordingContext
+{
+    std::array<vk::CommandPool, max_frames_in_flight> command_pools;
+    std::array<std::vector<vk::CommandBuffer>, max_frames_in_flight> command_buffers;
+
+    // Secondary command buffers already used in the current frame.
+    size_t used = 0;
+};
+
+/**
+ * @brief Instance data of materials using `MaterialFlags::instanced_view_matrix`, gathered from the draws of the render
+ * graph.
+ */
+struct DrawInstance
+{
+    glm::mat4 view_matrix;
+
+    /**
+     * @brief Replaces `gl_InstanceIndex`, which restarts at zero for merged draws.
+     */
+    uint32_t instance;
+};
+
+/**
+ * @brief GPU time spent in a pass or a range of a render graph.
+ */
+struct GpuZoneTiming
+{
+    const char *name;
+
+    /**
+     * @brief Nesting level of the zone, the whole frame is at depth 0.
+     */
+    uint32_t depth;
+    double ms;
+};
+
+/**
+ * @brief GPU timings of the last frame whose timestamps were read back, `max_frames_in_flight` frames behind the CPU.
+ */
+struct GpuTimings
+{
+    std::vector<GpuZoneTiming> zones;
+    double frame_ms = 0.0;
+};
+
+/**
+ * @brief A zone timed during a frame, `begin_query` and `end_query` are relative to the queries of the frame.
+ */
+struct TimestampZone
+{
+    const char *name;
+    uint32_t depth;
+    uint32_t begin_query;
+    uint32_t end_query;
+};
+
+/**
+ * @brief A frame rendered offscreen and copied to host memory. Pixels are `BGRA8` sRGB with tightly packed rows.
+ */
+struct FrameReadback
+{
+    Span<uint8_t> pixels;
+    uint32_t width;
+    uint32_t height;
+
+    /**
+     * @brief Value of the graphics timeline signaled by the frame, increasing by one every frame.
+     */
+    uint64_t frame;
+};
+
+struct FrameTimestamps
+{
+    std::vector<TimestampZone> zones;
+    uint32_t query_count = 0;
+};
+
+/**
+ * @brief Objects of a destroyed material layout, destroyed once the frames which may still use them are finished.
+ */
+struct RetiredMaterialLayout
+{
+    uint64_t last_use;
+    std::vector<vk::DescriptorPool> descriptor_pools;
+    vk::DescriptorSetLayout descriptor_set_layout;
+    vk::PipelineLayout pipeline_layout;
+};
+
+/**
+ * @brief Last accesses of a buffer by the GPU, used to infer barriers between the passes of a `RenderGraph`.
+ */
+struct BufferState
+{
+    // Write not yet made visible to later accesses.
+    vk::PipelineStageFlags write_stages;
+    vk::AccessFlags write_access;
+
+    // Reads since the last write, a write has to wait for them.
+    vk::PipelineStageFlags read_stages;
 };
 
 class SamplerCache
@@ -56,6 +317,231 @@ private:
     std::map<Sampler, vk::Sampler> m_samplers;
 };
 
+/**
+ * @brief A persistently mapped ring buffer used to stage uploads to the GPU.
+ *
+ * Space is handed out linearly and given back once the frame that consumed it has finished executing.
+ */
+class StagingBuffer
+{
+public:
+    struct Allocation
+    {
+        vk::Buffer buffer;
+        size_t offset;
+        uint8_t *ptr;
+    };
+
+    StagingBuffer() {}
+
+    StagingBuffer(vk::Buffer buffer, MemoryAllocation memory, size_t capacity)
+        : m_buffer(buffer), m_memory(memory), m_mapped(memory.ptr), m_capacity(capacity), m_frame_used({})
+    {
+    }
+
+    void destroy(vk::Device device, MemoryAllocator& allocator);
+
+    /**
+     * @brief Reserve `size` bytes for the frame `frame`. Returns `std::nullopt` when the ring is full.
+     */
+    std::optional<Allocation> allocate(size_t size, size_t alignment, size_t frame);
+
+    /**
+     * @brief Give back the space used by `frame`. Must only be called once the frame's fence is signaled.
+     */
+    void reclaim(size_t frame);
+
+private:
+    vk::Buffer m_buffer;
+    MemoryAllocation m_memory;
+    uint8_t *m_mapped = nullptr;
+    size_t m_capacity = 0;
+
+    size_t m_head = 0;
+    size_t m_used = 0;
+    std::array<size_t, max_frames_in_flight> m_frame_used;
+};
+
+/**
+ * @brief The descriptor set of bindless materials, holding arrays of every texture and storage buffer added to it.
+ *
+ * Shaders declare the arrays as `layout(set = 0, binding = 0) uniform sampler2D textures[]` and
+ * `layout(set = 0, binding = 1) buffer Buffers { ... } buffers[]`. Descriptors are written when a resource is added
+ * and the set stays bound across materials. Removed indices are only reused once the frames which may read them are
+ * finished.
+ */
+class BindlessHeap
+{
+public:
+    static constexpr uint32_t texture_binding = 0;
+    static constexpr uint32_t buffer_binding = 1;
+
+    BindlessHeap() {}
+
+    [[nodiscard]]
+    Expected<void> create(vk::Device device, uint32_t max_textures, uint32_t max_buffers);
+    void destroy(vk::Device device);
+
+    [[nodiscard]]
+    Expected<uint32_t> add_texture(vk::Device device, vk::ImageView image_view, vk::Sampler sampler);
+
+    [[nodiscard]]
+    Expected<uint32_t> add_buffer(vk::Device device, vk::Buffer buffer, vk::DeviceSize size);
+
+    /**
+     * @brief Remove an index read by frames up to the value `last_use` of the graphics timeline.
+     */
+    void remove_texture(uint32_t index, uint64_t last_use);
+    void remove_buffer(uint32_t index, uint64_t last_use);
+
+    /**
+     * @brief Make the indices removed before the value `completed` of the graphics timeline available again.
+     */
+    void reclaim(uint64_t completed);
+
+    inline vk::DescriptorSetLayout layout() const
+    {
+        return m_layout;
+    }
+
+    inline vk::DescriptorSet set() const
+    {
+        return m_set;
+    }
+
+private:
+    struct Slots
+    {
+        uint32_t capacity = 0;
+        uint32_t next = 0;
+        std::vector<uint32_t> free;
+        // Removed indices with the timeline value after which they can be reused, in increasing order.
+        std::deque<std::pair<uint64_t, uint32_t>> retired;
+
+        std::optional<uint32_t> take();
+        void reclaim(uint64_t completed);
+    };
+
+    vk::DescriptorSetLayout m_layout;
+    vk::DescriptorPool m_pool;
+    vk::DescriptorSet m_set;
+
+    Slots m_textures;
+    Slots m_buffers;
+};
+
+struct MeshPoolStats
+{
+    size_t page_count = 0;
+    size_t mesh_count = 0;
+
+    uint64_t vertex_capacity = 0;
+    uint64_t vertices_used = 0;
+    uint64_t index_capacity = 0;
+    uint64_t index_bytes_used = 0;
+
+    /**
+     * @brief Number of free ranges in all pages, it grows as the pages get fragmented.
+     */
+    size_t free_range_count = 0;
+};
+
+/**
+ * @brief Store the vertices and indices of every mesh in a few large buffers instead of four buffers per mesh.
+ *
+ * Meshes are sub-allocated from pages holding one buffer per vertex stream and one index buffer, so draws of meshes
+ * in the same page share their vertex and index bindings and only differ by their first vertex and first index.
+ * Ranges of destroyed meshes are reused once the frames which may read them are finished, and `compact` moves meshes
+ * into the holes left at the start of the pages.
+ */
+class MeshPool
+{
+public:
+    // A page holds a million vertices and 16 MiB of indices, larger meshes get a page of their own.
+    static constexpr uint32_t page_vertex_count = 1024 * 1024;
+    static constexpr uint64_t page_index_size = 16 * 1024 * 1024;
+
+    // The driver compacts the pool when it has more free ranges than this, at most once every `compact_interval`
+    // frames.
+    static constexpr size_t compact_free_ranges = 64;
+    static constexpr uint64_t compact_interval = 120;
+
+    struct Page
+    {
+        // Only meshes whose vertex layout has the same strides share a page.
+        std::vector<uint32_t> strides;
+        std::vector<Ref<Buffer>> streams;
+        Ref<Buffer> indices;
+
+        RangeAllocator vertex_ranges;
+        RangeAllocator index_ranges;
+
+        std::set<MeshVulkan *> meshes;
+    };
+
+    MeshPool() {}
+
+    [[nodiscard]]
+    Expected<void> add(MeshVulkan *mesh, Span<uint8_t> indices, const std::vector<uint32_t>& strides, Span<Span<uint8_t>> streams, uint32_t vertex_count);
+
+    /**
+     * @brief Remove a mesh read by frames up to the value `last_use` of the graphics timeline.
+     */
+    void remove(MeshVulkan *mesh, uint64_t last_use);
+
+    /**
+     * @brief Make the ranges removed before the value `completed` of the graphics timeline available again.
+     */
+    void reclaim(uint64_t completed);
+
+    /**
+     * @brief Release the pages, meshes still alive are left without a page and removing them does nothing.
+     */
+    void destroy();
+
+    /**
+     * @brief Move meshes into free ranges placed before them, returns the number of meshes moved.
+     *
+     * The copies are recorded in the current upload batch, frames recorded afterward read the new ranges.
+     */
+    [[nodiscard]]
+    Expected<size_t> compact();
+
+    /**
+     * @brief Mark the buffers of a page as read by the frame signaling the value `frame_value`.
+     */
+    void mark_used(uint32_t page, uint64_t frame_value);
+
+    inline const Page& get_page(uint32_t page) const
+    {
+        return *m_pages[page];
+    }
+
+    MeshPoolStats stats() const;
+
+private:
+    struct RetiredRange
+    {
+        uint64_t last_use;
+        uint32_t page;
+        uint32_t first_vertex;
+        uint32_t vertex_count;
+        uint64_t index_offset;
+        uint64_t index_size;
+    };
+
+    // Index ranges are aligned for both index types.
+    static constexpr uint64_t index_alignment = 4;
+
+    // Pages are never moved so `MeshVulkan::page` stays valid.
+    std::vector<std::unique_ptr<Page>> m_pages;
+
+    // Ranges given back with the timeline value after which they can be reused, in increasing order.
+    std::deque<RetiredRange> m_retired;
+
+    Expected<uint32_t> add_page(const std::vector<uint32_t>& strides, uint32_t vertex_count, uint64_t index_size);
+};
+
 class RenderingDriverVulkan final : public RenderingDriver
 {
 public:
@@ -74,6 +560,10 @@ public:
     virtual Expected<void> configure_surface(const Window& window, VSync vsync) override;
 
     virtual void limit_frames(uint32_t limit) override;
+    virtual void set_low_latency(bool enabled) override;
+    virtual void begin_frame() override;
+
+    virtual FrameTimeStats get_frame_time_stats() const override;
 
     [[nodiscard]]
     virtual Expected<Ref<Buffer>> create_buffer(size_t size, BufferUsage usage = {}, BufferVisibility visibility = BufferVisibility::GPUOnly) override;
@@ -87,34 +577,136 @@ public:
     [[nodiscard]]
     virtual Expected<Ref<Texture>> create_texture_cube(uint32_t width, uint32_t height, TextureFormat format, TextureUsage usage) override;
 
+    using RenderingDriver::create_mesh;
+
     [[nodiscard]]
-    virtual Expected<Ref<Mesh>> create_mesh(IndexType index_type, Span<uint8_t> indices, Span<glm::vec3> vertices, Span<glm::vec2> uvs, Span<glm::vec3> normals) override;
+    virtual Expected<Ref<Mesh>> create_mesh(IndexType index_type, Span<uint8_t> indices, const VertexLayout& layout, Span<Span<uint8_t>> streams) override;
 
     [[nodiscard]]
-    virtual Expected<Ref<MaterialLayout>> create_material_layout(Span<ShaderRef> shaders, Span<MaterialParam> params = {}, MaterialFlags flags = {}, std::optional<InstanceLayout> instance_layout = std::nullopt, CullMode cull_mode = CullMode::Back, PolygonMode polygon_mode = PolygonMode::Fill, bool transparency = false, bool always_draw_before = false) override;
+    virtual Expected<Ref<Mesh>> create_pulled_mesh(uint32_t first_quad, uint32_t quad_count, uint32_t first_instance = 0) override;
+
+    [[nodiscard]]
+    virtual Expected<Ref<MaterialLayout>> create_material_layout(Span<ShaderRef> shaders, Span<MaterialParam> params = {}, MaterialFlags flags = {}, std::optional<InstanceLayout> instance_layout = std::nullopt, CullMode cull_mode = CullMode::Back, PolygonMode polygon_mode = PolygonMode::Fill, bool transparency = false, bool always_draw_before = false, const VertexLayout& vertex_layout = VertexLayout::separate()) override;
 
     [[nodiscard]]
     virtual Expected<Ref<Material>> create_material(MaterialLayout *layout) override;
 
+    virtual bool supports_bindless() const override;
+
+    [[nodiscard]]
+    virtual Expected<uint32_t> add_bindless_texture(Texture *texture, Sampler sampler = {}) override;
+
+    [[nodiscard]]
+    virtual Expected<uint32_t> add_bindless_buffer(Buffer *buffer) override;
+
+    virtual void remove_bindless_texture(uint32_t index) override;
+    virtual void remove_bindless_buffer(uint32_t index) override;
+
     virtual void draw_graph(const RenderGraph& graph) override;
 
-    Expected<vk::Pipeline> create_graphics_pipeline(Span<ShaderRef> shaders, std::optional<InstanceLayout> instance_layout, vk::PolygonMode polygon_mode, vk::CullModeFlags cull_mode, bool transparency, bool always_draw_before, vk::PipelineLayout pipeline_layout, vk::RenderPass render_pass);
+    Expected<vk::Pipeline> create_graphics_pipeline(Span<ShaderRef> shaders, const VertexLayout& vertex_layout, std::optional<InstanceLayout> instance_layout, bool instanced_view_matrix, vk::PolygonMode polygon_mode, vk::CullModeFlags cull_mode, bool transparency, bool always_draw_before, vk::PipelineLayout pipeline_layout, vk::RenderPass render_pass);
 
     inline vk::Device get_device() const
     {
         return m_device;
     }
 
-    inline vk::CommandBuffer get_transfer_buffer() const
+    inline ShaderModuleCache& get_shader_module_cache()
     {
-        return m_transfer_buffer;
+        return m_shader_module_cache;
     }
 
+    /**
+     * @brief Returns the command buffer batching uploads of the current frame, beginning it if needed.
+     * The batch is submitted once per frame by `draw_graph`.
+     */
+    [[nodiscard]]
+    Expected<vk::CommandBuffer> begin_upload();
+
+    /**
+     * @brief Reserve `size` bytes of host visible memory to copy from in the current upload batch.
+     */
+    [[nodiscard]]
+    Expected<StagingBuffer::Allocation> allocate_staging(size_t size, size_t alignment = 16);
+
+    /**
+     * @brief Order a transfer to `buffer` after the previous transfers of the current batch writing to it.
+     */
+    void track_upload_target(vk::CommandBuffer cb, vk::Buffer buffer);
+
+    /**
+     * @brief Make the next upload batch wait until the graphics timeline reaches `value`.
+     * Only needed when uploads run on a dedicated transfer queue.
+     */
+    void wait_graphics_before_upload(uint64_t value);
+
     inline vk::Queue get_graphics_queue() const
     {
         return m_graphics_queue;
     }
 
+    /**
+     * @brief Returns `true` when uploads are submitted to a dedicated transfer queue.
+     */
+    inline bool has_async_transfer() const
+    {
+        return m_async_transfer;
+    }
+
+    /**
+     * @brief Value of the graphics timeline signaled by the last submitted frame.
+     */
+    inline uint64_t get_graphics_timeline_value() const
+    {
+        return m_graphics_timeline_value;
+    }
+
+    /**
+     * @brief Index of the frame in flight currently being prepared.
+     */
+    inline size_t get_current_frame() const
+    {
+        return m_current_frame;
+    }
+
+    /**
+     * @brief Wait until the GPU is done with the copy of `buffer` for the current frame, and flush it before the
+     * frame is submitted if its memory is not host coherent.
+     */
+    [[nodiscard]]
+    Expected<void> prepare_dynamic_write(BufferVulkan *buffer);
+
+    /**
+     * @brief Returns `true` when no submitted or pending work reads or writes `buffer`.
+     */
+    bool is_buffer_idle(const BufferVulkan *buffer);
+
+    /**
+     * @brief Make host writes to `size` bytes at `offset` of a non coherent allocation visible to the GPU.
+     */
+    void flush_memory(const MemoryAllocation& memory, vk::DeviceSize offset, vk::DeviceSize size);
+
+    /**
+     * @brief Queue the write of a descriptor of a material. Writes are applied by a single `updateDescriptorSets`
+     * before the next frame is recorded, so parameters can be changed in bulk cheaply.
+     */
+    void write_descriptor(vk::DescriptorSet set, uint32_t binding, const vk::DescriptorImageInfo& image_info);
+    void write_descriptor(vk::DescriptorSet set, uint32_t binding, const vk::DescriptorBufferInfo& buffer_info, vk::DescriptorType type = vk::DescriptorType::eUniformBuffer);
+
+    /**
+     * @brief Make GPU writes to `size` bytes at `offset` of a non coherent allocation visible to the host.
+     */
+    void invalidate_memory(const MemoryAllocation& memory, vk::DeviceSize offset, vk::DeviceSize size);
+
+    /**
+     * @brief Returns `true` when buffers can live in device local memory written directly by the CPU (integrated
+     * GPUs, software rasterizers, resizable BAR).
+     */
+    inline bool has_direct_upload() const
+    {
+        return m_direct_upload;
+    }
+
     inline PipelineCache& get_pipeline_cache()
     {
         return m_pipeline_cache;
@@ -125,8 +717,106 @@ public:
         return m_sampler_cache;
     }
 
+    inline MemoryAllocator& get_allocator()
+    {
+        return m_allocator;
+    }
+
+    /**
+     * @brief Returns usage statistics of the GPU memory.
+     */
+    inline MemoryStats get_memory_stats() const
+    {
+        return m_allocator.stats();
+    }
+
+    inline MeshPool& get_mesh_pool()
+    {
+        return m_mesh_pool;
+    }
+
+    /**
+     * @brief Returns the occupancy of the pages holding the meshes.
+     */
+    inline MeshPoolStats get_mesh_pool_stats() const
+    {
+        return m_mesh_pool.stats();
+    }
+
+    /**
+     * @brief Destroy the descriptor pools and layouts of a material layout once the frame being recorded is finished.
+     */
+    void retire_material_layout(const std::vector<vk::DescriptorPool>& descriptor_pools, vk::DescriptorSetLayout descriptor_set_layout, vk::PipelineLayout pipeline_layout);
+
+    /**
+     * @brief Value of the graphics timeline signaled by the frame being recorded, resources it uses are busy until
+     * the timeline reaches it.
+     */
+    inline uint64_t get_recording_frame_value() const
+    {
+        return m_graphics_timeline_value + 1;
+    }
+
+    /**
+     * @brief Last value of the graphics timeline known to be reached, refreshed when waiting for frames.
+     */
+    inline uint64_t get_completed_frame_value() const
+    {
+        return m_graphics_timeline_completed;
+    }
+
+    /**
+     * @brief Returns the GPU time of each pass and range of a recent frame. Empty when the graphics queue does not
+     * support timestamps.
+     */
+    inline const GpuTimings& get_gpu_timings() const
+    {
+        return m_gpu_timings;
+    }
+
+    /**
+     * @brief Returns `true` when rendering into offscreen targets instead of a swapchain, which is the case for
+     * headless windows.
+     */
+    inline bool is_offscreen() const
+    {
+        return m_offscreen;
+    }
+
+    /**
+     * @brief Copy the next offscreen frame to host memory. Frames are not read back otherwise, copying every frame
+     * would distort the timings of offscreen benchmarks.
+     */
+    inline void request_readback()
+    {
+        m_readback_requested = true;
+    }
+
+    /**
+     * @brief Returns the last offscreen frame requested with `request_readback`, waiting for it if it is still in
+     * flight. The pixels stay valid until the next frame is drawn.
+     */
+    std::optional<FrameReadback> get_readback();
+
 private:
-    static constexpr size_t max_frames_in_flight = 2;
+    static constexpr size_t staging_buffer_size = 32 * 1024 * 1024;
+
+    // Render passes with fewer draws are recorded directly in the primary command buffer.
+    static constexpr size_t parallel_draw_threshold = 512;
+    static constexpr size_t min_draws_per_range = 128;
+
+    static constexpr size_t instance_buffer_size = 8 * 1024 * 1024;
+    static constexpr vk::DeviceSize invalid_instance_offset = UINT64_MAX;
+
+    static constexpr uint32_t max_timestamps_per_frame = 256;
+    static constexpr size_t max_gpu_zone_depth = 16;
+
+    // Upper bounds of the arrays of the bindless set, lowered to the limits of the device.
+    static constexpr uint32_t bindless_max_textures = 16384;
+    static constexpr uint32_t bindless_max_buffers = 16384;
+
+    // Minimum time between two saves of the pipeline cache while running.
+    static constexpr std::chrono::seconds pipeline_cache_save_interval = std::chrono::seconds(60);
 
     vk::Instance m_instance;
     vk::SurfaceKHR m_surface;
@@ -135,38 +825,115 @@ private:
     vk::PhysicalDeviceProperties m_physical_device_properties;
     vk::Device m_device;
     vk::PhysicalDeviceMemoryProperties m_memory_properties;
+    MemoryAllocator m_allocator;
+    bool m_direct_upload = false;
 
     vk::Queue m_graphics_queue;
     uint32_t m_graphics_queue_index;
     vk::Queue m_compute_queue;
     uint32_t m_compute_queue_index;
+    vk::Queue m_transfer_queue;
+    uint32_t m_transfer_queue_index;
+    bool m_async_transfer = false;
+
+    // Queue families sharing resources when uploads are done on a dedicated transfer queue.
+    std::array<uint32_t, 2> m_shared_queue_indices;
+
+    // Timelines tracking the progress of the graphics and transfer queues.
+    vk::Semaphore m_graphics_timeline;
+    uint64_t m_graphics_timeline_value = 0;
+    uint64_t m_graphics_timeline_completed = 0;
+    vk::Semaphore m_transfer_timeline;
+    uint64_t m_transfer_timeline_value = 0;
 
     vk::SurfaceCapabilitiesKHR m_surface_capabilities;
     std::vector<vk::PresentModeKHR> m_surface_present_modes;
     vk::SurfaceFormatKHR m_surface_format;
 
     vk::CommandPool m_graphics_command_pool;
-    vk::CommandBuffer m_transfer_buffer;
+    vk::CommandPool m_transfer_command_pool;
 
+    // Each frame in flight owns `max_timestamps_per_frame` queries, read back once its fence is signaled.
     vk::QueryPool m_timestamp_query_pool;
+    bool m_timestamps_supported = false;
+    uint64_t m_timestamp_mask = UINT64_MAX;
+    std::array<FrameTimestamps, max_frames_in_flight> m_frame_timestamps;
+    std::vector<uint32_t> m_open_gpu_zones;
+    std::vector<uint64_t> m_timestamp_results;
+    GpuTimings m_gpu_timings;
+
+#ifdef TRACY_ENABLE
+    TracyVkCtx m_tracy_context = nullptr;
+    std::array<std::optional<tracy::VkCtxScope>, max_gpu_zone_depth> m_tracy_zones;
+#endif
+
     vk::RenderPass m_render_pass;
 
+    ShaderModuleCache m_shader_module_cache;
     PipelineCache m_pipeline_cache;
     SamplerCache m_sampler_cache;
 
-    std::chrono::time_point<std::chrono::high_resolution_clock> m_start_time;
+    // Driver side cache of compiled pipelines, persisted on disk between runs.
+    vk::PipelineCache m_vk_pipeline_cache;
+    std::string m_pipeline_cache_path;
+    std::atomic<bool> m_pipeline_cache_dirty = false;
+    std::chrono::time_point<std::chrono::high_resolution_clock> m_pipeline_cache_save_time;
+    std::atomic<int64_t> m_pipeline_creation_time_us = 0;
+    std::atomic<size_t> m_pipeline_creation_count = 0;
 
     // Frame in flight resources
     std::array<vk::CommandBuffer, max_frames_in_flight> m_command_buffers;
+
+    RecordingWorkers m_recording_workers;
+    std::vector<RecordingContext> m_recording_contexts;
+    std::vector<Expected<vk::CommandBuffer>> m_secondary_results;
+    std::vector<vk::CommandBuffer> m_secondary_command_buffers;
+
+    // Pipeline of each draw of the graph being recorded, null when the draw is skipped.
+    std::vector<vk::Pipeline> m_draw_pipelines;
+
+    // Instances of merged draws and per-instance view matrices are gathered in this buffer, it holds one region per
+    // frame in flight.
+    vk::Buffer m_instance_buffer;
+    MemoryAllocation m_instance_memory;
+    vk::DeviceSize m_instance_head = 0;
+
+    // Offset of the gathered instances of each merged draw, `invalid_instance_offset` when they did not fit.
+    std::vector<vk::DeviceSize> m_draw_instance_offsets;
+
+    // Offset of the `DrawInstance` of each draw whose material reads its view matrix per instance.
+    std::vector<vk::DeviceSize> m_draw_matrix_offsets;
+
+    std::vector<bool> m_culled_passes;
+    std::vector<vk::ImageMemoryBarrier> m_image_barriers;
+
     std::array<vk::Semaphore, max_frames_in_flight> m_acquire_semaphores;
     std::array<vk::Fence, max_frames_in_flight> m_frame_fences;
     std::vector<vk::Semaphore> m_submit_semaphores;
+    std::array<bool, max_frames_in_flight> m_frame_submitted = {};
     size_t m_current_frame = 0;
 
-    uint32_t m_frames_limit = 0;
-    // Time between two frames in microseconds when `m_frames_limit != 0`.
-    uint32_t m_time_between_frames;
-    std::chrono::time_point<std::chrono::high_resolution_clock> m_last_frame_limit_time;
+    // Upload resources, batched per frame and submitted before the frame's commands.
+    StagingBuffer m_staging_buffer;
+    std::array<vk::CommandBuffer, max_frames_in_flight> m_upload_buffers;
+    std::array<std::vector<std::pair<vk::Buffer, MemoryAllocation>>, max_frames_in_flight> m_staging_overflow;
+    std::set<vk::Buffer> m_upload_targets;
+    bool m_upload_recording = false;
+    uint64_t m_upload_wait_value = 0;
+
+    // Dynamic buffers written during the frame which must be flushed before submitting.
+    std::vector<vk::MappedMemoryRange> m_dynamic_flushes;
+
+    // Descriptor writes queued since the last frame, with the index of their info in the vector matching their type.
+    std::vector<vk::WriteDescriptorSet> m_descriptor_writes;
+    std::vector<uint32_t> m_descriptor_write_infos;
+    std::vector<vk::DescriptorImageInfo> m_descriptor_image_infos;
+    std::vector<vk::DescriptorBufferInfo> m_descriptor_buffer_infos;
+
+    FramePacer m_frame_pacer;
+    bool m_low_latency = false;
+    // Set by `begin_frame` so `draw_graph` does not wait a second time.
+    bool m_frame_began = false;
 
     // Swapchain resources
     uint32_t m_swapchain_image_count;
@@ -176,13 +943,68 @@ private:
     std::vector<Ref<Texture>> m_swapchain_textures;
     std::vector<vk::Framebuffer> m_swapchain_framebuffers;
 
+    // Bindless materials share one descriptor set and one pipeline layout, so switching between them never disturbs
+    // the bound set.
+    bool m_bindless_supported = false;
+    BindlessHeap m_bindless_heap;
+    vk::PipelineLayout m_bindless_pipeline_layout;
+
+    std::deque<RetiredMaterialLayout> m_retired_material_layouts;
+
+    MeshPool m_mesh_pool;
+    uint64_t m_mesh_pool_compacted = 0;
+
+    // Indices of `quad_pattern_count` quads shared by every pulled mesh, created with the first of them.
+    static constexpr uint32_t quad_pattern_count = 16384;
+    Ref<Buffer> m_quad_indices;
+
+    // Offscreen resources, used instead of the swapchain when there is no surface. Each frame in flight renders into
+    // its own target which is then copied to its readback buffer.
+    bool m_offscreen = false;
+    std::vector<std::unique_ptr<TextureVulkan>> m_offscreen_targets;
+    std::array<vk::Buffer, max_frames_in_flight> m_readback_buffers;
+    std::array<MemoryAllocation, max_frames_in_flight> m_readback_memory;
+    // Frame copied in each readback buffer and not read yet, or zero.
+    std::array<uint64_t, max_frames_in_flight> m_readback_pending = {};
+    std::vector<uint8_t> m_readback_pixels;
+    uint64_t m_readback_frame = 0;
+    bool m_readback_requested = false;
+
     Expected<Ref<Texture>> create_texture_from_vk_image(vk::Image image, uint32_t width, uint32_t height, vk::Format format);
 
     void destroy_swapchain();
 
-    std::optional<uint32_t> find_memory_type_index(uint32_t type_bits, vk::MemoryPropertyFlags properties);
-    std::expected<vk::DeviceMemory, Error> allocate_memory_for_buffer(vk::Buffer buffer, vk::MemoryPropertyFlags properties);
-    std::expected<vk::DeviceMemory, Error> allocate_memory_for_image(vk::Image image, vk::MemoryPropertyFlags properties);
+    Expected<void> configure_offscreen(const Window& window);
+    void record_readback(vk::CommandBuffer cb, uint32_t target);
+    void read_back(size_t frame);
+
+    void prepare_draws(vk::CommandBuffer cb, const RenderGraph& graph);
+    void gather_instances(vk::CommandBuffer cb, const RenderGraph& graph, size_t index, bool& copied);
+    void gather_pass_instances(vk::CommandBuffer cb, const RenderGraph& graph, size_t begin, size_t end);
+    void record_barriers(vk::CommandBuffer cb, const RenderGraph& graph, uint32_t use_begin, uint32_t use_count);
+
+    void begin_gpu_zone(vk::CommandBuffer cb, const char *name);
+    void end_gpu_zone(vk::CommandBuffer cb);
+    void read_timestamps(size_t frame);
+
+    void destroy_material_layout(const RetiredMaterialLayout& layout);
+    void record_draws(vk::CommandBuffer cb, const RenderGraph& graph, size_t begin, size_t end);
+    Expected<vk::CommandBuffer> record_draws_secondary(RecordingContext& context, vk::Framebuffer framebuffer, const RenderGraph& graph, size_t begin, size_t end);
+
+    Expected<void> load_pipeline_cache();
+    void save_pipeline_cache();
+
+    Expected<void> wait_frame(size_t frame);
+    void flush_descriptor_writes();
+    Expected<std::optional<vk::CommandBuffer>> end_upload();
+    Expected<void> submit_upload(vk::CommandBuffer cb);
+
+    void set_sharing_mode(vk::BufferCreateInfo& create_info) const;
+    void set_sharing_mode(vk::ImageCreateInfo& create_info) const;
+
+    std::optional<uint32_t> find_memory_type_index(uint32_t type_bits, vk::MemoryPropertyFlags properties, vk::MemoryPropertyFlags preferred = {});
+    std::expected<MemoryAllocation, Error> allocate_memory_for_buffer(vk::Buffer buffer, vk::MemoryPropertyFlags properties, vk::MemoryPropertyFlags preferred = {});
+    std::expected<MemoryAllocation, Error> allocate_memory_for_image(vk::Image image, vk::MemoryPropertyFlags properties, vk::MemoryPropertyFlags preferred = {});
 
     std::expected<QueueInfo, bool> find_queue(vk::PhysicalDevice physical_device);
     std::optional<PhysicalDeviceWithInfo> pick_best_device(const std::vector<vk::PhysicalDevice>& physical_devices, const std::vector<const char *>& required_extensions, const std::vector<const char *>& optional_extensions);
@@ -191,8 +1013,8 @@ private:
 class BufferVulkan : public Buffer
 {
 public:
-    BufferVulkan(vk::Buffer buffer, vk::DeviceMemory memory, size_t size)
-        : buffer(buffer), memory(memory)
+    BufferVulkan(vk::Buffer buffer, MemoryAllocation memory, size_t size, bool dynamic = false, size_t frame_stride = 0, bool coherent = true)
+        : buffer(buffer), memory(memory), dynamic(dynamic), frame_stride(frame_stride), coherent(coherent)
     {
         m_size = size;
     }
@@ -200,15 +1022,45 @@ public:
     virtual ~BufferVulkan();
 
     virtual void update(Span<uint8_t> view, size_t offset) override;
+    virtual uint8_t *map() override;
+
+    /**
+     * @brief Write a range that no submitted frame reads and no other copy of the upload batch writes, unlike `update`
+     * it does not wait for the frames using the rest of the buffer.
+     */
+    void update_range(Span<uint8_t> view, size_t offset);
+
+    /**
+     * @brief Offset of the copy used by the current frame, always `0` for non dynamic buffers.
+     */
+    vk::DeviceSize offset() const;
 
     vk::Buffer buffer;
-    vk::DeviceMemory memory;
+    MemoryAllocation memory;
+
+    // Value of the graphics timeline signaled by the last frame reading the buffer.
+    uint64_t last_use = 0;
+
+    // Value of the graphics timeline signaled by the frame submitting the last staged upload to the buffer.
+    uint64_t last_upload = 0;
+
+    // Accesses of render graphs, kept between frames since submissions are executed in order. Stored in the buffer so
+    // a buffer allocated at the address of a destroyed one does not inherit its state.
+    BufferState barrier_state;
+
+    // Dynamic buffers contain `max_frames_in_flight` copies separated by `frame_stride` bytes.
+    bool dynamic;
+    size_t frame_stride;
+    bool coherent;
+
+private:
+    void stage(Span<uint8_t> view, size_t offset, bool ordered);
 };
 
 class TextureVulkan : public Texture
 {
 public:
-    TextureVulkan(vk::Image image, vk::DeviceMemory memory, vk::ImageView image_view, uint32_t width, uint32_t height, size_t size, vk::ImageAspectFlags aspect_mask, uint32_t layers, bool owned)
+    TextureVulkan(vk::Image image, MemoryAllocation memory, vk::ImageView image_view, uint32_t width, uint32_t height, size_t size, vk::ImageAspectFlags aspect_mask, uint32_t layers, bool owned)
         : image(image), memory(memory), image_view(image_view), size(size), aspect_mask(aspect_mask), layers(layers), owned(owned)
     {
         m_width = width;
@@ -221,8 +1073,14 @@ public:
     virtual void update(Span<uint8_t> view, uint32_t layer) override;
     virtual void transition_layout(TextureLayout new_layout) override;
 
+    /**
+     * @brief Build the barrier moving the texture to `new_layout` and remember the new layout. The stages the barrier
+     * waits on and blocks are added to `src_stage_mask` and `dst_stage_mask`.
+     */
+    vk::ImageMemoryBarrier transition_barrier(TextureLayout new_layout, vk::PipelineStageFlags& src_stage_mask, vk::PipelineStageFlags& dst_stage_mask);
+
     vk::Image image;
-    vk::DeviceMemory memory;
+    MemoryAllocation memory;
     vk::ImageView image_view;
     size_t size;
 
@@ -236,21 +1094,46 @@ public:
 class MeshVulkan : public Mesh
 {
 public:
-    MeshVulkan(IndexType index_type, vk::IndexType index_type_vk, size_t vertex_count, Ref<Buffer> index_buffer, Ref<Buffer> vertex_buffer, Ref<Buffer> normal_buffer, Ref<Buffer> uv_buffer)
-        : index_buffer(index_buffer), vertex_buffer(vertex_buffer), normal_buffer(normal_buffer), uv_buffer(uv_buffer), index_type_vk(index_type_vk)
+    MeshVulkan(IndexType index_type, vk::IndexType index_type_vk, size_t vertex_count)
+        : index_type_vk(index_type_vk)
     {
         this->m_index_type = index_type;
         this->m_vertex_count = vertex_count;
     }
 
-    Ref<Buffer> index_buffer;
-    Ref<Buffer> vertex_buffer;
-    Ref<Buffer> normal_buffer;
-    Ref<Buffer> uv_buffer;
+    virtual ~MeshVulkan();
+
+    /**
+     * @brief Index of the first index of the mesh in the index buffer of its page.
+     */
+    inline uint32_t first_index() const
+    {
+        return (uint32_t)(index_offset / size_of(m_index_type));
+    }
+
+    // Ranges of the mesh in its page of the mesh pool, vertices are counted in vertices and indices in bytes.
+    uint32_t page = 0;
+    uint32_t first_vertex = 0;
+    uint32_t page_vertex_count = 0;
+    uint64_t index_offset = 0;
+    uint64_t index_size = 0;
+
+    // Pulled meshes have no range in the pool, they only draw quads of the shared quad indices.
+    bool pulled = false;
+    uint32_t first_quad = 0;
+    uint32_t quad_count = 0;
+    uint32_t first_instance = 0;
 
     vk::IndexType index_type_vk;
 };
 
+/**
+ * @brief Allocate the descriptor sets of the materials of a layout.
+ *
+ * Each new pool holds twice as many sets as the previous one, so materials created at runtime rarely need a new pool.
+ * Sets of destroyed materials are kept in a free list and reused as they are once the frames which may read them are
+ * finished, they only go back to the driver with their pool.
+ */
 class DescriptorPool
 {
 public:
@@ -260,42 +1143,68 @@ public:
     [[nodiscard]]
     Expected<vk::DescriptorSet> allocate();
 
+    /**
+     * @brief Give back a set read by frames up to the value `last_use` of the graphics timeline.
+     */
+    void free(vk::DescriptorSet set, uint64_t last_use);
+
+    /**
+     * @brief Pools created so far, destroyed by the driver with the material layout.
+     */
+    inline const std::vector<vk::DescriptorPool>& pools() const
+    {
+        return m_pools;
+    }
+
     DescriptorPool() {}
 
 private:
     DescriptorPool(vk::DescriptorSetLayout layout, const std::vector<vk::DescriptorPoolSize>&& sizes)
-        : m_layout(layout), m_sizes(sizes), m_allocation_count(0)
+        : m_layout(layout), m_sizes(sizes)
     {
     }
 
     Expected<void> add_pool();
 
-    static constexpr uint32_t max_sets = 8;
+    static constexpr uint32_t initial_sets = 8;
+    static constexpr uint32_t max_sets_per_pool = 1024;
 
     vk::DescriptorSetLayout m_layout;
     std::vector<vk::DescriptorPool> m_pools;
+
+    // Descriptors of each type needed by a single set.
     std::vector<vk::DescriptorPoolSize> m_sizes;
-    uint32_t m_allocation_count;
+
+    // Sets left in the last pool, older pools are full.
+    uint32_t m_pool_sets = 0;
+    uint32_t m_pool_remaining = 0;
+
+    std::vector<vk::DescriptorSet> m_free;
+    // Sets given back with the timeline value after which they can be reused, in increasing order.
+    std::deque<std::pair<uint64_t, vk::DescriptorSet>> m_retired;
 };
 
 class MaterialLayoutVulkan : public MaterialLayout
 {
 public:
-    MaterialLayoutVulkan(vk::DescriptorSetLayout m_descriptor_set_layout, DescriptorPool descriptor_pool, std::vector<ShaderRef> shaders, std::optional<InstanceLayout> instance_layout, std::vector<MaterialParam> params, vk::PolygonMode polygon_mode, vk::CullModeFlags cull_mode, MaterialFlags flags, vk::PipelineLayout pipeline_layout, bool transparency, bool always_draw_before)
-        : m_descriptor_pool(descriptor_pool), m_descriptor_set_layout(m_descriptor_set_layout), m_shaders(shaders), m_instance_layout(instance_layout), m_params(params), m_polygon_mode(polygon_mode), m_cull_mode(cull_mode), m_flags(flags), m_pipeline_layout(pipeline_layout), m_transparency(transparency), m_always_draw_before(always_draw_before)
+    MaterialLayoutVulkan(vk::DescriptorSetLayout m_descriptor_set_layout, DescriptorPool descriptor_pool, std::vector<ShaderRef> shaders, VertexLayout vertex_layout, std::optional<InstanceLayout> instance_layout, std::vector<MaterialParam> params, vk::PolygonMode polygon_mode, vk::CullModeFlags cull_mode, MaterialFlags flags, vk::PipelineLayout pipeline_layout, bool transparency, bool always_draw_before)
+        : m_descriptor_pool(descriptor_pool), m_descriptor_set_layout(m_descriptor_set_layout), m_shaders(shaders), m_vertex_layout(vertex_layout), m_instance_layout(instance_layout), m_polygon_mode(polygon_mode), m_cull_mode(cull_mode), m_flags(flags), m_pipeline_layout(pipeline_layout), m_transparency(transparency), m_always_draw_before(always_draw_before)
     {
+        m_transparent = transparency;
+        m_drawn_first = always_draw_before;
+        m_instanced_view_matrix = flags.instanced_view_matrix;
+        m_params = params;
     }
 
-    std::optional<uint32_t> get_param_binding(const std::string& name);
-    std::optional<MaterialParam> get_param(const std::string& name);
+    ~MaterialLayoutVulkan();
 
     // private:
     DescriptorPool m_descriptor_pool;
     vk::DescriptorSetLayout m_descriptor_set_layout;
 
     std::vector<ShaderRef> m_shaders;
+    VertexLayout m_vertex_layout;
     std::optional<InstanceLayout> m_instance_layout;
-    std::vector<MaterialParam> m_params;
     vk::PolygonMode m_polygon_mode;
     vk::CullModeFlags m_cull_mode;
     MaterialFlags m_flags;
@@ -314,8 +1223,12 @@ public:
         m_layout = layout;
     }
 
-    virtual void set_param(const std::string& name, Ref<Texture>& texture) override;
-    virtual void set_param(const std::string& name, Ref<Buffer>& buffer) override;
+    ~MaterialVulkan();
+
+    using Material::set_param;
+
+    virtual void set_param(MaterialParamHandle param, Ref<Texture>& texture) override;
+    virtual void set_param(MaterialParamHandle param, Ref<Buffer>& buffer) override;
 
     vk::DescriptorSet descriptor_set;
 };
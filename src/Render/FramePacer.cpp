@@ -0,0 +1,45 @@
+#include "Render/FramePacer.hpp"
+
+#include <thread>
+
+void FramePacer::set_limit(uint32_t limit)
+{
+    m_frame_time = limit > 0 ? std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) / limit : Clock::duration::zero();
+    m_next_frame = Clock::now();
+}
+
+void FramePacer::wait()
+{
+    Clock::time_point now = Clock::now();
+
+    if (m_frame_time > Clock::duration::zero())
+    {
+        // A frame which ran late starts a new schedule, instead of rushing the next frames to catch up.
+        if (now - m_next_frame > m_frame_time)
+            m_next_frame = now;
+
+        if (m_next_frame - now > spin_duration)
+            std::this_thread::sleep_for(m_next_frame - now - spin_duration);
+
+        while ((now = Clock::now()) < m_next_frame)
+            std::this_thread::yield();
+
+        m_next_frame += m_frame_time;
+    }
+
+    if (m_last_frame != Clock::time_point())
+    {
+        // Exponential moving average and variance of the frame time.
+        const double frame_ms = std::chrono::duration<double, std::milli>(now - m_last_frame).count();
+
+        if (m_mean_ms == 0.0)
+            m_mean_ms = frame_ms;
+
+        const double delta = frame_ms - m_mean_ms;
+
+        m_mean_ms += stats_weight * delta;
+        m_variance_ms = (1.0 - stats_weight) * (m_variance_ms + stats_weight * delta * delta);
+    }
+
+    m_last_frame = now;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+struct FrameTimeStats
+{
+    /**
+     * @brief Average time between two frames in milliseconds.
+     */
+    double mean_ms = 0.0;
+
+    /**
+     * @brief Standard deviation of the time between two frames in milliseconds.
+     */
+    double deviation_ms = 0.0;
+};
+
+/**
+ * @brief Start frames at a steady rate by waiting until the next frame is due.
+ *
+ * Sleeping is only accurate to about a millisecond on most systems, so the pacer sleeps until shortly before the
+ * deadline and spins for the remaining time.
+ */
+class FramePacer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief Target `limit` frames per second. Set to `0` to remove the limit.
+     */
+    void set_limit(uint32_t limit);
+
+    /**
+     * @brief Wait until the next frame is due. Returns immediately when there is no limit.
+     */
+    void wait();
+
+    inline FrameTimeStats stats() const
+    {
+        return FrameTimeStats{.mean_ms = m_mean_ms, .deviation_ms = std::sqrt(m_variance_ms)};
+    }
+
+private:
+    // Time before the deadline at which the pacer stops sleeping and starts spinning.
+    static constexpr std::chrono::microseconds spin_duration = std::chrono::microseconds(2000);
+
+    // Weight of the last frame in the statistics.
+    static constexpr double stats_weight = 0.05;
+
+    Clock::duration m_frame_time = Clock::duration::zero();
+    Clock::time_point m_next_frame;
+    Clock::time_point m_last_frame;
+
+    double m_mean_ms = 0.0;
+    double m_variance_ms = 0.0;
+};
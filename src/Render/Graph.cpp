@@ -1,5 +1,23 @@
 #include "Render/Graph.hpp"
 #include "Core/Error.hpp"
+#include "Render/Driver.hpp"
+
+#include <algorithm>
+
+uint64_t make_sort_key(uint32_t pass, Mesh *mesh, Material *material, uint64_t sequence)
+{
+    constexpr uint64_t id_mask = SortIds::max_count - 1;
+
+    const MaterialLayout *layout = material->get_layout().ptr();
+    const uint64_t key = (uint64_t)(pass & 0xff) << 56;
+
+    if (layout->is_transparent())
+        return key | (uint64_t)2 << 54 | (sequence & ((1ull << 54) - 1));
+
+    const uint64_t layer = layout->is_drawn_first() ? 0 : 1;
+
+    return key | layer << 54 | (layout->sort_id() & id_mask) << 36 | (material->sort_id() & id_mask) << 18 | (mesh->sort_id() & id_mask);
+}
 
 RenderGraph::RenderGraph()
 {
@@ -7,8 +25,14 @@ RenderGraph::RenderGraph()
 
 void RenderGraph::reset()
 {
-    m_instructions.resize(0, {});
-    m_renderpass = true;
+    m_instructions.clear();
+    m_instance_ranges.clear();
+    m_push_constants.clear();
+    m_resource_uses.clear();
+    m_transient_buffers.clear();
+    m_renderpass = false;
+    m_pass_count = 0;
+    m_pass_start = 0;
 }
 
 Span<Instruction> RenderGraph::get_instructions() const
@@ -16,27 +40,225 @@ Span<Instruction> RenderGraph::get_instructions() const
     return m_instructions;
 }
 
+Span<InstanceRange> RenderGraph::get_instance_ranges() const
+{
+    return m_instance_ranges;
+}
+
+Span<PushConstants> RenderGraph::get_push_constants() const
+{
+    return m_push_constants;
+}
+
 void RenderGraph::begin_render_pass()
 {
-    m_instructions.push_back({.renderpass = {.kind = InstructionKind::BeginRenderPass}});
+    m_instructions.push_back({.renderpass = {.kind = InstructionKind::BeginRenderPass, .use_begin = (uint32_t)m_resource_uses.size(), .use_count = 0}});
     m_renderpass = true;
+    m_pass_instruction = m_instructions.size() - 1;
+    m_pass_start = m_instructions.size();
 }
 
 void RenderGraph::end_render_pass()
 {
     ERR_COND(!m_renderpass, "Not inside a renderpass");
+    sort_draws();
+    merge_draws();
+
     m_instructions.push_back({.kind = InstructionKind::EndRenderPass});
     m_renderpass = false;
+    m_pass_count += 1;
 }
 
-void RenderGraph::add_draw(Mesh *mesh, Material *material, glm::mat4 view_matrix, uint32_t instance_count, std::optional<Buffer *> instance_buffer)
+void RenderGraph::add_draw(Mesh *mesh, Material *material, glm::mat4 view_matrix, uint32_t instance_count, Buffer *instance_buffer)
 {
     ERR_COND(!m_renderpass, "Cannot draw outside of a renderpass");
-    m_instructions.push_back({.draw = {.kind = InstructionKind::Draw, .mesh = mesh, .material = material, .instance_count = instance_count, .instance_buffer = instance_buffer, .view_matrix = view_matrix}});
+    if (instance_buffer)
+        use_buffer(instance_buffer, ResourceUsage::Vertex);
+
+    // Most draws of a frame use the same camera.
+    if (m_push_constants.empty() || m_push_constants.back().view_matrix != view_matrix)
+        m_push_constants.push_back({.view_matrix = view_matrix});
+
+    const uint64_t sort_key = make_sort_key(m_pass_count, mesh, material, m_instructions.size() - m_pass_start);
+    m_instructions.push_back({.draw = {
+                                  .kind = InstructionKind::Draw,
+                                  .instance_count = instance_count,
+                                  .mesh = mesh,
+                                  .material = material,
+                                  .instance_buffer = instance_buffer,
+                                  .sort_key = sort_key,
+                                  .push_constants = (uint32_t)m_push_constants.size() - 1,
+                              }});
 }
 
 void RenderGraph::add_copy(Buffer *src, Buffer *dst, size_t size, size_t src_offset, size_t dst_offset)
 {
     ERR_COND(m_renderpass, "Cannot copy inside of a renderpass");
-    m_instructions.push_back({.copy = {.kind = InstructionKind::Copy, .src = src, .dst = dst, .src_offset = src_offset, .dst_offset = dst_offset, .size = size}});
+    ERR_COND_R(src_offset + size > src->size(), "Copy reads past the end of the source buffer");
+    ERR_COND_R(dst_offset + size > dst->size(), "Copy writes past the end of the destination buffer");
+
+    const uint32_t use_begin = (uint32_t)m_resource_uses.size();
+
+    m_resource_uses.push_back({.buffer = src, .texture = nullptr, .usage = ResourceUsage::CopySrc});
+    m_resource_uses.push_back({.buffer = dst, .texture = nullptr, .usage = ResourceUsage::CopyDst});
+
+    m_instructions.push_back({.copy = {.kind = InstructionKind::Copy, .use_begin = use_begin, .src = src, .dst = dst, .src_offset = src_offset, .dst_offset = dst_offset, .size = size, .use_count = 2}});
+}
+
+void RenderGraph::begin_range(const char *name)
+{
+    ERR_COND(m_renderpass, "Cannot begin a range inside of a renderpass");
+    m_instructions.push_back({.range = {.kind = InstructionKind::BeginRange, .name = name}});
+}
+
+void RenderGraph::end_range()
+{
+    ERR_COND(m_renderpass, "Cannot end a range inside of a renderpass");
+    m_instructions.push_back({.kind = InstructionKind::EndRange});
+}
+
+void RenderGraph::use_buffer(Buffer *buffer, ResourceUsage usage)
+{
+    ERR_COND(!m_renderpass, "Resources can only be declared inside of a renderpass");
+
+    m_resource_uses.push_back({.buffer = buffer, .texture = nullptr, .usage = usage});
+    m_instructions[m_pass_instruction].renderpass.use_count += 1;
+}
+
+void RenderGraph::use_texture(Texture *texture, ResourceUsage usage)
+{
+    ERR_COND(!m_renderpass, "Resources can only be declared inside of a renderpass");
+
+    m_resource_uses.push_back({.buffer = nullptr, .texture = texture, .usage = usage});
+    m_instructions[m_pass_instruction].renderpass.use_count += 1;
+}
+
+void RenderGraph::set_transient(Buffer *buffer)
+{
+    m_transient_buffers.push_back(buffer);
+}
+
+Span<ResourceUse> RenderGraph::get_resource_uses() const
+{
+    return m_resource_uses;
+}
+
+void RenderGraph::cull_passes(std::vector<bool>& culled) const
+{
+    culled.assign(m_instructions.size(), false);
+    m_needed_scratch.clear();
+
+    // Walk the passes backward, a pass is kept when something outside of the graph or a pass kept after it may read
+    // what it writes.
+    for (size_t i = m_instructions.size(); i-- > 0;)
+    {
+        const Instruction& instruction = m_instructions[i];
+
+        if (instruction.kind == InstructionKind::Copy)
+        {
+            Buffer *dst = instruction.copy.dst;
+
+            const bool transient = std::find(m_transient_buffers.begin(), m_transient_buffers.end(), dst) != m_transient_buffers.end();
+            const bool needed = std::find(m_needed_scratch.begin(), m_needed_scratch.end(), dst) != m_needed_scratch.end();
+
+            if (transient && !needed)
+            {
+                culled[i] = true;
+                continue;
+            }
+        }
+        else if (instruction.kind != InstructionKind::BeginRenderPass)
+        {
+            continue;
+        }
+
+        const uint32_t use_begin = instruction.kind == InstructionKind::Copy ? instruction.copy.use_begin : instruction.renderpass.use_begin;
+        const uint32_t use_count = instruction.kind == InstructionKind::Copy ? instruction.copy.use_count : instruction.renderpass.use_count;
+
+        for (uint32_t use = use_begin; use < use_begin + use_count; use++)
+        {
+            const ResourceUse& resource_use = m_resource_uses[use];
+
+            if (!is_write(resource_use.usage))
+                m_needed_scratch.push_back(resource_use.buffer ? (const void *)resource_use.buffer : (const void *)resource_use.texture);
+        }
+    }
+}
+
+void RenderGraph::sort_draws()
+{
+    // Sort the keys first and move the instructions once, instead of swapping whole instructions around.
+    m_sort_scratch.clear();
+
+    for (size_t i = m_pass_start; i < m_instructions.size(); i++)
+        m_sort_scratch.push_back({m_instructions[i].draw.sort_key, (uint32_t)i});
+
+    if (std::is_sorted(m_sort_scratch.begin(), m_sort_scratch.end()))
+        return;
+
+    std::sort(m_sort_scratch.begin(), m_sort_scratch.end());
+
+    m_instruction_scratch.clear();
+
+    for (const auto& [key, index] : m_sort_scratch)
+        m_instruction_scratch.push_back(m_instructions[index]);
+
+    std::copy(m_instruction_scratch.begin(), m_instruction_scratch.end(), m_instructions.begin() + (ssize_t)m_pass_start);
+}
+
+static bool can_merge(const Instruction& a, const Instruction& b, Span<PushConstants> push_constants)
+{
+    if (a.draw.mesh != b.draw.mesh || a.draw.material != b.draw.material || !a.draw.instance_buffer != !b.draw.instance_buffer)
+        return false;
+
+    // Each instance is given the view matrix of its draw.
+    if (a.draw.material->get_layout()->has_instanced_view_matrix())
+        return true;
+
+    // Instances without instance data could not be told apart.
+    if (!a.draw.instance_buffer)
+        return false;
+
+    return a.draw.push_constants == b.draw.push_constants || push_constants[a.draw.push_constants].view_matrix == push_constants[b.draw.push_constants].view_matrix;
+}
+
+void RenderGraph::merge_draws()
+{
+    // Sorting puts draws of the same mesh and material next to each other, runs of them are merged into a single
+    // instanced draw. The driver gathers the instances of every range into one buffer.
+    size_t write = m_pass_start;
+
+    for (size_t read = m_pass_start; read < m_instructions.size();)
+    {
+        size_t end = read + 1;
+
+        while (end < m_instructions.size() && can_merge(m_instructions[read], m_instructions[end], m_push_constants))
+            end += 1;
+
+        Instruction instruction = m_instructions[read];
+
+        // Materials reading the view matrix per instance need it gathered even for a single draw.
+        if (end - read > 1 || instruction.draw.material->get_layout()->has_instanced_view_matrix())
+        {
+            // The instances come from the ranges, the buffer of the first draw only holds a part of them.
+            instruction.draw.instance_buffer = nullptr;
+            instruction.draw.range_begin = (uint32_t)m_instance_ranges.size();
+            instruction.draw.range_count = (uint32_t)(end - read);
+            instruction.draw.instance_count = 0;
+
+            for (size_t i = read; i < end; i++)
+            {
+                const auto& draw = m_instructions[i].draw;
+
+                m_instance_ranges.push_back({.buffer = draw.instance_buffer, .instance_count = draw.instance_count, .push_constants = draw.push_constants});
+                instruction.draw.instance_count += draw.instance_count;
+            }
+        }
+
+        m_instructions[write] = instruction;
+        write += 1;
+        read = end;
+    }
+
+    m_instructions.erase(m_instructions.begin() + (ssize_t)write, m_instructions.end());
 }
@@ -5,6 +5,7 @@
 #include <glm/matrix.hpp>
 
 class Buffer;
+class Texture;
 class Mesh;
 class Material;
 
@@ -14,6 +15,38 @@ enum class InstructionKind : uint8_t
     EndRenderPass,
     Draw,
     Copy,
+    BeginRange,
+    EndRange,
+};
+
+/**
+ * @brief How a pass uses a resource, used to infer the barriers between passes.
+ */
+enum class ResourceUsage : uint8_t
+{
+    Vertex,
+    Index,
+    Uniform,
+    Sampled,
+    CopySrc,
+    CopyDst,
+    ColorAttachment,
+    DepthAttachment,
+};
+
+inline bool is_write(ResourceUsage usage)
+{
+    return usage == ResourceUsage::CopyDst || usage == ResourceUsage::ColorAttachment || usage == ResourceUsage::DepthAttachment;
+}
+
+/**
+ * @brief A buffer or a texture used by a pass, only one of them is set.
+ */
+struct ResourceUse
+{
+    Buffer *buffer = nullptr;
+    Texture *texture = nullptr;
+    ResourceUsage usage;
 };
 
 union Instruction
@@ -22,26 +55,61 @@ union Instruction
     struct
     {
         InstructionKind kind;
+
+        // Resources used by the pass, indices in `RenderGraph::get_resource_uses`.
+        uint32_t use_begin;
+        uint32_t use_count;
     } renderpass;
     struct
     {
         InstructionKind kind;
+        uint32_t instance_count;
         Mesh *mesh;
         Material *material;
-        size_t instance_count;
-        std::optional<Buffer *> instance_buffer;
-        glm::mat4 view_matrix;
-        ;
+
+        // Per-instance data, `nullptr` when the draw has no instance buffer or its instances come from ranges.
+        Buffer *instance_buffer;
+        uint64_t sort_key;
+
+        // Index in `RenderGraph::get_push_constants`.
+        uint32_t push_constants;
+
+        // Draws merged into this one, indices in `RenderGraph::get_instance_ranges`. Draws of materials using
+        // `MaterialFlags::instanced_view_matrix` always have their ranges, even when nothing was merged.
+        uint32_t range_begin;
+        uint32_t range_count;
     } draw;
     struct
     {
         InstructionKind kind;
+        uint32_t use_begin;
         Buffer *src;
         Buffer *dst;
         size_t src_offset;
         size_t dst_offset;
         size_t size;
+        uint32_t use_count;
     } copy;
+    struct
+    {
+        InstructionKind kind;
+        const char *name;
+    } range;
+};
+
+static_assert(sizeof(Instruction) <= 56, "instructions are stored for every draw, keep them small");
+
+/**
+ * @brief Instances of a draw merged with others, the instances are read from the start of `buffer` when the draw had
+ * an instance buffer.
+ */
+struct InstanceRange
+{
+    Buffer *buffer;
+    uint32_t instance_count;
+
+    // Index in `RenderGraph::get_push_constants`, the view matrix of the instances.
+    uint32_t push_constants;
 };
 
 struct PushConstants
@@ -49,6 +117,15 @@ struct PushConstants
     glm::mat4 view_matrix;
 };
 
+/**
+ * @brief Build the key ordering draws inside a render pass.
+ *
+ * From the most to the least significant bits: the pass (8 bits), the layer (2 bits), then the material layout, the
+ * material and the mesh (18 bits each). Transparent draws keep their submission order instead, since they must be
+ * blended back to front.
+ */
+uint64_t make_sort_key(uint32_t pass, Mesh *mesh, Material *material, uint64_t sequence);
+
 class RenderGraph
 {
 public:
@@ -56,14 +133,70 @@ public:
 
     void reset();
     Span<Instruction> get_instructions() const;
+    Span<InstanceRange> get_instance_ranges() const;
+
+    /**
+     * @brief Push constants of the draws. Consecutive draws with the same push constants share them.
+     */
+    Span<PushConstants> get_push_constants() const;
 
     void begin_render_pass();
     void end_render_pass();
 
-    void add_draw(Mesh *mesh, Material *material, glm::mat4 view_matrix = {}, uint32_t instance_count = 1, std::optional<Buffer *> instance_buffer = {});
+    void add_draw(Mesh *mesh, Material *material, glm::mat4 view_matrix = {}, uint32_t instance_count = 1, Buffer *instance_buffer = nullptr);
     void add_copy(Buffer *src, Buffer *dst, size_t size, size_t src_offset = 0, size_t dst_offset = 0);
 
+    /**
+     * @brief Group the following passes under `name` in GPU timings. Ranges can be nested but cannot start or end
+     * inside of a render pass, since draws are reordered. `name` is kept until the timings are read back, frames later,
+     * so it should be a string literal.
+     */
+    void begin_range(const char *name);
+    void end_range();
+
+    /**
+     * @brief Declare a resource used by the current render pass. Instance buffers of draws are declared automatically.
+     */
+    void use_buffer(Buffer *buffer, ResourceUsage usage);
+    void use_texture(Texture *texture, ResourceUsage usage);
+
+    /**
+     * @brief The content of the buffer is only needed while the graph executes. Passes writing it are culled when
+     * nothing reads it afterwards.
+     */
+    void set_transient(Buffer *buffer);
+
+    Span<ResourceUse> get_resource_uses() const;
+
+    /**
+     * @brief Find the passes which can be skipped, `culled[i]` is set for the first instruction `i` of those passes.
+     *
+     * Render passes always write the output of the frame so they are never culled.
+     */
+    void cull_passes(std::vector<bool>& culled) const;
+
 private:
+    // Cleared but never shrunk by `reset`, a graph rebuilt every frame stops allocating once it reached its largest size.
     std::vector<Instruction> m_instructions;
     bool m_renderpass;
+
+    uint32_t m_pass_count = 0;
+    size_t m_pass_start = 0;
+
+    // Reused between frames to sort draws without allocating.
+    std::vector<std::pair<uint64_t, uint32_t>> m_sort_scratch;
+    std::vector<Instruction> m_instruction_scratch;
+
+    std::vector<InstanceRange> m_instance_ranges;
+    std::vector<PushConstants> m_push_constants;
+
+    std::vector<ResourceUse> m_resource_uses;
+    std::vector<Buffer *> m_transient_buffers;
+    size_t m_pass_instruction = 0;
+
+    // Resources read by the passes kept alive, reused by `cull_passes`.
+    mutable std::vector<const void *> m_needed_scratch;
+
+    void sort_draws();
+    void merge_draws();
 };
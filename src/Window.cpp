@@ -12,14 +12,30 @@ Window::Window(const std::string& title, uint32_t width, uint32_t height, bool r
     m_window = SDL_CreateWindow(title.c_str(), (int)width, (int)height, flags);
 }
 
+Window::Window(uint32_t width, uint32_t height)
+    : m_headless_size{.width = width, .height = height}
+{
+}
+
+Window Window::headless(uint32_t width, uint32_t height)
+{
+    return Window(width, height);
+}
+
 Window::~Window()
 {
+    if (!m_window)
+        return;
+
     SDL_DestroyWindow(m_window);
     SDL_Quit();
 }
 
 WindowSize Window::size() const
 {
+    if (!m_window)
+        return m_headless_size;
+
     int w = 0, h = 0;
     SDL_GetWindowSizeInPixels(m_window, &w, &h);
     return {.width = (uint32_t)w, .height = (uint32_t)h};
@@ -29,7 +45,7 @@ std::optional<SDL_Event> Window::poll_event() const
 {
     SDL_Event event;
 
-    if (SDL_PollEvent(&event))
+    if (m_window && SDL_PollEvent(&event))
         return event;
     else
         return std::nullopt;
@@ -37,7 +53,8 @@ std::optional<SDL_Event> Window::poll_event() const
 
 void Window::set_fullscreen(bool f)
 {
-    SDL_SetWindowFullscreen(m_window, f);
+    if (m_window)
+        SDL_SetWindowFullscreen(m_window, f);
 }
 
 void Window::close()
@@ -16,6 +16,12 @@ public:
     Window(const std::string& title, uint32_t width, uint32_t height, bool resizable = true);
     ~Window();
 
+    /**
+     * @brief Create a window without any SDL window behind it, SDL is not even initialized. It never receives events
+     * and is meant to be used with `RenderingDriverNull`, or with `RenderingDriverVulkan` rendering offscreen.
+     */
+    static Window headless(uint32_t width, uint32_t height);
+
     WindowSize size() const;
 
     [[nodiscard]]
@@ -29,12 +35,20 @@ public:
         return m_running;
     }
 
+    inline bool is_headless() const
+    {
+        return m_window == nullptr;
+    }
+
     inline SDL_Window *get_window_ptr() const
     {
         return m_window;
     }
 
 private:
-    SDL_Window *m_window;
+    SDL_Window *m_window = nullptr;
+    WindowSize m_headless_size;
     bool m_running = true;
+
+    Window(uint32_t width, uint32_t height);
 };
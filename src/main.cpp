@@ -1,31 +1,20 @@
-#include "MeshPrimitives.hpp"
+#include "Chunk.hpp"
 #include "Render/Driver.hpp"
+#include "Render/DriverNull.hpp"
 #include "Render/DriverVulkan.hpp"
 #include "Window.hpp"
 
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/vec4.hpp>
 #include <tracy/Tracy.hpp>
 
 #include <SDL3_image/SDL_image.h>
 
+#include <cstring>
 #include <print>
 
-struct BlockInstanceData
-{
-    glm::vec3 position;
-    glm::vec3 textures0;
-    glm::vec3 textures1;
-    uint8_t visibility;
-    uint8_t gradient;
-    uint8_t gradient_type;
-    uint8_t pad = 0;
-};
-
 int main(int argc, char *argv[])
 {
-    (void)argc;
-    (void)argv;
-
     initialize_error_handling(argv[0]);
 
     tracy::SetThreadName("Main");
@@ -33,27 +22,54 @@ int main(int argc, char *argv[])
     static const int width = 1280;
     static const int height = 720;
 
-    Window window("ft_vox", width, height);
+    // Without a GPU nor a display, a fixed number of frames is built and consumed by the null driver. Offscreen, the
+    // frames are rendered by Vulkan without a display and the last one can be saved with `--offscreen <file.png>`.
+    static const size_t headless_frame_count = 10'000;
+    static const size_t offscreen_frame_count = 100;
+    const bool headless = argc > 1 && std::strcmp(argv[1], "--headless") == 0;
+    const bool offscreen = argc > 1 && std::strcmp(argv[1], "--offscreen") == 0;
+    const char *offscreen_output = offscreen && argc > 2 ? argv[2] : nullptr;
+
+    Window window = headless || offscreen ? Window::headless(width, height) : Window("ft_vox", width, height);
 
-    RenderingDriver::create_singleton<RenderingDriverVulkan>();
+    if (headless)
+        RenderingDriver::create_singleton<RenderingDriverNull>();
+    else
+        RenderingDriver::create_singleton<RenderingDriverVulkan>();
 
     auto init_result = RenderingDriver::get()->initialize(window);
     EXPECT(init_result);
 
-    auto instance_buffer_result = RenderingDriver::get()->create_buffer(sizeof(BlockInstanceData) * 1, {.copy_dst = true, .vertex = true});
-    EXPECT(instance_buffer_result);
-    Ref<Buffer> instance_buffer = instance_buffer_result->ptr();
-
-    BlockInstanceData block_instance{
-        .position = glm::vec3(0.0, 0.0, -3.0),
-        .textures0 = glm::vec3(0.0, 0.0, 0.0),
-        .textures1 = glm::vec3(0.0, 0.0, 0.0),
-        .visibility = 0xff,
-        .gradient = 0,
-        .gradient_type = 0,
-    };
-    Span<BlockInstanceData> span{block_instance};
-    instance_buffer->update(span.as_bytes());
+    // A flat patch of terrain, only the faces next to air are kept so the vertex shader never runs for hidden ones.
+    Chunk chunk(glm::ivec3(-16, -8, -48));
+
+    for (uint32_t y = 0; y < 4; y++)
+    {
+        for (uint32_t z = 0; z < Chunk::size; z++)
+        {
+            for (uint32_t x = 0; x < Chunk::size; x++)
+                chunk.set_block(x, y, z, 1);
+        }
+    }
+
+    // The faces of every chunk are pulled by `voxel.vert` from one buffer, the instance index selects the origin of
+    // the chunk.
+    std::vector<uint32_t> faces;
+    const size_t face_count = chunk.build_faces(faces);
+
+    std::println("info: {} visible faces out of {}", face_count, Chunk::size * Chunk::size * 4 * 6);
+
+    std::array<glm::ivec4, 1> chunk_origins{glm::ivec4(chunk.origin(), 0)};
+
+    Span<uint32_t> faces_span = faces;
+    auto face_buffer_result = RenderingDriver::get()->create_buffer_from_data(faces.size() * sizeof(uint32_t), faces_span.as_bytes(), {.copy_dst = true, .storage = true});
+    EXPECT(face_buffer_result);
+    Ref<Buffer> face_buffer = face_buffer_result.value();
+
+    Span<glm::ivec4> chunk_origins_span = chunk_origins;
+    auto chunk_buffer_result = RenderingDriver::get()->create_buffer_from_data(sizeof(chunk_origins), chunk_origins_span.as_bytes(), {.copy_dst = true, .storage = true});
+    EXPECT(chunk_buffer_result);
+    Ref<Buffer> chunk_buffer = chunk_buffer_result.value();
 
     auto texture_array_result = RenderingDriver::get()->create_texture_array(16, 16, TextureFormat::RGBA8Srgb, {.copy_dst = true, .sampled = true}, 1);
     EXPECT(texture_array_result);
@@ -75,34 +91,41 @@ int main(int argc, char *argv[])
     }
 
     std::array<ShaderRef, 2> shaders{ShaderRef("assets/shaders/voxel.vert.spv", ShaderKind::Vertex), ShaderRef("assets/shaders/voxel.frag.spv", ShaderKind::Fragment)};
-    std::array<MaterialParam, 1> params{MaterialParam::image(ShaderKind::Fragment, "textures", {.min_filter = Filter::Nearest, .mag_filter = Filter::Nearest})};
-    std::array<InstanceLayoutInput, 4> inputs{
-        InstanceLayoutInput{.type = ShaderType::Vec3, .offset = 0},
-        InstanceLayoutInput{.type = ShaderType::Vec3, .offset = sizeof(glm::vec3)},
-        InstanceLayoutInput{.type = ShaderType::Vec3, .offset = sizeof(glm::vec3) * 2},
-        InstanceLayoutInput{.type = ShaderType::Uint, .offset = sizeof(glm::vec3) * 3},
+    std::array<MaterialParam, 3> params{
+        MaterialParam::image(ShaderKind::Fragment, "textures", {.min_filter = Filter::Nearest, .mag_filter = Filter::Nearest}),
+        MaterialParam::storage_buffer(ShaderKind::Vertex, "faces"),
+        MaterialParam::storage_buffer(ShaderKind::Vertex, "chunks"),
     };
-    auto material_layout_result = RenderingDriverVulkan::get()->create_material_layout(shaders, params, {.transparency = true}, InstanceLayout(inputs, sizeof(BlockInstanceData)), CullMode::None, PolygonMode::Fill, true, false);
+    auto material_layout_result = RenderingDriver::get()->create_material_layout(shaders, params, {.transparency = true, .vertex_pulling = true, .instanced_view_matrix = true}, std::nullopt, CullMode::None, PolygonMode::Fill, true, false);
     EXPECT(material_layout_result);
     Ref<MaterialLayout> material_layout = material_layout_result.value();
 
-    auto material_result = RenderingDriverVulkan::get()->create_material(material_layout.ptr());
+    auto material_result = RenderingDriver::get()->create_material(material_layout.ptr());
     EXPECT(material_result);
     Ref<Material> material = material_result.value();
 
-    material->set_param("textures", texture_array);
+    const MaterialParamHandle textures_param = material_layout->find_param("textures");
+    material->set_param(textures_param, texture_array);
+    material->set_param(material_layout->find_param("faces"), face_buffer);
+    material->set_param(material_layout->find_param("chunks"), chunk_buffer);
 
-    auto cube_result = create_cube_with_separate_faces(glm::vec3(1.0)); // create_cube_with_separate_faces(glm::vec3(1.0), glm::vec3(-0.5));
-    EXPECT(cube_result);
-    Ref<Mesh> cube = cube_result.value();
+    // A chunk only references its range of faces, all chunks are drawn with the same pipeline and buffers.
+    auto chunk_mesh_result = RenderingDriver::get()->create_pulled_mesh(0, (uint32_t)face_count, 0);
+    EXPECT(chunk_mesh_result);
+    Ref<Mesh> chunk_mesh = chunk_mesh_result.value();
 
     RenderGraph graph;
 
     glm::mat4 view_matrix = glm::perspective(glm::radians(70.0), 1920.0 / 720.0, 0.01, 10'000.0);
     view_matrix[1][1] *= -1;
 
+    size_t frame_count = 0;
+    const auto start_time = std::chrono::steady_clock::now();
+
     while (window.is_running())
     {
+        RenderingDriver::get()->begin_frame();
+
         std::optional<SDL_Event> event;
 
         while ((event = window.poll_event()))
@@ -120,9 +143,42 @@ int main(int argc, char *argv[])
         graph.reset();
 
         graph.begin_render_pass();
-        graph.add_draw(cube.ptr(), material.ptr(), glm::mat4(1.0), 1, instance_buffer.ptr());
+        graph.add_draw(chunk_mesh.ptr(), material.ptr(), glm::mat4(1.0));
         graph.end_render_pass();
 
+        // Only the last frame is copied back, the others are not slowed down by the readback.
+        if (offscreen_output && frame_count + 1 == offscreen_frame_count)
+            RenderingDriverVulkan::get()->request_readback();
+
         RenderingDriver::get()->draw_graph(graph);
+
+        frame_count += 1;
+
+        if ((headless && frame_count == headless_frame_count) || (offscreen && frame_count == offscreen_frame_count))
+            window.close();
+    }
+
+    if (offscreen_output)
+    {
+        std::optional<FrameReadback> readback = RenderingDriverVulkan::get()->get_readback();
+        SDL_Surface *surface = nullptr;
+
+        if (readback.has_value())
+            surface = SDL_CreateSurfaceFrom((int)readback->width, (int)readback->height, SDL_PIXELFORMAT_BGRA32, (void *)readback->pixels.data(), (int)readback->width * 4);
+
+        if (surface && IMG_SavePNG(surface, offscreen_output))
+            std::println("info: Frame {} saved to `{}`", readback->frame, offscreen_output);
+        else
+            std::println(stderr, "error: Cannot save the last frame to `{}`", offscreen_output);
+
+        SDL_DestroySurface(surface);
+    }
+
+    if (headless || offscreen)
+    {
+        const double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+        const FrameTimeStats stats = RenderingDriver::get()->get_frame_time_stats();
+
+        std::println("info: {} frames in {:.2f} ms, {:.4f} ms per frame (deviation {:.4f} ms)", frame_count, elapsed_ms, elapsed_ms / (double)frame_count, stats.deviation_ms);
     }
 }